@@ -33,6 +33,7 @@
 #include "aes.h"
 
 #include <string.h>
+#include <pthread.h>
 
 /*
  * 32-bit integer manipulation macros (little endian)
@@ -87,7 +88,8 @@ static unsigned long RCON[10];
 #define XTIME(x) ( ( x << 1 ) ^ ( ( x & 0x80 ) ? 0x1B : 0x00 ) )
 #define MUL(x,y) ( ( x && y ) ? pow[(log[x]+log[y]) % 255] : 0 )
 
-static int aes_init_done = 0;
+/* lrzip sets keys from many threads at once; the tables are built once */
+static pthread_once_t aes_init_once = PTHREAD_ONCE_INIT;
 
 static void aes_gen_tables( void )
 {
@@ -174,11 +176,7 @@ int aes_setkey_enc( aes_context *ctx, const unsigned char *key, int keysize )
     unsigned long *RK;
 
 #if !defined(POLARSSL_AES_ROM_TABLES)
-    if( aes_init_done == 0 )
-    {
-        aes_gen_tables();
-        aes_init_done = 1;
-    }
+    pthread_once( &aes_init_once, aes_gen_tables );
 #endif
 
     switch( keysize )
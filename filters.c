@@ -29,6 +29,7 @@
 #include <inttypes.h>
 
 #include "filters.h"
+#include "stream.h"
 #include "util.h"
 #include "lzma/C/LzmaLib.h"
 #include "lzma/C/Bra.h"
@@ -90,6 +91,156 @@ void lrz_filter_convert_mem(uchar *buf, i64 len, int kind, bool encode)
 	lrz_filter_stream_conv(&fs, buf, len, true);
 }
 
+void lrz_filter_par_init(rzip_control *control, struct lrz_filter_par *fp, uchar *buf,
+			 i64 len, int kind, bool encode)
+{
+	i64 slice_len, ofs = 0;
+	int n = 1, i;
+
+	fp->control = control;
+	fp->buf = buf;
+	fp->kind = kind;
+	fp->encode = encode;
+	fp->slice = NULL;
+	/* Delta carries its history across the whole region */
+	if (kind == LRZ_FILTER_X86 || kind == LRZ_FILTER_ARM64)
+		n = MAX(1, MIN((i64)control->threads, len / LRZ_FILTER_SLICE_MIN));
+	if (n > 1)
+		fp->slice = calloc(n, sizeof(struct lrz_filter_slice));
+	if (!fp->slice) {
+		fp->slice = &fp->one;
+		memset(&fp->one, 0, sizeof(fp->one));
+		n = 1;
+	}
+	fp->slices = n;
+	/* Whole arm64 instruction words per slice */
+	slice_len = (len / n) & ~(i64)3;
+	for (i = 0; i < n; i++) {
+		struct lrz_filter_slice *sl = &fp->slice[i];
+
+		sl->fp = fp;
+		sl->buf = buf + ofs;
+		sl->len = i == n - 1 ? len - ofs : slice_len;
+		sl->last = i == n - 1;
+		ofs += sl->len;
+	}
+}
+
+static void filter_slice_conv(struct lrz_filter_slice *sl)
+{
+	struct lrz_filter_stream fs;
+
+	lrz_filter_stream_init(&fs, sl->fp->kind, sl->fp->encode);
+	fs.pc = sl->buf - sl->fp->buf;
+	sl->done = lrz_filter_stream_conv(&fs, sl->buf, sl->len, sl->last);
+	sl->x86_state = fs.x86_state;
+}
+
+static void *filter_slice_thread(void *data)
+{
+	filter_slice_conv(data);
+	return NULL;
+}
+
+void lrz_filter_par_run(struct lrz_filter_par *fp, int n)
+{
+	struct lrz_filter_slice *sl = &fp->slice[n];
+
+	if (fp->slices == 1) {
+		filter_slice_conv(sl);
+		return;
+	}
+	if (n)
+		memcpy(sl->head, sl->buf, MIN(sl->len, LRZ_FILTER_SYNC));
+	/* A slice that gets no thread is converted here instead */
+	sl->threaded = create_pthread(fp->control, &sl->thread, NULL, filter_slice_thread, sl);
+	if (!sl->threaded)
+		filter_slice_conv(sl);
+}
+
+/* Redo the start of slice sl from pc, where the slice before it really
+ * stopped with state, using the bytes left unconverted there and the
+ * original head of sl. If both ways of converting it stop at the same place
+ * in the same state, the rest of the slice is right as it is. Otherwise
+ * the slice is converted back and done again from pc. Returns where the
+ * region is converted up to and updates state. */
+static i64 filter_mend(struct lrz_filter_par *fp, struct lrz_filter_slice *sl,
+		       i64 pc, u32 *state)
+{
+	i64 ofs = sl->buf - fp->buf, tail = ofs - pc, head = MIN(sl->len, LRZ_FILTER_SYNC);
+	uchar real[LRZ_FILTER_SYNC + 16], guess[LRZ_FILTER_SYNC];
+	struct lrz_filter_stream rs, gs;
+	i64 rdone, gdone;
+	rzip_control *control = fp->control;
+
+	/* The converter leaves at most an instruction behind */
+	if (unlikely(tail > 16))
+		goto redo;
+	memcpy(real, fp->buf + pc, tail);
+	memcpy(real + tail, sl->head, head);
+	lrz_filter_stream_init(&rs, fp->kind, fp->encode);
+	rs.pc = pc;
+	rs.x86_state = *state;
+	if (sl->last && head == sl->len) {
+		lrz_filter_stream_conv(&rs, real, tail + head, true);
+		memcpy(fp->buf + pc, real, tail + head);
+		return ofs + sl->len;
+	}
+	rdone = lrz_filter_stream_conv(&rs, real, tail + head, false);
+
+	memcpy(guess, sl->head, head);
+	lrz_filter_stream_init(&gs, fp->kind, fp->encode);
+	gs.pc = ofs;
+	gdone = lrz_filter_stream_conv(&gs, guess, head, false);
+
+	if (pc + rdone == ofs + gdone && rs.x86_state == gs.x86_state) {
+		memcpy(fp->buf + pc, real, rdone);
+		*state = sl->x86_state;
+		return ofs + sl->done;
+	}
+
+redo:
+	print_maxverbose("Filter slice at %"PRId64" out of step, converting it in order\n", ofs);
+	lrz_filter_stream_init(&gs, fp->kind, !fp->encode);
+	gs.pc = ofs;
+	lrz_filter_stream_conv(&gs, sl->buf, sl->len, sl->last);
+	lrz_filter_stream_init(&rs, fp->kind, fp->encode);
+	rs.pc = pc;
+	rs.x86_state = *state;
+	rdone = lrz_filter_stream_conv(&rs, fp->buf + pc, ofs + sl->len - pc, sl->last);
+	*state = rs.x86_state;
+	return pc + rdone;
+}
+
+bool lrz_filter_par_finish(struct lrz_filter_par *fp)
+{
+	rzip_control *control = fp->control;
+	bool ret = true;
+	i64 pc;
+	u32 state;
+	int i;
+
+	for (i = 0; i < fp->slices; i++) {
+		if (fp->slice[i].threaded && unlikely(!join_pthread(control, fp->slice[i].thread, NULL)))
+			ret = false;
+	}
+	if (fp->slices == 1 || !ret)
+		goto out;
+
+	/* Arm64 words never cross a slice, only x86 seams need mending */
+	if (fp->kind == LRZ_FILTER_X86) {
+		pc = fp->slice[0].done;
+		state = fp->slice[0].x86_state;
+		for (i = 1; i < fp->slices; i++)
+			pc = filter_mend(fp, &fp->slice[i], pc, &state);
+	}
+	print_maxverbose("Filter converted %d slices in parallel\n", fp->slices);
+out:
+	if (fp->slice != &fp->one)
+		dealloc(fp->slice);
+	return ret;
+}
+
 int lrz_filter_trial(rzip_control *control, uchar *sample_area, i64 avail)
 {
 	unsigned char props[5];
@@ -52,6 +52,45 @@ void lrz_filter_stream_init(struct lrz_filter_stream *fs, int kind, bool encode)
 i64 lrz_filter_stream_conv(struct lrz_filter_stream *fs, uchar *buf, i64 len, bool last);
 /* One shot in place conversion of a whole region */
 void lrz_filter_convert_mem(uchar *buf, i64 len, int kind, bool encode);
+
+/* The same conversion of a large region split into slices converted by up
+ * to control->threads threads. Each slice starts as if it began the region;
+ * as x86 conversion depends on where the instructions before it end, the
+ * first LRZ_FILTER_SYNC original bytes of a slice are kept so that finish
+ * can redo the seam with the real state of the slice before, or the whole
+ * slice in order if the two do not line up by then. */
+#define LRZ_FILTER_SYNC 4096
+#define LRZ_FILTER_SLICE_MIN (1 << 20)
+
+struct lrz_filter_slice {
+	struct lrz_filter_par *fp;
+	uchar *buf;
+	i64 len;
+	i64 done;	/* converted, the rest is left to the next slice */
+	u32 x86_state;
+	bool last;
+	pthread_t thread;
+	bool threaded;
+	uchar head[LRZ_FILTER_SYNC];
+};
+
+struct lrz_filter_par {
+	rzip_control *control;
+	uchar *buf;
+	int kind;
+	bool encode;
+	int slices;
+	struct lrz_filter_slice *slice;
+	struct lrz_filter_slice one;	/* when the region is not split */
+};
+
+/* Split buf[0..len) into fp->slices slices, at least one */
+void lrz_filter_par_init(rzip_control *control, struct lrz_filter_par *fp, uchar *buf,
+			 i64 len, int kind, bool encode);
+/* Start converting slice n, in order; the caller is done with its bytes */
+void lrz_filter_par_run(struct lrz_filter_par *fp, int n);
+/* Wait for every slice and mend the seams between them */
+bool lrz_filter_par_finish(struct lrz_filter_par *fp);
 /* Trial compress a sample plain and converted with each candidate filter;
  * returns the winning LRZ_FILTER_* or LRZ_FILTER_NONE. */
 int lrz_filter_trial(rzip_control *control, uchar *sample_area, i64 avail);
@@ -6,11 +6,20 @@
  * packaging is GPL-2+ to match lrzip.
  */
 
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
 #include "gcm.h"
 #include "aes.h"
 
 #include <string.h>
 
+#ifdef HAVE_AESNI_INTRIN
+# include <wmmintrin.h>
+# include <tmmintrin.h>
+#endif
+
 static void xor_block(unsigned char *d, const unsigned char *a,
 		      const unsigned char *b)
 {
@@ -153,6 +162,313 @@ static int gcm_prepare(aes_context *ctx, const unsigned char *key, int keybits,
 	return 0;
 }
 
+#ifdef HAVE_AESNI_INTRIN
+/*
+ * AES-NI and PCLMULQDQ kernels for AES-256-GCM. They are compiled for those
+ * instructions only and used after a runtime CPU check, so one binary still
+ * runs everywhere on the table code above. GHASH works on byte reversed
+ * blocks as in Intel's carry-less multiplication white paper, four blocks
+ * per reduction against H^4..H; the counter is kept byte reversed so that
+ * inc32 is a single 32-bit add on the low lane.
+ */
+#define GCM_HW __attribute__((target("aes,pclmul,ssse3")))
+
+/* Bulk data is encrypted and hashed this many bytes at a time so the
+ * second pass over it still hits L1. */
+#define GCM_HW_SPAN	4096
+
+struct gcm_hw {
+	__m128i rk[15];		/* AES-256 round keys */
+	__m128i h[4];		/* H, H^2, H^3, H^4 byte reversed */
+	__m128i bswap;
+};
+
+GCM_HW static __m128i hw_key_step(__m128i t1, __m128i t2)
+{
+	__m128i t4;
+
+	t4 = _mm_slli_si128(t1, 4);
+	t1 = _mm_xor_si128(t1, t4);
+	t4 = _mm_slli_si128(t4, 4);
+	t1 = _mm_xor_si128(t1, t4);
+	t4 = _mm_slli_si128(t4, 4);
+	t1 = _mm_xor_si128(t1, t4);
+	return _mm_xor_si128(t1, t2);
+}
+
+/* aeskeygenassist needs its round constant as an immediate. */
+#define HW_KEY_PAIR(rk, i, rcon) do { \
+	rk[i] = hw_key_step(rk[i - 2], _mm_shuffle_epi32( \
+		_mm_aeskeygenassist_si128(rk[i - 1], rcon), 0xff)); \
+	if (i < 14) \
+		rk[i + 1] = hw_key_step(rk[i - 1], _mm_shuffle_epi32( \
+			_mm_aeskeygenassist_si128(rk[i], 0), 0xaa)); \
+} while (0)
+
+GCM_HW static void hw_expand_key(__m128i rk[15], const unsigned char *key)
+{
+	rk[0] = _mm_loadu_si128((const __m128i *)key);
+	rk[1] = _mm_loadu_si128((const __m128i *)(key + 16));
+	HW_KEY_PAIR(rk, 2, 0x01);
+	HW_KEY_PAIR(rk, 4, 0x02);
+	HW_KEY_PAIR(rk, 6, 0x04);
+	HW_KEY_PAIR(rk, 8, 0x08);
+	HW_KEY_PAIR(rk, 10, 0x10);
+	HW_KEY_PAIR(rk, 12, 0x20);
+	HW_KEY_PAIR(rk, 14, 0x40);
+}
+
+GCM_HW static __m128i hw_encrypt_block(const __m128i rk[15], __m128i x)
+{
+	int i;
+
+	x = _mm_xor_si128(x, rk[0]);
+	for (i = 1; i < 14; i++)
+		x = _mm_aesenc_si128(x, rk[i]);
+	return _mm_aesenclast_si128(x, rk[14]);
+}
+
+/* Unreduced 256 bit carry-less product of a and b, added into lo:hi. */
+GCM_HW static void hw_clmul(__m128i a, __m128i b, __m128i *lo, __m128i *hi)
+{
+	__m128i t0, t1, t2, t3;
+
+	t0 = _mm_clmulepi64_si128(a, b, 0x00);
+	t1 = _mm_clmulepi64_si128(a, b, 0x10);
+	t2 = _mm_clmulepi64_si128(a, b, 0x01);
+	t3 = _mm_clmulepi64_si128(a, b, 0x11);
+	t1 = _mm_xor_si128(t1, t2);
+	*lo = _mm_xor_si128(*lo, _mm_xor_si128(t0, _mm_slli_si128(t1, 8)));
+	*hi = _mm_xor_si128(*hi, _mm_xor_si128(t3, _mm_srli_si128(t1, 8)));
+}
+
+/* Shift lo:hi left one bit to undo the bit reflection, then reduce it
+ * modulo x^128 + x^7 + x^2 + x + 1. */
+GCM_HW static __m128i hw_reduce(__m128i lo, __m128i hi)
+{
+	__m128i t7, t8, t9;
+
+	t7 = _mm_srli_epi32(lo, 31);
+	t8 = _mm_srli_epi32(hi, 31);
+	lo = _mm_slli_epi32(lo, 1);
+	hi = _mm_slli_epi32(hi, 1);
+	t9 = _mm_srli_si128(t7, 12);
+	t8 = _mm_slli_si128(t8, 4);
+	t7 = _mm_slli_si128(t7, 4);
+	lo = _mm_or_si128(lo, t7);
+	hi = _mm_or_si128(_mm_or_si128(hi, t8), t9);
+
+	t7 = _mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30));
+	t7 = _mm_xor_si128(t7, _mm_slli_epi32(lo, 25));
+	t8 = _mm_srli_si128(t7, 4);
+	lo = _mm_xor_si128(lo, _mm_slli_si128(t7, 12));
+	t9 = _mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2));
+	t9 = _mm_xor_si128(t9, _mm_srli_epi32(lo, 7));
+	t9 = _mm_xor_si128(t9, t8);
+	lo = _mm_xor_si128(lo, t9);
+	return _mm_xor_si128(hi, lo);
+}
+
+GCM_HW static __m128i hw_gfmul(__m128i a, __m128i b)
+{
+	__m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+
+	hw_clmul(a, b, &lo, &hi);
+	return hw_reduce(lo, hi);
+}
+
+/* Fold len bytes of data into y, zero padding a final partial block. */
+GCM_HW static __m128i hw_ghash(const struct gcm_hw *g, __m128i y,
+			       const unsigned char *data, size_t len)
+{
+	__m128i lo, hi, x;
+	unsigned char last[16];
+
+	for (; len >= 64; data += 64, len -= 64) {
+		lo = hi = _mm_setzero_si128();
+		x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), g->bswap);
+		hw_clmul(_mm_xor_si128(y, x), g->h[3], &lo, &hi);
+		x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), g->bswap);
+		hw_clmul(x, g->h[2], &lo, &hi);
+		x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), g->bswap);
+		hw_clmul(x, g->h[1], &lo, &hi);
+		x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), g->bswap);
+		hw_clmul(x, g->h[0], &lo, &hi);
+		y = hw_reduce(lo, hi);
+	}
+	for (; len >= 16; data += 16, len -= 16) {
+		x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), g->bswap);
+		y = hw_gfmul(_mm_xor_si128(y, x), g->h[0]);
+	}
+	if (len) {
+		memset(last, 0, 16);
+		memcpy(last, data, len);
+		x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)last), g->bswap);
+		y = hw_gfmul(_mm_xor_si128(y, x), g->h[0]);
+	}
+	return y;
+}
+
+/* CTR mode from the byte reversed counter *ctr, four blocks in flight. */
+GCM_HW static void hw_ctr(const struct gcm_hw *g, __m128i *ctr,
+			  const unsigned char *in, size_t len, unsigned char *out)
+{
+	const __m128i one = _mm_set_epi32(0, 0, 0, 1);
+	__m128i c = *ctr, b0, b1, b2, b3;
+	unsigned char ks[16];
+	size_t i;
+	int r;
+
+	for (; len >= 64; in += 64, out += 64, len -= 64) {
+		c = _mm_add_epi32(c, one);
+		b0 = _mm_xor_si128(_mm_shuffle_epi8(c, g->bswap), g->rk[0]);
+		c = _mm_add_epi32(c, one);
+		b1 = _mm_xor_si128(_mm_shuffle_epi8(c, g->bswap), g->rk[0]);
+		c = _mm_add_epi32(c, one);
+		b2 = _mm_xor_si128(_mm_shuffle_epi8(c, g->bswap), g->rk[0]);
+		c = _mm_add_epi32(c, one);
+		b3 = _mm_xor_si128(_mm_shuffle_epi8(c, g->bswap), g->rk[0]);
+		for (r = 1; r < 14; r++) {
+			b0 = _mm_aesenc_si128(b0, g->rk[r]);
+			b1 = _mm_aesenc_si128(b1, g->rk[r]);
+			b2 = _mm_aesenc_si128(b2, g->rk[r]);
+			b3 = _mm_aesenc_si128(b3, g->rk[r]);
+		}
+		b0 = _mm_aesenclast_si128(b0, g->rk[14]);
+		b1 = _mm_aesenclast_si128(b1, g->rk[14]);
+		b2 = _mm_aesenclast_si128(b2, g->rk[14]);
+		b3 = _mm_aesenclast_si128(b3, g->rk[14]);
+		_mm_storeu_si128((__m128i *)out, _mm_xor_si128(b0,
+				 _mm_loadu_si128((const __m128i *)in)));
+		_mm_storeu_si128((__m128i *)(out + 16), _mm_xor_si128(b1,
+				 _mm_loadu_si128((const __m128i *)(in + 16))));
+		_mm_storeu_si128((__m128i *)(out + 32), _mm_xor_si128(b2,
+				 _mm_loadu_si128((const __m128i *)(in + 32))));
+		_mm_storeu_si128((__m128i *)(out + 48), _mm_xor_si128(b3,
+				 _mm_loadu_si128((const __m128i *)(in + 48))));
+	}
+	while (len > 0) {
+		size_t n = len < 16 ? len : 16;
+
+		c = _mm_add_epi32(c, one);
+		b0 = hw_encrypt_block(g->rk, _mm_shuffle_epi8(c, g->bswap));
+		_mm_storeu_si128((__m128i *)ks, b0);
+		for (i = 0; i < n; i++)
+			out[i] = in[i] ^ ks[i];
+		in += n;
+		out += n;
+		len -= n;
+	}
+	*ctr = c;
+	memset(ks, 0, sizeof(ks));
+}
+
+/* Key schedule and hash powers; returns E(K, J0) and the counter at J0. */
+GCM_HW static void hw_prepare(struct gcm_hw *g, const unsigned char *key,
+			      const unsigned char nonce[GCM_NONCE_LEN],
+			      __m128i *e0, __m128i *ctr)
+{
+	unsigned char j0[16];
+	__m128i h;
+
+	g->bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	hw_expand_key(g->rk, key);
+	h = hw_encrypt_block(g->rk, _mm_setzero_si128());
+	g->h[0] = _mm_shuffle_epi8(h, g->bswap);
+	g->h[1] = hw_gfmul(g->h[0], g->h[0]);
+	g->h[2] = hw_gfmul(g->h[1], g->h[0]);
+	g->h[3] = hw_gfmul(g->h[2], g->h[0]);
+
+	memcpy(j0, nonce, 12);
+	j0[12] = 0;
+	j0[13] = 0;
+	j0[14] = 0;
+	j0[15] = 1;
+	*ctr = _mm_loadu_si128((const __m128i *)j0);
+	*e0 = hw_encrypt_block(g->rk, *ctr);
+	*ctr = _mm_shuffle_epi8(*ctr, g->bswap);
+}
+
+GCM_HW static void hw_tag(const struct gcm_hw *g, __m128i y, __m128i e0,
+			  size_t aad_len, size_t ct_len, unsigned char tag[16])
+{
+	__m128i lens = _mm_set_epi64x((long long)aad_len * 8, (long long)ct_len * 8);
+
+	y = hw_gfmul(_mm_xor_si128(y, lens), g->h[0]);
+	_mm_storeu_si128((__m128i *)tag,
+			 _mm_xor_si128(e0, _mm_shuffle_epi8(y, g->bswap)));
+}
+
+GCM_HW static void hw_encrypt(const unsigned char *key,
+			      const unsigned char nonce[GCM_NONCE_LEN],
+			      const unsigned char *aad, size_t aad_len,
+			      const unsigned char *pt, size_t pt_len,
+			      unsigned char *ct, unsigned char tag[GCM_TAG_LEN])
+{
+	struct gcm_hw g;
+	__m128i e0, ctr, y;
+	size_t off, n;
+
+	hw_prepare(&g, key, nonce, &e0, &ctr);
+	y = hw_ghash(&g, _mm_setzero_si128(), aad, aad_len);
+	for (off = 0; off < pt_len; off += n) {
+		n = pt_len - off < GCM_HW_SPAN ? pt_len - off : GCM_HW_SPAN;
+		hw_ctr(&g, &ctr, pt + off, n, ct + off);
+		y = hw_ghash(&g, y, ct + off, n);
+	}
+	hw_tag(&g, y, e0, aad_len, pt_len, tag);
+	memset(&g, 0, sizeof(g));
+	e0 = ctr = y = _mm_setzero_si128();
+}
+
+/* Decrypts even when the tag turns out wrong; the caller wipes pt then. */
+GCM_HW static int hw_decrypt(const unsigned char *key,
+			     const unsigned char nonce[GCM_NONCE_LEN],
+			     const unsigned char *aad, size_t aad_len,
+			     const unsigned char *ct, size_t ct_len,
+			     const unsigned char tag[GCM_TAG_LEN],
+			     unsigned char *pt)
+{
+	unsigned char expect[16];
+	struct gcm_hw g;
+	__m128i e0, ctr, y;
+	size_t off, n;
+	int i, diff = 0;
+
+	hw_prepare(&g, key, nonce, &e0, &ctr);
+	y = hw_ghash(&g, _mm_setzero_si128(), aad, aad_len);
+	for (off = 0; off < ct_len; off += n) {
+		n = ct_len - off < GCM_HW_SPAN ? ct_len - off : GCM_HW_SPAN;
+		y = hw_ghash(&g, y, ct + off, n);
+		hw_ctr(&g, &ctr, ct + off, n, pt + off);
+	}
+	hw_tag(&g, y, e0, aad_len, ct_len, expect);
+	for (i = 0; i < 16; i++)
+		diff |= expect[i] ^ tag[i];
+	memset(&g, 0, sizeof(g));
+	memset(expect, 0, sizeof(expect));
+	e0 = ctr = y = _mm_setzero_si128();
+	return diff;
+}
+
+static int gcm_hw_usable(int keybits)
+{
+	return keybits == 256 && __builtin_cpu_supports("aes") &&
+		__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+}
+#else
+static int gcm_hw_usable(int keybits)
+{
+	(void)keybits;
+	return 0;
+}
+#endif
+
+int gcm_aes_hw(void)
+{
+	return gcm_hw_usable(256);
+}
+
 int gcm_aes_encrypt(const unsigned char *key, int keybits,
 		    const unsigned char nonce[GCM_NONCE_LEN],
 		    const unsigned char *aad, size_t aad_len,
@@ -167,6 +483,12 @@ int gcm_aes_encrypt(const unsigned char *key, int keybits,
 	if (!key || !nonce || !tag || (pt_len && (!pt || !ct)) || (aad_len && !aad))
 		return -1;
 
+#ifdef HAVE_AESNI_INTRIN
+	if (gcm_hw_usable(keybits)) {
+		hw_encrypt(key, nonce, aad, aad_len, pt, pt_len, ct, tag);
+		return 0;
+	}
+#endif
 	memset(&ctx, 0, sizeof(ctx));
 	if (gcm_prepare(&ctx, key, keybits, nonce, H, J0, E0) != 0)
 		goto out;
@@ -201,6 +523,15 @@ int gcm_aes_decrypt(const unsigned char *key, int keybits,
 	if (!key || !nonce || !tag || (ct_len && (!ct || !pt)) || (aad_len && !aad))
 		return -1;
 
+#ifdef HAVE_AESNI_INTRIN
+	if (gcm_hw_usable(keybits)) {
+		if (hw_decrypt(key, nonce, aad, aad_len, ct, ct_len, tag, pt) == 0)
+			return 0;
+		if (ct_len)
+			memset(pt, 0, ct_len);
+		return -1;
+	}
+#endif
 	memset(&ctx, 0, sizeof(ctx));
 	if (gcm_prepare(&ctx, key, keybits, nonce, H, J0, E0) != 0)
 		goto out;
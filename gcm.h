@@ -46,6 +46,12 @@ int gcm_aes_decrypt(const unsigned char *key, int keybits,
 		    const unsigned char tag[GCM_TAG_LEN],
 		    unsigned char *pt);
 
+/**
+ * Non-zero when AES-256-GCM runs on AES-NI and PCLMULQDQ on this CPU
+ * rather than on the portable table code.
+ */
+int gcm_aes_hw(void);
+
 #ifdef __cplusplus
 }
 #endif
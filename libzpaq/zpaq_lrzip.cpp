@@ -50,141 +50,176 @@ static int zpaq_classic_level(int level)
 	return level;
 }
 
+/* libzpaq moves data through read()/write() in its own buffers; progress
+ * is shown between spans of this many bytes rather than per byte. */
+#define ZPAQ_SPAN	(1 << 20)
+
+static void zpaq_progress(FILE *msgout, long thread, i64 done, i64 total, int *last_pct)
+{
+	int pct, i;
+
+	/* CVE-2017-8842: never divide by zero when total == 0 */
+	if (total <= 0)
+		return;
+	pct = (int)(done * 100 / total);
+	if (pct / 10 == *last_pct / 10)
+		return;
+	fprintf(msgout, "\r\t\t\tZPAQ\t");
+	for (i = 0; i < thread; i++)
+		fprintf(msgout, "\t");
+	fprintf(msgout, "%ld:%i%%  \r", thread + 1, pct);
+	fflush(msgout);
+	*last_pct = pct;
+}
+
 struct bufRead: public libzpaq::Reader {
-	uchar *s_buf;
-	i64 *s_len;
-	i64 total_len;
-	int *last_pct;
-	bool progress;
-	long thread;
-	FILE *msgout;
-
-	bufRead(uchar *buf_, i64 *n_, i64 total_len_, int *last_pct_,
-		bool progress_, long thread_, FILE *msgout_)
-		: s_buf(buf_), s_len(n_), total_len(total_len_),
-		  last_pct(last_pct_), progress(progress_),
-		  thread(thread_), msgout(msgout_) {}
+	uchar *p, *end;
 
-	int get() {
-		/* CVE-2017-8842: never divide by zero when total_len == 0 */
-		if (progress && total_len > 0 && !(*s_len % 128)) {
-			int pct = (int)((total_len - *s_len) * 100 / total_len);
-
-			if (pct / 10 != *last_pct / 10) {
-				int i;
-
-				fprintf(msgout, "\r\t\t\tZPAQ\t");
-				for (i = 0; i < thread; i++)
-					fprintf(msgout, "\t");
-				fprintf(msgout, "%ld:%i%%  \r",
-					thread + 1, pct);
-				fflush(msgout);
-				*last_pct = pct;
-			}
-		}
+	bufRead(uchar *buf_, i64 len_) : p(buf_), end(buf_ + len_) {}
 
-		if (likely(*s_len > 0)) {
-			(*s_len)--;
-			return (int)(uchar)*s_buf++;
-		}
+	int get() {
+		if (likely(p < end))
+			return *p++;
 		return -1;
 	}
 
 	int read(char *buf, int n) {
 		if (unlikely(n < 0))
 			return 0;
-		if (unlikely((i64)n > *s_len))
-			n = (int)*s_len;
-
-		if (likely(n > 0)) {
-			*s_len -= n;
-			memcpy(buf, s_buf, (size_t)n);
-			s_buf += n;
-		}
+		if (unlikely((i64)n > end - p))
+			n = (int)(end - p);
+		memcpy(buf, p, (size_t)n);
+		p += n;
 		return n;
 	}
 };
 
+/* Bounded: anything past end sets overflow and is dropped, so corrupt
+ * or malicious archives can never write beyond the buffer. */
 struct bufWrite: public libzpaq::Writer {
-	uchar *c_buf;
-	i64 *c_len;
-	i64 max_len;
+	uchar *buf, *p, *end;
+	bool overflow;
+
+	bufWrite(uchar *buf_, i64 max_len) : buf(buf_), p(buf_), end(buf_ + max_len),
+		overflow(false) {}
 
-	bufWrite(uchar *buf_, i64 *n_, i64 max_ = -1LL)
-		: c_buf(buf_), c_len(n_), max_len(max_) {}
+	i64 len() { return p - buf; }
 
 	void put(int c) {
-		if (*c_len < 0)
-			return;
-		if (max_len >= 0 && *c_len >= max_len) {
-			*c_len = -1;
-			return;
-		}
-		c_buf[(*c_len)++] = static_cast<uchar>(c);
+		if (likely(p < end))
+			*p++ = (uchar)c;
+		else
+			overflow = true;
 	}
 
-	void write(const char *buf, int n) {
-		if (n <= 0 || *c_len < 0)
+	void write(const char *src, int n) {
+		if (unlikely(n <= 0))
 			return;
-		if (max_len < 0) {
-			memcpy(c_buf + *c_len, buf, (size_t)n);
-			*c_len += n;
+		if (unlikely((i64)n > end - p)) {
+			overflow = true;
 			return;
 		}
-		{
-			i64 avail = max_len - *c_len;
-
-			if (avail <= 0) {
-				*c_len = -1;
-				return;
-			}
-			if ((i64)n > avail) {
-				*c_len = -1;
-				return;
-			}
-		}
-		memcpy(c_buf + *c_len, buf, (size_t)n);
-		*c_len += n;
+		memcpy(p, src, (size_t)n);
+		p += n;
 	}
 };
 
-extern "C" void zpaq_compress(uchar *c_buf, i64 *c_len, uchar *s_buf, i64 s_len,
-			      int level, FILE *msgout, bool progress, long thread)
+/* Kept by a worker between blocks, so the objects and the buffers they
+ * allocate up front are made once. Each block still carries its own model
+ * header, which libzpaq reads, JIT compiles and sizes its tables for anew,
+ * as it does for every block of one of its own archives. */
+struct zpaq_cache {
+	libzpaq::Compressor *c;
+	libzpaq::Decompresser *d;
+};
+
+/* Like libzpaq's own allocations, running out of memory here is fatal */
+static zpaq_cache *zpaq_get_cache(void **cache)
+{
+	if (!*cache)
+		*cache = new zpaq_cache();
+	return (zpaq_cache *)*cache;
+}
+
+extern "C" void zpaq_free(void *cache)
+{
+	zpaq_cache *zc = (zpaq_cache *)cache;
+
+	if (!zc)
+		return;
+	delete zc->c;
+	delete zc->d;
+	delete zc;
+}
+
+extern "C" void zpaq_compress(uchar *c_buf, i64 *c_len, i64 c_size, uchar *s_buf, i64 s_len,
+			      int level, FILE *msgout, bool progress, long thread, void **cache)
 {
-	i64 total_len = s_len;
 	int last_pct = 100;
 	int classic = zpaq_classic_level(level);
 
-	bufRead bufR(s_buf, &s_len, total_len, &last_pct, progress, thread, msgout);
-	bufWrite bufW(c_buf, c_len);
+	bufRead bufR(s_buf, s_len);
+	bufWrite bufW(c_buf, c_size);
+	zpaq_cache *zc = zpaq_get_cache(cache);
+
+	if (!zc->c)
+		zc->c = new libzpaq::Compressor;
 
 	/* Classic min/mid/max models (same family as pre-7.15 lrzip -z).
 	 * Do not use libzpaq::compress(..., "1".."5") — those are the
 	 * archiver's fast methods, not the old context-mixing levels. */
-	libzpaq::Compressor c;
+	libzpaq::Compressor &c = *zc->c;
 
 	c.setInput(&bufR);
 	c.setOutput(&bufW);
 	c.startBlock(classic);
 	c.startSegment();
 	c.postProcess();
-	c.compress();
+	while (c.compress(ZPAQ_SPAN) && !bufW.overflow) {
+		if (progress)
+			zpaq_progress(msgout, thread, s_len - (bufR.end - bufR.p), s_len, &last_pct);
+	}
 	c.endSegment(); /* no SHA-1; lrzip has its own integrity */
 	c.endBlock();
+	/* Not fitting c_size reads as incompressible to the caller */
+	*c_len = bufW.overflow ? c_size : bufW.len();
 }
 
 extern "C" int zpaq_decompress(uchar *s_buf, i64 *d_len, uchar *c_buf, i64 c_len,
 			       FILE *msgout, bool progress, long thread,
-			       i64 expected_len)
+			       i64 expected_len, void **cache)
 {
-	i64 total_len = c_len;
 	int last_pct = 100;
 
-	bufRead bufR(c_buf, &c_len, total_len, &last_pct, progress, thread, msgout);
-	bufWrite bufW(s_buf, d_len, expected_len);
-
-	libzpaq::decompress(&bufR, &bufW);
-	if (*d_len < 0)
-		return -1; /* write past expected_len / corrupt input */
+	bufRead bufR(c_buf, c_len);
+	bufWrite bufW(s_buf, expected_len);
+	zpaq_cache *zc = zpaq_get_cache(cache);
+
+	if (!zc->d)
+		zc->d = new libzpaq::Decompresser;
+
+	libzpaq::Decompresser &d = *zc->d;
+
+	d.setInput(&bufR);
+	d.setOutput(&bufW);
+	while (d.findBlock()) {
+		while (d.findFilename()) {
+			d.readComment();
+			while (d.decompress(ZPAQ_SPAN)) {
+				if (unlikely(bufW.overflow)) {
+					/* Abandoned mid block, never reuse it */
+					delete zc->d;
+					zc->d = NULL;
+					return -1; /* write past expected_len / corrupt input */
+				}
+				if (progress)
+					zpaq_progress(msgout, thread, bufW.len(), expected_len, &last_pct);
+			}
+			d.readSegmentEnd();
+		}
+	}
+	*d_len = bufW.len();
+	if (bufW.overflow)
+		return -1;
 	return 0;
 }
@@ -193,11 +193,16 @@ bool write_magic(rzip_control *control)
 			magic[i + 16] = (char)control->lzma_properties[i];
 	}
 
+	/* Blocks may be primed with the tail of the block before them */
+	if (PRIME)
+		magic[15] = 1;
+
 	/* Flag that an md5 sum is stored at the end of the archive for
-	 * integrity checking. Per-chunk CRC32 is no longer written.
+	 * integrity checking. Per-chunk CRC32 is no longer written, but a
+	 * tree hash stores each chunk's MD5 and a root over them.
 	 */
 	if (!NO_MD5)
-		magic[21] = 1;
+		magic[21] = TREE_HASH ? 2 : 1;
 	/* Encryption mode byte:
 	 * 1 = AES-128-CBC (0.6-compatible / --legacy-encrypt)
 	 * 3 = AES-256-GCM + PBKDF2 (default -e)
@@ -238,11 +243,13 @@ bool write_magic(rzip_control *control)
 		uint32_t iters;
 
 		memset(desc, 0, sizeof(desc));
-		desc[0] = LRZ_SUITE_AES256_GCM_PBKDF2;
+		desc[0] = control->aead_suite;
 		desc[1] = LRZ_AEAD_SALT_LEN;
 		iters = htole32(control->aead_iters);
 		memcpy(desc + 2, &iters, 4);
 		memcpy(desc + 8, control->aead_salt, LRZ_AEAD_SALT_LEN);
+		if (control->aead_suite == LRZ_SUITE_AES256_GCM_PBKDF2_HKDF)
+			memcpy(desc + 24, control->aead_archive_salt, LRZ_AEAD_ARCHIVE_SALT_LEN);
 		if (unlikely(put_fdout(control, desc, LRZ_CRYPTO_DESC_LEN) != LRZ_CRYPTO_DESC_LEN))
 			fatal_return(("Failed to write encryption descriptor\n"), false);
 	}
@@ -251,15 +258,13 @@ bool write_magic(rzip_control *control)
 	return true;
 }
 
-/* Read suite-3 CryptoDesc after magic; populate aead_salt / aead_iters. */
-static bool read_crypto_desc(rzip_control *control, int fd_in)
+/* Populate aead_suite / aead_salt / aead_iters from a suite-3 CryptoDesc. */
+static bool parse_crypto_desc(rzip_control *control, const uchar *desc)
 {
-	uchar desc[LRZ_CRYPTO_DESC_LEN];
 	uint32_t iters;
 
-	if (unlikely(read(fd_in, desc, LRZ_CRYPTO_DESC_LEN) != LRZ_CRYPTO_DESC_LEN))
-		fatal_return(("Failed to read encryption descriptor\n"), false);
-	if (desc[0] != LRZ_SUITE_AES256_GCM_PBKDF2)
+	if (desc[0] != LRZ_SUITE_AES256_GCM_PBKDF2 &&
+	    desc[0] != LRZ_SUITE_AES256_GCM_PBKDF2_HKDF)
 		failure_return(("Unsupported encryption suite %u\n", desc[0]), false);
 	if (desc[1] != LRZ_AEAD_SALT_LEN)
 		failure_return(("Invalid encryption salt length %u\n", desc[1]), false);
@@ -267,10 +272,25 @@ static bool read_crypto_desc(rzip_control *control, int fd_in)
 	iters = le32toh(iters);
 	if (iters < 1 || iters > LRZ_PBKDF2_ITERS_MAX)
 		failure_return(("Invalid PBKDF2 iteration count %u\n", iters), false);
+	control->aead_suite = desc[0];
 	control->aead_iters = iters;
 	memcpy(control->aead_salt, desc + 8, LRZ_AEAD_SALT_LEN);
+	if (control->aead_suite == LRZ_SUITE_AES256_GCM_PBKDF2_HKDF)
+		memcpy(control->aead_archive_salt, desc + 24, LRZ_AEAD_ARCHIVE_SALT_LEN);
 	/* Keep salt[0..7] in sync for any code that still peeks at control->salt */
 	memcpy(control->salt, control->aead_salt, SALT_LEN);
+	return true;
+}
+
+/* Read suite-3 CryptoDesc after magic. */
+static bool read_crypto_desc(rzip_control *control, int fd_in)
+{
+	uchar desc[LRZ_CRYPTO_DESC_LEN];
+
+	if (unlikely(read(fd_in, desc, LRZ_CRYPTO_DESC_LEN) != LRZ_CRYPTO_DESC_LEN))
+		fatal_return(("Failed to read encryption descriptor\n"), false);
+	if (unlikely(!parse_crypto_desc(control, desc)))
+		return false;
 	print_maxverbose("AEAD PBKDF2 iterations %u\n", control->aead_iters);
 	return true;
 }
@@ -333,11 +353,20 @@ static bool get_magic(rzip_control *control, char *magic)
 			control->lzma_properties[0] = 93;
 	}
 
+	/* Primed blocks need the tail of the previous block kept around */
+	if (magic[15] == 1)
+		control->flags |= FLAG_PRIME;
+	else if (magic[15])
+		failure_return(("Invalid priming flag in magic header\n"), false);
+
 	/* Whether this archive contains md5 data at the end or not */
 	md5 = magic[21];
+	control->flags &= ~FLAG_TREE_HASH;
 	if (md5) {
 		if (md5 == 1)
 			control->flags |= FLAG_MD5;
+		else if (md5 == 2)
+			control->flags |= FLAG_MD5 | FLAG_TREE_HASH;
 		else
 			print_verbose("Unknown hash, falling back to CRC\n");
 	}
@@ -668,7 +697,6 @@ static bool read_tmpinmagic(rzip_control *control)
 		return false;
 	if (ENCRYPT_AEAD) {
 		uchar desc[LRZ_CRYPTO_DESC_LEN];
-		uint32_t iters;
 
 		for (i = 0; i < LRZ_CRYPTO_DESC_LEN; i++) {
 			tmpchar = getchar();
@@ -676,17 +704,8 @@ static bool read_tmpinmagic(rzip_control *control)
 				failure_return(("EOF reading encryption descriptor from STDIN\n"), false);
 			desc[i] = (uchar)tmpchar;
 		}
-		if (desc[0] != LRZ_SUITE_AES256_GCM_PBKDF2)
-			failure_return(("Unsupported encryption suite %u\n", desc[0]), false);
-		if (desc[1] != LRZ_AEAD_SALT_LEN)
-			failure_return(("Invalid encryption salt length\n"), false);
-		memcpy(&iters, desc + 2, 4);
-		iters = le32toh(iters);
-		if (iters < 1 || iters > LRZ_PBKDF2_ITERS_MAX)
-			failure_return(("Invalid PBKDF2 iteration count\n"), false);
-		control->aead_iters = iters;
-		memcpy(control->aead_salt, desc + 8, LRZ_AEAD_SALT_LEN);
-		memcpy(control->salt, control->aead_salt, SALT_LEN);
+		if (unlikely(!parse_crypto_desc(control, desc)))
+			return false;
 	}
 	return true;
 }
@@ -925,6 +944,7 @@ static void release_hashes(rzip_control *control)
 	lrz_secure_wipe(control->aead_key_hdr, LRZ_AEAD_KEY_LEN);
 	lrz_secure_wipe(control->aead_key_data, LRZ_AEAD_KEY_LEN);
 	lrz_secure_wipe(control->aead_salt, LRZ_AEAD_SALT_LEN);
+	lrz_secure_wipe(control->aead_archive_salt, LRZ_AEAD_ARCHIVE_SALT_LEN);
 	munlock(control->salt_pass, PASS_LEN);
 	munlock(control->hash, HASH_LEN);
 	dealloc(control->salt_pass);
@@ -942,7 +962,10 @@ static void clear_rulist(rzip_control *control)
 	while (control->ruhead) {
 		struct runzip_node *node = control->ruhead;
 		struct stream_info *sinfo = node->sinfo;
+		int i;
 
+		for (i = 0; i < sinfo->num_streams; i++)
+			dealloc(sinfo->s[i].prime);
 		dealloc(sinfo->ucthreads);
 		dealloc(node->pthreads);
 		dealloc(sinfo->s);
@@ -1036,11 +1059,12 @@ bool decompress_file(rzip_control *control)
 	control->fd_in = fd_in;
 
 	if (!(TEST_ONLY | STDOUT)) {
-		fd_out = open(control->outfile, O_WRONLY | O_CREAT | O_EXCL, 0666);
+		/* Read-write so runzip can map it as history */
+		fd_out = open(control->outfile, O_RDWR | O_CREAT | O_EXCL, 0666);
 		if (FORCE_REPLACE && (-1 == fd_out) && (EEXIST == errno)) {
 			if (unlikely(unlink(control->outfile)))
 				fatal_return(("Failed to unlink an existing file: %s\n", control->outfile), false);
-			fd_out = open(control->outfile, O_WRONLY | O_CREAT | O_EXCL, 0666);
+			fd_out = open(control->outfile, O_RDWR | O_CREAT | O_EXCL, 0666);
 		}
 		if (unlikely(fd_out == -1)) {
 			/* We must ensure we don't delete a file that already
@@ -1070,7 +1094,8 @@ bool decompress_file(rzip_control *control)
 		}
 	}
 
-	if (STDOUT) {
+	/* A range is written to stdout a chunk at a time as it is extracted */
+	if (STDOUT && !RANGE) {
 		if (unlikely(!open_tmpoutbuf(control)))
 			return false;
 	}
@@ -1082,7 +1107,7 @@ bool decompress_file(rzip_control *control)
 			fatal_return(("Invalid expected size %"PRId64"\n", expected_size), false);
 	}
 
-	if (!STDOUT && !TEST_ONLY) {
+	if (!STDOUT && !TEST_ONLY && !RANGE) {
 		/* Check if there's enough free space on the device chosen to fit the
 		* decompressed file. */
 		if (unlikely(fstatvfs(fd_out, &fbuf)))
@@ -1100,7 +1125,9 @@ bool decompress_file(rzip_control *control)
 
 	if (NO_MD5)
 		print_verbose("Not performing MD5 hash check\n");
-	if (HAS_MD5)
+	if (TREE_HASH)
+		print_verbose("MD5 tree hash ");
+	else if (HAS_MD5)
 		print_verbose("MD5 ");
 	else
 		print_verbose("CRC32 ");
@@ -1112,7 +1139,13 @@ bool decompress_file(rzip_control *control)
 
 	print_output("Decompressing...\n");
 
-	if (unlikely(runzip_fd(control, fd_in, fd_hist, expected_size) < 0)) {
+	if (RANGE) {
+		expected_size = runzip_range(control, fd_in, expected_size);
+		if (unlikely(expected_size < 0)) {
+			clear_rulist(control);
+			return false;
+		}
+	} else if (unlikely(runzip_fd(control, fd_in, fd_hist, expected_size) < 0)) {
 		clear_rulist(control);
 		return false;
 	}
@@ -1147,7 +1180,8 @@ bool decompress_file(rzip_control *control)
 		close(fd_in);
 	}
 
-	if (!KEEP_FILES && !STDIN) {
+	/* An archive only partly extracted is still needed */
+	if (!KEEP_FILES && !STDIN && !RANGE) {
 		if (unlikely(unlink(control->infile)))
 			fatal_return(("Failed to unlink %s\n", infilecopy), false);
 	}
@@ -1227,6 +1261,8 @@ bool get_fileinfo(rzip_control *control)
 	long double cratio;
 	uchar ctype = 0;
 	uchar save_ctype = 255;
+	uchar first_backend = 0;
+	bool mixed_backends = false, block_crc = false;
 	struct stat st;
 	int fd_in;
 
@@ -1341,6 +1377,7 @@ next_chunk:
 		print_verbose("\n");
 		do {
 			i64 head_off;
+			bool crc;
 
 			if (unlikely(last_head && last_head <= second_last))
 				failure_goto(("Invalid earlier last_head position, corrupt archive.\n"), error);
@@ -1355,12 +1392,17 @@ next_chunk:
 			if (unlikely(last_head < 0 || c_len < 0 || u_len < 0))
 				failure_goto(("Entry negative, likely corrupted archive.\n"), error);
 			print_verbose("%d\t", block);
+			crc = ctype & CTYPE_CRC;
+			ctype &= ~CTYPE_CRC;
+			block_crc |= crc;
 			if (ctype == CTYPE_NONE)
 				print_verbose("none");
 			else if (ctype == CTYPE_BZIP2)
 				print_verbose("bzip2");
 			else if (ctype == CTYPE_LZO)
 				print_verbose("lzo");
+			else if (ctype == CTYPE_LZ4)
+				print_verbose("lz4");
 			else if (ctype == CTYPE_LZMA)
 				print_verbose("lzma");
 			else if (ctype == CTYPE_GZIP)
@@ -1373,13 +1415,29 @@ next_chunk:
 				print_verbose("lzma+bcj-arm64");
 			else if (ctype >= CTYPE_LZMA_DELTA1 && ctype <= CTYPE_LZMA_DELTA4)
 				print_verbose("lzma+delta%d", ctype - CTYPE_LZMA_DELTA1 + 1);
+			else if (ctype == CTYPE_LZMA_PRIMED)
+				print_verbose("lzma+primed");
 			else
 				print_verbose("Dunno wtf");
-			if (save_ctype == 255)
-				save_ctype = ctype; /* need this for lzma when some chunks could have no compression
+			if (crc)
+				print_verbose("+crc");
+			if (save_ctype == 255 || save_ctype == CTYPE_NONE)
+				save_ctype = ctype == CTYPE_LZMA_PRIMED ? CTYPE_LZMA : ctype; /* need this for lzma when some chunks could have no compression
 						     * and info will show rzip + none on info display if last chunk
 						     * is not compressed. Adjust for all types in case it's used in
 						     * the future */
+			/* --auto archives can use a different back end per block */
+			if (ctype != CTYPE_NONE) {
+				uchar backend = ctype;
+
+				if ((ctype >= CTYPE_LZMA_BCJ && ctype <= CTYPE_LZMA_DELTA4) ||
+				    ctype == CTYPE_LZMA_PRIMED)
+					backend = CTYPE_LZMA;
+				if (!first_backend)
+					first_backend = backend;
+				else if (backend != first_backend)
+					mixed_backends = true;
+			}
 			utotal += u_len;
 			ctotal += c_len;
 			print_verbose("\t%5.1f%%\t%16"PRId64" / %14"PRId64"", percentage(c_len, u_len), c_len, u_len);
@@ -1462,12 +1520,16 @@ done:
 
 	print_output("  Compression Method: ");
 
-	if (save_ctype == CTYPE_NONE)
+	if (mixed_backends)
+		print_output("rzip + mixed back ends per block\n");
+	else if (save_ctype == CTYPE_NONE)
 		print_output("rzip alone\n");
 	else if (save_ctype == CTYPE_BZIP2)
 		print_output("rzip + bzip2\n");
 	else if (save_ctype == CTYPE_LZO)
 		print_output("rzip + lzo\n");
+	else if (save_ctype == CTYPE_LZ4)
+		print_output("rzip + lz4\n");
 	else if (save_ctype == CTYPE_LZMA)
 		print_output("rzip + lzma\n");
 	else if (save_ctype == CTYPE_GZIP)
@@ -1482,6 +1544,8 @@ done:
 		print_output("rzip + lzma + delta %d\n", save_ctype - CTYPE_LZMA_DELTA1 + 1);
 	else
 		print_output("Dunno wtf\n");
+	if (block_crc)
+		print_output("  Block CRC32s: present\n");
 
 	print_output("\n");
 
@@ -1502,7 +1566,7 @@ done:
 			fatal_goto(("Failed to seek to md5 data in runzip_fd\n"), error);
 		if (unlikely(read(fd_in, md5_stored, MD5_DIGEST_SIZE) != MD5_DIGEST_SIZE))
 			fatal_goto(("Failed to read md5 data in runzip_fd\n"), error);
-		print_output("\n  MD5 Checksum: ");
+		print_output(TREE_HASH ? "\n  MD5 tree root: " : "\n  MD5 Checksum: ");
 		for (i = 0; i < MD5_DIGEST_SIZE; i++)
 			print_output("%02x", md5_stored[i] & 0xFF);
 		print_output("\n");
@@ -1545,6 +1609,16 @@ bool compress_file(rzip_control *control)
 			memcpy(control->salt, control->aead_salt, SALT_LEN);
 			if (!control->aead_iters)
 				control->aead_iters = LRZ_PBKDF2_ITERS_DEFAULT;
+			/* With --session-key, lrz_aead_kdf_setup swaps in the
+			 * salt of a running session; the archive salt keeps
+			 * every archive's keys its own. */
+			control->aead_suite = LRZ_SUITE_AES256_GCM_PBKDF2;
+			if (SESSION_KEY) {
+				control->aead_suite = LRZ_SUITE_AES256_GCM_PBKDF2_HKDF;
+				if (unlikely(!get_rand(control, control->aead_archive_salt,
+						       LRZ_AEAD_ARCHIVE_SALT_LEN)))
+					return false;
+			}
 		}
 		if (unlikely(!get_hash(control, 1)))
 			return false;
@@ -42,9 +42,11 @@ bool clear_tmpinfile(rzip_control *control);
 void close_tmpinbuf(rzip_control *control);
 bool initialise_control(rzip_control *control);
 #define initialize_control(_control) initialise_control(_control)
-extern void zpaq_compress(uchar *c_buf, i64 *c_len, uchar *s_buf, i64 s_len, int level,
-			  FILE *msgout, bool progress, long thread);
+extern void zpaq_compress(uchar *c_buf, i64 *c_len, i64 c_size, uchar *s_buf, i64 s_len, int level,
+			  FILE *msgout, bool progress, long thread, void **cache);
 extern int zpaq_decompress(uchar *s_buf, i64 *d_len, uchar *c_buf, i64 c_len,
-			    FILE *msgout, bool progress, long thread, i64 expected_len);
+			    FILE *msgout, bool progress, long thread, i64 expected_len,
+			    void **cache);
+extern void zpaq_free(void *cache);
 
 #endif
@@ -249,6 +249,17 @@ typedef sem_t cksem_t;
 /* Maximum compression modifier: single block per stream, largest
  * dictionaries, 273 fast bytes. Sacrifices parallelism for ratio. */
 #define FLAG_ULTRA		(1 << 28)
+#define FLAG_LZ4_COMPRESS	(1 << 29)
+/* Decompress only output bytes [range_start, range_end) */
+#define FLAG_RANGE		(1 << 30)
+/* lzma blocks continue from the tail of the stream's previous block */
+#define FLAG_PRIME		(1ULL << 31)
+/* Archives written in one run share a PBKDF2 master key */
+#define FLAG_SESSION_KEY	(1ULL << 32)
+/* Each chunk carries its own MD5 and the archive a root over them */
+#define FLAG_TREE_HASH		(1ULL << 33)
+/* Each compressed block ends with a CRC32 of its uncompressed data */
+#define FLAG_BLOCK_CRC		(1ULL << 34)
 
 #define MAGIC_LEN	24
 #define LRZC_LEN	24
@@ -260,6 +271,10 @@ typedef sem_t cksem_t;
 #define LRZ_CRYPTO_DESC_LEN	32
 #define LRZ_AEAD_SALT_LEN	16
 #define LRZ_SUITE_AES256_GCM_PBKDF2	1
+/* As suite 1, but the PBKDF2 salt may be shared by the archives of one
+ * session and each archive's keys are extracted with its own salt */
+#define LRZ_SUITE_AES256_GCM_PBKDF2_HKDF	2
+#define LRZ_AEAD_ARCHIVE_SALT_LEN	8
 #define LRZ_PBKDF2_ITERS_DEFAULT	600000u
 #define LRZ_PBKDF2_ITERS_MAX		5000000u
 
@@ -281,6 +296,21 @@ typedef sem_t cksem_t;
 #define CTYPE_LZMA_DELTA2 12
 #define CTYPE_LZMA_DELTA3 13
 #define CTYPE_LZMA_DELTA4 14
+/* lz4 fast for levels 1-3, lz4hc above: cheap to decode at any level */
+#define CTYPE_LZ4 15
+/* lzma primed with the tail of the previous block of the stream, written
+ * with --prime: a 4 byte prime length comes before the lzma data */
+#define CTYPE_LZMA_PRIMED 16
+/* Or'd into any block type written with --block-crc: the last 4 bytes of
+ * the block, counted in c_len, are a CRC32 of its uncompressed data */
+#define CTYPE_CRC 0x80
+
+/* --auto policies: which backend each class of block gets. The choice is
+ * stored in the block type byte so decompression needs nothing extra. */
+#define LRZ_AUTO_OFF 0
+#define LRZ_AUTO_SPEED 1
+#define LRZ_AUTO_BALANCED 2
+#define LRZ_AUTO_RATIO 3
 
 #define PASS_LEN 512
 #define HASH_LEN 64
@@ -313,7 +343,7 @@ typedef sem_t cksem_t;
 #define ARBITRARY_AT_EPOCH (ARBITRARY * pow (MOORE_TIMES_PER_SECOND, -T_ZERO))
 
 #define FLAG_VERBOSE (FLAG_VERBOSITY | FLAG_VERBOSITY_MAX)
-#define FLAG_NOT_LZMA (FLAG_NO_COMPRESS | FLAG_LZO_COMPRESS | FLAG_BZIP2_COMPRESS | FLAG_ZLIB_COMPRESS | FLAG_ZPAQ_COMPRESS)
+#define FLAG_NOT_LZMA (FLAG_NO_COMPRESS | FLAG_LZO_COMPRESS | FLAG_BZIP2_COMPRESS | FLAG_ZLIB_COMPRESS | FLAG_ZPAQ_COMPRESS | FLAG_LZ4_COMPRESS)
 #define LZMA_COMPRESS	(!(control->flags & FLAG_NOT_LZMA))
 
 #define SHOW_PROGRESS	(control->flags & FLAG_SHOW_PROGRESS)
@@ -326,6 +356,7 @@ typedef sem_t cksem_t;
 #define BZIP2_COMPRESS	(control->flags & FLAG_BZIP2_COMPRESS)
 #define ZLIB_COMPRESS	(control->flags & FLAG_ZLIB_COMPRESS)
 #define ZPAQ_COMPRESS	(control->flags & FLAG_ZPAQ_COMPRESS)
+#define LZ4_COMPRESS	(control->flags & FLAG_LZ4_COMPRESS)
 #define ULTRA		(control->flags & FLAG_ULTRA)
 #define VERBOSE		(control->flags & FLAG_VERBOSE)
 #define VERBOSITY	(control->flags & FLAG_VERBOSITY)
@@ -346,6 +377,11 @@ typedef sem_t cksem_t;
 #define ENCRYPT		(control->flags & FLAG_ENCRYPT)
 #define SHOW_OUTPUT	(control->flags & FLAG_OUTPUT)
 #define STREAMING_BLOCKS (control->flags & FLAG_STREAMING_BLOCKS)
+#define RANGE		(control->flags & FLAG_RANGE)
+#define PRIME		(control->flags & FLAG_PRIME)
+#define SESSION_KEY	(control->flags & FLAG_SESSION_KEY)
+#define TREE_HASH	(control->flags & FLAG_TREE_HASH)
+#define BLOCK_CRC	(control->flags & FLAG_BLOCK_CRC)
 
 #define IS_FROM_FILE ( !!(control->inFILE) && !STDIN )
 
@@ -377,12 +413,24 @@ struct sliding_buffer {
 	int fd;		/* The fd of the mmap */
 };
 
-struct checksum {
-	uchar *buf;
+/* Ranges waiting for the MD5 worker, and how much a slot takes before it
+ * is handed over */
+#define CKSUM_RING 8
+#define CKSUM_CHUNK (1024 * 1024)
+
+struct cksum_slot {
+	const uchar *data;	/* The bytes to hash, in place or in buf */
 	i64 len;
+	uchar *buf;		/* Own copy buffer, allocated on first use */
+};
+
+struct checksum {
+	struct cksum_slot ring[CKSUM_RING];
+	int head;	/* Next slot the producer fills */
+	int tail;	/* Next slot the worker hashes */
 	i64 capacity;
 	int shutdown;
-	int filling;	/* producer owns buf and is appending (decompress) */
+	int filling;	/* producer owns ring[head] and is appending */
 };
 
 /* Rolling hash tag: 32-bit is enough (hash_index is built from random()). */
@@ -440,6 +488,12 @@ struct rzip_state {
 #define RZIP_S0_BUFSIZE 4096
 	uchar s0_buf[RZIP_S0_BUFSIZE];
 	unsigned s0_len;
+	/* With -c stream 0 is replayed against the input as it is flushed */
+	uchar replay_tok[16];	/* Token split across two flushes */
+	int replay_have;
+	bool replay_done;
+	i64 replay_pos;
+	uchar *replay_buf;	/* Both sides of a match, sliding mmap only */
 	struct {
 		i64 inserts;
 		i64 literals;
@@ -482,8 +536,15 @@ struct rzip_control {
 	 * LRZ_FILTER_* kind. Backend blocks record their filter in the
 	 * block type byte. */
 	int filter_mode;
+	/* --auto: 0 off, else the LRZ_AUTO_* policy used to pick a backend
+	 * for each block from a quick probe of its contents */
+	int auto_policy;
+	/* --range: first and one past the last byte to extract, range_end
+	 * -1 for the end of the file */
+	i64 range_start;
+	i64 range_end;
 	i64 window;
-	unsigned long flags;
+	i64 flags;	/* FLAG_ bits, more than 32 of them */
 	i64 ramsize;
 	i64 max_chunk;
 	i64 max_mmap;
@@ -497,6 +558,11 @@ struct rzip_control {
 	int fd_in;
 	int fd_out;
 	int fd_hist;
+	/* Decompression output file mapped shared over its full expected
+	 * size, so matches copy from history and tokens land without a
+	 * syscall each. NULL when writes go through fd_out. */
+	uchar *hist_map;
+	i64 hist_map_len;
 	i64 encloops;
 	i64 secs;
 	void (*pass_cb)(void *, char *, size_t); /* callback to get password in lib */
@@ -505,6 +571,8 @@ struct rzip_control {
 	/* Suite-3: full 16-byte salt + PBKDF2 params (CryptoDesc) */
 	uchar aead_salt[LRZ_AEAD_SALT_LEN];
 	unsigned int aead_iters;
+	uchar aead_suite;
+	uchar aead_archive_salt[LRZ_AEAD_ARCHIVE_SALT_LEN];	/* Suite 2 only */
 	uchar aead_key_hdr[LRZ_AEAD_KEY_LEN];
 	uchar aead_key_data[LRZ_AEAD_KEY_LEN];
 	/* Nonce uniqueness: random prefix + counters */
@@ -530,20 +598,19 @@ struct rzip_control {
 	i64 next_block_c_size;
 	i64 rcd_start;
 	bool lzma_prop_set;
-	/* LZ4 prefilter: test first backend block only, reuse for the rest */
-	bool lz4_test_done;
-	bool lz4_compressible;
 
-	cksem_t cksumsem;	/* MD5 producer: buffer free */
-	cksem_t cksum_worksem;	/* MD5 worker: job ready */
+	cksem_t cksumsem;	/* MD5 producer: free ring slots */
+	cksem_t cksum_worksem;	/* MD5 worker: queued ring slots */
 	pthread_t md5_thread;
 	md5_ctx ctx;
 	uchar md5_resblock[MD5_DIGEST_SIZE];
+	/* Tree hash root over the chunk digests, and the chunk sizes so that
+	 * -c can rebuild it from the written file */
+	md5_ctx tree_ctx;
+	i64 *tree_sizes;
+	int tree_chunks;
 	i64 md5_read; // How far into the file the md5 has done so far
 	struct checksum checksum;
-	/* Grow-only scratch for runzip literal/match tokens */
-	uchar *runzip_buf;
-	i64 runzip_buf_len;
 
 	const char *util_infile;
 	char delete_infile;
@@ -572,11 +639,36 @@ struct rzip_control {
 struct uncomp_thread {
 	uchar *s_buf;
 	i64 u_len, c_len;
-	i64 m_alloced;	/* bytes counted in stream_info.ram_alloced */
+	i64 m_alloced;	/* bytes counted against the look-ahead ram budget */
 	i64 last_head;
 	uchar c_type;
 	int busy;
 	int streamno;
+	int next;	/* Next slot queued for the same stream, -1 if none */
+	/* Plain LZMA output is handed over while it decodes: the first ready
+	 * bytes of dec_buf are final, and done is set as the thread returns.
+	 * Both are guarded by ready_lock in stream.c. */
+	uchar *dec_buf;
+	i64 ready;
+	bool done;
+	int seq;	/* Block number within its stream */
+	i64 skip;	/* Prime in front of the output of a primed block */
+	/* An encrypted block arrives still sealed in s_buf and is decrypted
+	 * in place by its thread, with the salt or nonce and tag read with it */
+	bool sealed;
+	uchar salt[SALT_LEN];
+	uchar nonce[LRZ_AEAD_NONCE_LEN];
+	uchar tag[LRZ_AEAD_TAG_LEN];
+	/* CRC32 of the uncompressed block, checked by its thread, and where
+	 * the block header sits for reporting a mismatch */
+	bool has_crc;
+	u32 crc;
+	i64 head_ofs;
+	/* Backend state kept between blocks */
+	void *lzma_dec;
+	void *zstrm;
+	void *bz_mem;
+	void *zpaq;
 };
 
 struct stream {
@@ -585,11 +677,15 @@ struct stream {
 	i64 buflen;
 	i64 bufp;
 	uchar eos;
-	long uthread_no;
-	long unext_thread;
-	long base_thread;
-	int total_threads;
+	int qhead, qtail;	/* Decompression slots queued in archive order */
+	int live;	/* Slot still decoding into buf, -1 if none */
 	i64 last_headofs;
+	/* Tail of the last block to prime the next one with. When reading,
+	 * started and taken count the stream's blocks and a primed block
+	 * waits under ready_lock until every block before it is taken. */
+	uchar *prime;
+	i64 prime_len;
+	int started, taken;
 };
 
 struct stream_info {
@@ -600,13 +696,18 @@ struct stream_info {
 	i64 cur_pos;
 	i64 initial_pos;
 	i64 total_read;
-	i64 ram_alloced;
 	i64 size;
+	/* Where the stream headers of an input chunk start */
+	i64 head_pos;
 	/* Absolute end of this RCD payload (0 = unknown); last_head/total_read bound */
 	i64 payload_end;
 	/* Absolute archive size for last_head checks when known (0 = unknown) */
 	i64 infile_size;
 	struct uncomp_thread *ucthreads;
+	pthread_t *pthreads;
+	int slots;
+	uchar eof;
+	bool looked_ahead;
 	long thread_no;
 	long next_thread;
 	int chunks;
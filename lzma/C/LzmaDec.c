@@ -925,6 +925,18 @@ void LzmaDec_Init(CLzmaDec *p)
   LzmaDec_InitDicAndState(p, True, True);
 }
 
+/* lrzip: start a stream written by LzmaEnc_MemEncodePrimed. The caller has
+   put the same primeLen bytes at the start of dic; decoding continues after
+   them and matches may reach back into them. */
+void LzmaDec_InitPrimed(CLzmaDec *p, SizeT primeLen)
+{
+  LzmaDec_Init(p);
+  p->dicPos = primeLen;
+  p->processedPos = (UInt32)primeLen;
+  if (primeLen >= p->prop.dicSize)
+    p->checkDicSize = p->prop.dicSize;
+}
+
 
 /*
 LZMA supports optional end_marker.
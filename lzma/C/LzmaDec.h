@@ -77,6 +77,7 @@ typedef struct
 #define LzmaDec_Construct(p) LzmaDec_CONSTRUCT(p)
 
 void LzmaDec_Init(CLzmaDec *p);
+void LzmaDec_InitPrimed(CLzmaDec *p, SizeT primeLen);
 
 /* There are two types of LZMA streams:
      - Stream with end mark. That end mark adds about 6 bytes to compressed size.
@@ -3090,6 +3090,18 @@ unsigned LzmaEnc_IsWriteEndMark(CLzmaEncHandle p)
 
 SRes LzmaEnc_MemEncode(CLzmaEncHandle p, Byte *dest, SizeT *destLen, const Byte *src, SizeT srcLen,
     int writeEndMark, ICompressProgressPtr progress, ISzAllocPtr alloc, ISzAllocPtr allocBig)
+{
+  return LzmaEnc_MemEncodePrimed(p, dest, destLen, src, srcLen, 0,
+      writeEndMark, progress, alloc, allocBig);
+}
+
+
+/* lrzip: the first primeLen bytes of src are a preset dictionary. They are
+   only run through the match finder, so the stream encodes src[primeLen..]
+   and a decoder must start with the same bytes already in its window
+   (see LzmaDec_InitPrimed). */
+SRes LzmaEnc_MemEncodePrimed(CLzmaEncHandle p, Byte *dest, SizeT *destLen, const Byte *src, SizeT srcLen,
+    SizeT primeLen, int writeEndMark, ICompressProgressPtr progress, ISzAllocPtr alloc, ISzAllocPtr allocBig)
 {
   SRes res;
   // GET_CLzmaEnc_p
@@ -3106,6 +3118,26 @@ SRes LzmaEnc_MemEncode(CLzmaEncHandle p, Byte *dest, SizeT *destLen, const Byte
 
   res = LzmaEnc_MemPrepare(p, src, srcLen, 0, alloc, allocBig);
   
+  if (res == SZ_OK && primeLen != 0)
+  {
+    if (primeLen >= srcLen)
+      res = SZ_ERROR_PARAM;
+    else
+    {
+      #ifndef Z7_ST
+      if (p->mtMode)
+        res = MatchFinderMt_InitMt(&p->matchFinderMt);
+      #endif
+      if (res == SZ_OK)
+      {
+        p->matchFinder.Init(p->matchFinderObj);
+        p->needInit = 0;
+        p->matchFinder.Skip(p->matchFinderObj, (UInt32)primeLen);
+        p->nowPos64 = primeLen;
+      }
+    }
+  }
+
   if (res == SZ_OK)
   {
     res = LzmaEnc_Encode2(p, progress);
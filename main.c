@@ -77,15 +77,24 @@ static void usage(bool compat)
 	print_output("General options:\n");
 	if (compat) {
 		print_output("	-c, --stdout		output to STDOUT\n");
-		print_output("	-C, --check		check integrity of file written on decompression\n");
-	} else
-		print_output("	-c, -C, --check		check integrity of file written on decompression\n");
+		print_output("	-C, --check		check integrity of file written on decompression,\n");
+		print_output("				or verify each block as it is compressed\n");
+	} else {
+		print_output("	-c, -C, --check		check integrity of file written on decompression,\n");
+		print_output("				or verify each block as it is compressed\n");
+	}
 	print_output("	-d, --decompress	decompress\n");
 	print_output("	-e, --encrypt[=password] password protected encryption on compression\n");
 	print_output("				default: AES-256-GCM + PBKDF2 (not 0.6-readable)\n");
 	print_output("	--legacy-encrypt	with -e, write 0.6-compatible AES-128-CBC (weaker)\n");
+	print_output("	--session-key		with -e, run the password KDF once for all files of this\n");
+	print_output("				run; each archive still gets its own keys\n");
 	print_output("	-h, -?, --help		show help\n");
 	print_output("	-H, --hash		display md5 hash integrity information\n");
+	print_output("	--tree-hash		store an MD5 of each chunk and a root over them, so that\n");
+	print_output("				chunks are checked in parallel (not readable by older versions)\n");
+	print_output("	--block-crc		store a CRC32 with each compressed block, checked as it\n");
+	print_output("				decodes (not readable by older versions)\n");
 	print_output("	-i, --info		show compressed file information\n");
 	if (compat) {
 		print_output("	-L, --license		display software version and license\n");
@@ -107,22 +116,28 @@ static void usage(bool compat)
 	print_output("	-K, --keep-broken	keep broken or damaged output files\n");
 	print_output("	-o, --outfile filename	specify the output file name and/or path\n");
 	print_output("	-O, --outdir directory	specify the output directory when -o is not used\n");
+	print_output("	    --range=START-END	with -d, only extract bytes START to END (or START- to the\n");
+	print_output("				end) of the original file, decompressing only the chunks\n");
+	print_output("				that hold them\n");
 	print_output("	-S, --suffix suffix	specify compressed suffix (default '.lrz')\n");
 	print_output("Options affecting compression:\n");
 	print_output("	--lzma			lzma compression (default)\n");
 	print_output("	-b, --bzip2		bzip2 compression\n");
 	print_output("	-g, --gzip		gzip compression using zlib\n");
 	print_output("	-l, --lzo		lzo compression (ultra fast)\n");
+	print_output("	    --lz4		lz4 compression, lz4hc above level 3 (fastest decompression)\n");
 	print_output("	-n, --no-compress	no backend compression - prepare for other compressor\n");
 	print_output("	-z, --zpaq		zpaq compression (best, extreme compression, extremely slow)\n");
+	print_output("	    --auto[=POLICY]	choose none, lzo, gzip or lzma for each block from a quick\n");
+	print_output("				probe. POLICY is speed, balanced (default) or ratio\n");
 	print_output("Low level options:\n");
 	if (compat) {
-		print_output("	-1 .. -9		set lzma/bzip2/gzip compression level (1-9, default 7)\n");
+		print_output("	-1 .. -9		set lzma/bzip2/gzip/lz4 compression level (1-9, default 7)\n");
 		print_output("	--fast			alias for -1\n");
 		print_output("	--best			alias for -9\n");
 	}
 	if (!compat)
-		print_output("	-L, --level level	set lzma/bzip2/gzip compression level (1-9, default 7)\n");
+		print_output("	-L, --level level	set lzma/bzip2/gzip/lz4 compression level (1-9, default 7)\n");
 	print_output("	-N, --nice-level value	Set nice value to value (default %d)\n", compat ? 0 : 19);
 	print_output("	-p, --threads value	Set processor count to override number of threads\n");
 	print_output("	-m, --maxram size	Set maximum available ram in hundreds of MB\n");
@@ -131,6 +146,9 @@ static void usage(bool compat)
 	print_output("	    --filter[=TYPE]	Reversible prefilter on lzma blocks. TYPE is auto (default),\n");
 	print_output("				x86, arm64, delta1 .. delta4, or none. auto trial\n");
 	print_output("				compresses a sample of each block and picks the winner\n");
+	print_output("	    --prime		Prime each lzma block with the tail of the previous block of\n");
+	print_output("				its stream so that small blocks keep their ratio. Blocks\n");
+	print_output("				of a stream then decompress one after another\n");
 	print_output("	-u, --ultra		Maximum compression modifier: single block per stream,\n");
 	print_output("				largest dictionaries, automatic prefilters. Much slower,\n");
 	print_output("				best possible ratio\n");
@@ -196,10 +214,15 @@ static void show_summary(void)
 		/* show compression options */
 		if (!DECOMPRESS && !TEST_ONLY) {
 			print_verbose("Compression mode is: ");
-			if (LZMA_COMPRESS)
+			if (control->auto_policy)
+				print_verbose("AUTO (%s) per block\n", control->auto_policy == LRZ_AUTO_SPEED ? "speed" :
+					      control->auto_policy == LRZ_AUTO_RATIO ? "ratio" : "balanced");
+			else if (LZMA_COMPRESS)
 				print_verbose("LZMA. LZ4 Compressibility testing %s\n", (LZ4_TEST? "enabled" : "disabled"));
 			else if (LZO_COMPRESS)
 				print_verbose("LZO\n");
+			else if (LZ4_COMPRESS)
+				print_verbose("LZ4%s\n", control->compression_level > 3 ? "HC" : "");
 			else if (BZIP2_COMPRESS)
 				print_verbose("BZIP2. LZ4 Compressibility testing %s\n", (LZ4_TEST? "enabled" : "disabled"));
 			else if (ZLIB_COMPRESS)
@@ -248,6 +271,7 @@ static struct option long_options[] = {
 	{"keep-broken",	no_argument,	0,	'k'},
 	{"keep-broken",	no_argument,	0,	'K'},
 	{"lzo",		no_argument,	0,	'l'},
+	{"lz4",		no_argument,	0,	'@'},
 	{"lzma",       	no_argument,	0,	'/'},
 	{"level",	optional_argument,	0,	'L'}, /* 15 */
 	{"license",	no_argument,	0,	'L'},
@@ -272,6 +296,12 @@ static struct option long_options[] = {
 	{"zpaq",	no_argument,	0,	'z'},
 	{"fast",	no_argument,	0,	'1'},
 	{"best",	no_argument,	0,	'9'},
+	{"auto",	optional_argument,	0,	'A'},
+	{"range",	required_argument,	0,	'R'},
+	{"prime",	no_argument,	0,	'I'},
+	{"session-key",	no_argument,	0,	'Y'},
+	{"tree-hash",	no_argument,	0,	'X'},
+	{"block-crc",	no_argument,	0,	'J'},
 	{0,	0,	0,	0},
 };
 
@@ -373,16 +403,27 @@ int main(int argc, char *argv[])
 
 	while ((c = getopt_long(argc, argv, compat ? coptions : loptions, long_options, &i)) != -1) {
 		switch (c) {
+		case 'A':							/* --auto, long option only */
+			if (!optarg || !strcmp(optarg, "balanced"))
+				control->auto_policy = LRZ_AUTO_BALANCED;
+			else if (!strcmp(optarg, "speed"))
+				control->auto_policy = LRZ_AUTO_SPEED;
+			else if (!strcmp(optarg, "ratio"))
+				control->auto_policy = LRZ_AUTO_RATIO;
+			else
+				failure("Invalid --auto policy '%s': use speed, balanced or ratio\n", optarg);
+			break;
 		case 'b':
 		case 'g':
 		case 'l':
 		case 'n':
 		case 'z':
+		case '@':						/* --lz4, long option only */
 			/* If some compression was chosen in lrzip.conf, allow this one time
 			 * because conf_file_compression_set will be true
 			 */
 			if ((control->flags & FLAG_NOT_LZMA) && conf_file_compression_set == false)
-				failure("Can only use one of -l, -b, -g, -z or -n\n");
+				failure("Can only use one of -l, -b, -g, -z, -n or --lz4\n");
 			/* Select Compression Mode */
 			control->flags &= ~FLAG_NOT_LZMA; /* must clear all compressions first */
 			if (c == 'b')
@@ -395,6 +436,8 @@ int main(int argc, char *argv[])
 				control->flags |= FLAG_NO_COMPRESS;
 			else if (c == 'z')
 				control->flags |= FLAG_ZPAQ_COMPRESS;
+			else if (c == '@')
+				control->flags |= FLAG_LZ4_COMPRESS;
 			/* now FLAG_NOT_LZMA will evaluate as true */
 			conf_file_compression_set = false;
 			break;
@@ -432,6 +475,9 @@ int main(int argc, char *argv[])
 			control->flags |= FLAG_ENCRYPT_LEGACY;
 			control->flags &= ~FLAG_ENCRYPT_AEAD;
 			break;
+		case 'Y':							/* --session-key, long option only */
+			control->flags |= FLAG_SESSION_KEY;
+			break;
 		case 'f':
 			control->flags |= FLAG_FORCE_REPLACE;
 			break;
@@ -458,10 +504,16 @@ int main(int argc, char *argv[])
 		case 'H':
 			control->flags |= FLAG_HASH;
 			break;
+		case 'J':							/* --block-crc, long option only */
+			control->flags |= FLAG_BLOCK_CRC;
+			break;
 		case 'i':
 			control->flags |= FLAG_INFO;
 			control->flags &= ~FLAG_DECOMPRESS;
 			break;
+		case 'I':							/* --prime, long option only */
+			control->flags |= FLAG_PRIME;
+			break;
 		case 'k':
 			if (compat) {
 				control->flags |= FLAG_KEEP_FILES;
@@ -484,6 +536,23 @@ int main(int argc, char *argv[])
 			if (*endptr)
 				failure("Extra characters after compression level: \'%s\'\n", endptr);
 			break;
+		case 'R':						/* --range, long option only */
+			/* START-END inclusive like an HTTP byte range, or START-
+			 * for everything from START on */
+			control->range_start = strtoll(optarg, &endptr, 10);
+			if (endptr == optarg || *endptr != '-' || control->range_start < 0)
+				failure("Invalid --range '%s': use START-END or START- in bytes\n", optarg);
+			if (*++endptr) {
+				char *last = endptr;
+
+				control->range_end = strtoll(last, &endptr, 10);
+				if (endptr == last || *endptr || control->range_end < control->range_start)
+					failure("Invalid --range '%s': use START-END or START- in bytes\n", optarg);
+				control->range_end++;
+			} else
+				control->range_end = -1;
+			control->flags |= FLAG_RANGE;
+			break;
 		case 'm':
 			control->ramsize = strtol(optarg, &endptr, 10) * 1024 * 1024 * 100;
 			if (*endptr)
@@ -557,6 +626,9 @@ int main(int argc, char *argv[])
 		case 'T':
 			control->flags &= ~FLAG_THRESHOLD;
 			break;
+		case 'X':							/* --tree-hash, long option only */
+			control->flags |= FLAG_TREE_HASH;
+			break;
 		case 'u':
 			control->flags |= FLAG_ULTRA;
 			break;
@@ -619,17 +691,26 @@ int main(int argc, char *argv[])
 	if (INFO && !SHOW_OUTPUT)
 		failure("Cannot show info and have no output.\n");
 
+	if (RANGE && !DECOMPRESS)
+		failure("--range only works when decompressing with -d\n");
+
 	if (ENCRYPT_LEGACY && !ENCRYPT)
 		failure("--legacy-encrypt requires -e / --encrypt\n");
 	if (ENCRYPT && ENCRYPT_LEGACY)
 		control->flags &= ~FLAG_ENCRYPT_AEAD;
 	else if (ENCRYPT && !ENCRYPT_AEAD && !ENCRYPT_LEGACY)
 		control->flags |= FLAG_ENCRYPT_AEAD;
+	/* Reading archives reuses a session master key whenever it can */
+	if (SESSION_KEY && !(DECOMPRESS || TEST_ONLY || INFO) && !ENCRYPT_AEAD)
+		failure("--session-key requires -e / --encrypt without --legacy-encrypt\n");
 
 	/* -e / --encrypt on decompress/test/info only provides the passphrase.
-	 * Whether the stream is encrypted (and mode) comes from magic. */
+	 * Whether the stream is encrypted (and mode), and whether its blocks
+	 * are primed or tree hashed, comes from magic; block CRCs are marked
+	 * in each block's type. */
 	if (DECOMPRESS || TEST_ONLY || INFO)
-		control->flags &= ~(FLAG_ENCRYPT | FLAG_ENCRYPT_AEAD | FLAG_ENCRYPT_LEGACY);
+		control->flags &= ~(FLAG_ENCRYPT | FLAG_ENCRYPT_AEAD | FLAG_ENCRYPT_LEGACY |
+				    FLAG_PRIME | FLAG_TREE_HASH | FLAG_BLOCK_CRC);
 
 	if (VERBOSE && !SHOW_PROGRESS) {
 		print_err("Cannot have -v and -q options. -v wins.\n");
@@ -653,9 +734,10 @@ int main(int argc, char *argv[])
 	 * large block with a dictionary sized to ram instead of splitting
 	 * chunks into one block per thread, since independently compressed
 	 * blocks cost ratio. Parallelism is sacrificed deliberately; -p can
-	 * still force multiple threads. */
+	 * still force multiple threads, and --prime keeps them since primed
+	 * lzma blocks lose little to being split. */
 	if (ULTRA && (LZMA_COMPRESS || ZPAQ_COMPRESS) && !threads_set &&
-	    !(DECOMPRESS || TEST_ONLY || INFO)) {
+	    !(PRIME && LZMA_COMPRESS) && !(DECOMPRESS || TEST_ONLY || INFO)) {
 		control->threads = 1;
 		print_verbose("Ultra maximum compression: using single block per stream\n");
 	}
@@ -673,6 +755,13 @@ int main(int argc, char *argv[])
 	 * chosen per block and recorded in the block type byte. */
 	if (control->filter_mode && !(DECOMPRESS || TEST_ONLY || INFO) && !LZMA_COMPRESS)
 		failure("--filter only works with the lzma back end\n");
+	if (PRIME && !LZMA_COMPRESS)
+		failure("--prime only works with the lzma back end\n");
+
+	/* --auto picks the backend per block itself, starting from the lzma
+	 * setup so any lzma block it chooses is sized correctly. */
+	if (control->auto_policy && !(DECOMPRESS || TEST_ONLY || INFO) && !LZMA_COMPRESS)
+		failure("--auto cannot be combined with -b, -g, -l, -n, -z or --lz4\n");
 
 	setup_overhead(control);
 
@@ -782,11 +871,13 @@ recursion:
 			}
 		}
 
+		/* On compression -c verifies each block and chunk as it is
+		 * written instead */
 		if (CHECK_FILE) {
-			if (!DECOMPRESS) {
-				print_err("Can only check file written on decompression.\n");
+			if (TEST_ONLY || INFO) {
+				print_err("Can only check file written on compression or decompression.\n");
 				control->flags &= ~FLAG_CHECK;
-			} else if (STDOUT) {
+			} else if (DECOMPRESS && STDOUT) {
 				print_err("Can't check file written when writing to stdout. Checking disabled.\n");
 				control->flags &= ~FLAG_CHECK;
 			}
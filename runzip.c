@@ -22,6 +22,9 @@
 #endif
 
 #include <sys/types.h>
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
 #ifdef HAVE_SYS_STAT_H
 # include <sys/stat.h>
 #endif
@@ -40,6 +43,7 @@
 # include <arpa/inet.h>
 #endif
 
+#include <fcntl.h>
 #include <inttypes.h>
 #include <string.h>
 
@@ -56,16 +60,60 @@
  * millions of them thrash read_stream; fill a few KiB at a time instead. */
 #define RUNZIP_S0_WIN 4096
 
+/* Match sources further back than this in mapped history may have been
+ * written back and dropped from the page cache, so ask for them early. */
+#define HIST_PREFETCH_DIST (64 * 1024 * 1024)
+
+/* A prefiltered chunk rebuilt in memory is unfiltered to the output this
+ * many bytes at a time, lagging behind reconstruction */
+#define UNFILTER_STEP (1024 * 1024)
+
 struct runzip_s0 {
 	uchar buf[RUNZIP_S0_WIN];
 	unsigned pos;
 	unsigned end;
 };
 
+/* Reconstruction state of one chunk. Chunks rebuilt in parallel each have
+ * their own: they write with pwrite at out_pos, read history back with
+ * pread and leave the MD5 to be computed in archive order afterwards. */
+struct runzip_state {
+	void *ss;
+	struct runzip_s0 s0;
+	/* Grow-only scratch for literal/match tokens */
+	uchar *buf;
+	i64 buf_len;
+	i64 out_pos;		/* Output offset of the next byte */
+	i64 chunk_start;	/* Output offset the chunk starts at */
+	/* Mapped history, hist[0] being output offset hist_base: the output
+	 * file itself, or just this chunk in memory when only testing */
+	uchar *hist;
+	i64 hist_base;
+	i64 out_end;		/* Mapped output may not be written past here */
+	/* Prefetch scan of the tokens buffered in s0: the next unscanned
+	 * byte and the output offset of the token it starts */
+	unsigned pf_pos;
+	i64 pf_out;
+	uint32 cksum;
+	uchar digest[MD5_DIGEST_SIZE];	/* MD5 of the chunk (tree hash) */
+	char chunk_bytes;	/* Width of match offsets */
+	char chunk_filter;
+	bool parallel;
+	/* A prefiltered chunk is rebuilt in the private map unf_map, which
+	 * is hist while it lasts, and written out unfiltered up to unf_pos
+	 * as it goes: through out_map, the history it replaced, or unf_buf */
+	uchar *unf_map;
+	i64 unf_size;
+	uchar *out_map;
+	i64 unf_pos;
+	uchar *unf_buf;
+	struct lrz_filter_stream unf;
+};
+
 /* Ensure at least need bytes are buffered from stream 0. */
-static int s0_need(rzip_control *control, void *ss, struct runzip_s0 *s0,
-		   unsigned need)
+static int s0_need(rzip_control *control, struct runzip_state *st, unsigned need)
 {
+	struct runzip_s0 *s0 = &st->s0;
 	unsigned have = s0->end - s0->pos;
 	i64 got, space;
 
@@ -74,6 +122,7 @@ static int s0_need(rzip_control *control, void *ss, struct runzip_s0 *s0,
 	if (s0->pos) {
 		if (have)
 			memmove(s0->buf, s0->buf + s0->pos, have);
+		st->pf_pos = st->pf_pos > s0->pos ? st->pf_pos - s0->pos : 0;
 		s0->pos = 0;
 		s0->end = have;
 	}
@@ -81,7 +130,7 @@ static int s0_need(rzip_control *control, void *ss, struct runzip_s0 *s0,
 		space = RUNZIP_S0_WIN - s0->end;
 		if (unlikely(space <= 0))
 			return -1;
-		got = read_stream(control, ss, 0, s0->buf + s0->end, space);
+		got = read_stream(control, st->ss, 0, s0->buf + s0->end, space);
 		if (unlikely(got < 0))
 			return -1;
 		if (got == 0)
@@ -94,29 +143,27 @@ static int s0_need(rzip_control *control, void *ss, struct runzip_s0 *s0,
 	return (s0->end - s0->pos >= need) ? 0 : -1;
 }
 
-static inline i64 s0_vchars(rzip_control *control, void *ss,
-			    struct runzip_s0 *s0, int length)
+static inline i64 s0_vchars(rzip_control *control, struct runzip_state *st, int length)
 {
 	i64 s = 0;
 
-	if (unlikely(s0_need(control, ss, s0, (unsigned)length)))
+	if (unlikely(s0_need(control, st, (unsigned)length)))
 		fatal_return(("Stream read of %d bytes failed\n", length), -1);
-	memcpy(&s, s0->buf + s0->pos, (size_t)length);
-	s0->pos += (unsigned)length;
+	memcpy(&s, st->s0.buf + st->s0.pos, (size_t)length);
+	st->s0.pos += (unsigned)length;
 	return le64toh(s);
 }
 
-static inline u32 s0_u32(rzip_control *control, void *ss, struct runzip_s0 *s0,
-			 bool *err)
+static inline u32 s0_u32(rzip_control *control, struct runzip_state *st, bool *err)
 {
 	u32 ret;
 
-	if (unlikely(s0_need(control, ss, s0, 4))) {
+	if (unlikely(s0_need(control, st, 4))) {
 		*err = true;
 		fatal_return(("Stream read u32 failed\n"), 0);
 	}
-	memcpy(&ret, s0->buf + s0->pos, 4);
-	s0->pos += 4;
+	memcpy(&ret, st->s0.buf + st->s0.pos, 4);
+	st->s0.pos += 4;
 	return le32toh(ret);
 }
 
@@ -176,13 +223,13 @@ static i64 seekto_fdinend(rzip_control *control)
 }
 
 /* head (1) + length (control->chunk_bytes, usually 2) in one window fill. */
-static i64 read_header(rzip_control *control, void *ss, struct runzip_s0 *s0,
-		       uchar *head)
+static i64 read_header(rzip_control *control, struct runzip_state *st, uchar *head)
 {
+	struct runzip_s0 *s0 = &st->s0;
 	int lb = control->chunk_bytes;
 	i64 s = 0;
 
-	if (unlikely(s0_need(control, ss, s0, (unsigned)(1 + lb))))
+	if (unlikely(s0_need(control, st, (unsigned)(1 + lb))))
 		return -1;
 	*head = s0->buf[s0->pos++];
 	memcpy(&s, s0->buf + s0->pos, (size_t)lb);
@@ -192,127 +239,96 @@ static i64 read_header(rzip_control *control, void *ss, struct runzip_s0 *s0,
 
 /* Grow-only scratch for literal/match tokens — avoids malloc/free per token.
  * Token lengths are format-capped at LRZIP_MAX_TOKEN_LEN (0xFFFF). */
-static uchar *runzip_get_buf(rzip_control *control, i64 len)
+static uchar *runzip_get_buf(struct runzip_state *st, i64 len)
 {
 	uchar *nbuf;
 
 	if (unlikely(!lrzip_size_ok(len, LRZIP_MAX_TOKEN_LEN)))
 		return NULL;
-	if (likely(len <= control->runzip_buf_len))
-		return control->runzip_buf;
-	nbuf = realloc(control->runzip_buf, (size_t)len);
+	if (likely(len <= st->buf_len))
+		return st->buf;
+	nbuf = realloc(st->buf, (size_t)len);
 	if (unlikely(!nbuf))
 		return NULL;
-	control->runzip_buf = nbuf;
-	control->runzip_buf_len = len;
+	st->buf = nbuf;
+	st->buf_len = len;
 	return nbuf;
 }
 
-/* ---- Batched MD5 worker (same semaphore protocol as compress) ---- */
-#define RUNZIP_MD5_CHUNK (1024 * 1024)
-
-static void *runzip_md5_worker(void *data)
+/* Where len bytes at the chunk's output position go in mapped history, or
+ * NULL if they would run past the end of what the chunk may write */
+static uchar *hist_at(rzip_control *control, struct runzip_state *st, i64 len)
 {
-	rzip_control *control = (rzip_control *)data;
-
-	while (42) {
-		cksem_wait(control, &control->cksum_worksem);
-		if (control->checksum.shutdown) {
-			cksem_post(control, &control->cksumsem);
-			break;
-		}
-		if (control->checksum.len > 0)
-			md5_process_bytes(control->checksum.buf, control->checksum.len,
-					  &control->ctx);
-		cksem_post(control, &control->cksumsem);
+	if (unlikely(st->out_pos + len > st->out_end)) {
+		print_err("Output of %"PRId64" bytes at %"PRId64" overruns expected size\n",
+			  len, st->out_pos);
+		return NULL;
 	}
-	return NULL;
+	return st->hist + (st->out_pos - st->hist_base);
 }
 
-static void runzip_md5_start(rzip_control *control)
+/* Write reconstructed bytes at the chunk's output position */
+static i64 put_out(rzip_control *control, struct runzip_state *st, uchar *buf, i64 len)
 {
-	i64 cap = RUNZIP_MD5_CHUNK;
+	if (st->hist) {
+		uchar *dst = hist_at(control, st, len);
 
-	round_to_page(&cap);
-	control->checksum.capacity = cap;
-	control->checksum.buf = malloc((size_t)cap);
-	if (unlikely(!control->checksum.buf))
-		failure("Failed to allocate MD5 batch buffer\n");
-	control->checksum.len = 0;
-	control->checksum.shutdown = 0;
-	control->checksum.filling = 0;
-
-	cksem_init(control, &control->cksumsem);
-	cksem_post(control, &control->cksumsem);
-	cksem_init(control, &control->cksum_worksem);
-
-	if (unlikely(!create_pthread(control, &control->md5_thread, NULL,
-				     runzip_md5_worker, control)))
-		failure("Failed to start MD5 worker thread\n");
-}
-
-/* Flush any partial batch, wait for the worker to go idle, then join. */
-static void runzip_md5_stop(rzip_control *control)
-{
-	if (control->checksum.filling) {
-		if (control->checksum.len > 0)
-			cksem_post(control, &control->cksum_worksem);
-		else
-			cksem_post(control, &control->cksumsem);
-		control->checksum.filling = 0;
+		if (unlikely(!dst))
+			return -1;
+		memcpy(dst, buf, (size_t)len);
+		return len;
 	}
-
-	cksem_wait(control, &control->cksumsem);
-	control->checksum.shutdown = 1;
-	control->checksum.len = 0;
-	cksem_post(control, &control->cksum_worksem);
-	if (unlikely(!join_pthread(control, control->md5_thread, NULL)))
-		failure("Failed to join MD5 worker thread\n");
-	dealloc(control->checksum.buf);
-	control->checksum.capacity = 0;
-	control->checksum.buf = NULL;
+	if (!st->parallel)
+		return write_all(control, buf, len);
+	if (unlikely(pwrite(control->fd_out, buf, (size_t)len, st->out_pos) != (ssize_t)len))
+		return -1;
+	return len;
 }
 
-/* Append to the batch buffer; submit full buffers to the worker. */
-static void runzip_md5_update(rzip_control *control, const uchar *data, i64 n)
+/* Queue a chunk that was rebuilt in parallel for MD5, in archive order, from
+ * its mapped history or read back from the output */
+static bool runzip_md5_range(rzip_control *control, struct runzip_state *st,
+			     i64 start, i64 len)
 {
-	while (n > 0) {
+	if (st->hist) {
+		md5_ring_add(control, st->hist + (start - st->hist_base), len);
+		return true;
+	}
+	while (len > 0) {
 		i64 space, c;
-
-		if (!control->checksum.filling) {
-			cksem_wait(control, &control->cksumsem);
-			control->checksum.len = 0;
-			control->checksum.filling = 1;
-		}
-		space = control->checksum.capacity - control->checksum.len;
-		c = MIN(n, space);
-		memcpy(control->checksum.buf + control->checksum.len, data, (size_t)c);
-		control->checksum.len += c;
-		data += c;
-		n -= c;
-		if (control->checksum.len == control->checksum.capacity) {
-			cksem_post(control, &control->cksum_worksem);
-			control->checksum.filling = 0;
-		}
+		uchar *p = md5_ring_space(control, &space);
+
+		c = MIN(len, space);
+		if (unlikely(pread(control->fd_hist, p, (size_t)c, start) != (ssize_t)c))
+			fatal_return(("Failed to pread output for MD5 at %"PRId64"\n", start), false);
+		md5_ring_commit(control, c);
+		start += c;
+		len -= c;
 	}
+	return true;
 }
 
-static inline void match_cksum(rzip_control *control, uint32 *cksum,
+static inline void match_cksum(rzip_control *control, struct runzip_state *st,
 			       const uchar *buf, i64 n)
 {
 	/* Chunk filtered archives are reconstructed in the filtered domain;
 	 * checksums of the original bytes are computed during the unfilter
 	 * pass at the end of the chunk instead. */
-	if (control->chunk_filter != LRZ_FILTER_NONE)
+	if (st->chunk_filter != LRZ_FILTER_NONE)
 		return;
 	if (!HAS_MD5)
-		*cksum = CrcUpdate(*cksum, buf, n);
-	if (!NO_MD5)
-		runzip_md5_update(control, buf, n);
+		st->cksum = CrcUpdate(st->cksum, buf, n);
+	if (NO_MD5 || st->parallel)
+		return;
+	/* Mapped history is not unmapped before the MD5 is drained, but
+	 * scratch and tmp_outbuf are reused */
+	if (st->hist)
+		md5_ring_add(control, buf, n);
+	else
+		md5_ring_copy(control, buf, n);
 }
 
-static i64 unzip_literal(rzip_control *control, void *ss, i64 len,
-			 uint32 *cksum, i64 *out_pos)
+static i64 unzip_literal(rzip_control *control, struct runzip_state *st, i64 len)
 {
 	i64 stream_read;
 	uchar *buf;
@@ -326,23 +342,30 @@ static i64 unzip_literal(rzip_control *control, void *ss, i64 len,
 	if (unlikely(len > LRZIP_MAX_TOKEN_LEN))
 		failure_return(("Literal length %"PRId64" exceeds format max\n", len), -1);
 
-	buf = runzip_get_buf(control, len);
+	/* Mapped history: read the literal straight into place */
+	if (st->hist) {
+		buf = hist_at(control, st, len);
+		if (unlikely(!buf))
+			return -1;
+	} else
+		buf = runzip_get_buf(st, len);
 	if (unlikely(!buf))
 		fatal_return(("Failed to malloc literal buffer of size %"PRId64"\n", len), -1);
 
-	stream_read = read_stream(control, ss, 1, buf, len);
+	stream_read = read_stream(control, st->ss, 1, buf, len);
 	if (unlikely(stream_read == -1 ))
 		fatal_return(("Failed to read_stream in unzip_literal\n"), -1);
 	if (unlikely(stream_read != len))
 		failure_return(("Short literal read %"PRId64" of %"PRId64" (corrupt archive)\n",
 			       stream_read, len), -1);
 
-	if (unlikely(write_all(control, buf, stream_read) != stream_read))
+	if (!st->hist &&
+	    unlikely(put_out(control, st, buf, stream_read) != stream_read))
 		fatal_return(("Failed to write literal buffer of size %"PRId64"\n", stream_read), -1);
 
-	match_cksum(control, cksum, buf, stream_read);
+	match_cksum(control, st, buf, stream_read);
 
-	*out_pos += stream_read;
+	st->out_pos += stream_read;
 	return stream_read;
 }
 
@@ -372,8 +395,7 @@ static void match_expand(uchar *buf, i64 period, i64 offset, i64 len)
 	}
 }
 
-static i64 unzip_match(rzip_control *control, void *ss, struct runzip_s0 *s0,
-		       i64 len, uint32 *cksum, int chunk_bytes, i64 *out_pos)
+static i64 unzip_match(rzip_control *control, struct runzip_state *st, i64 len)
 {
 	i64 offset, period, cur_pos, hist;
 	uchar *buf;
@@ -385,21 +407,43 @@ static i64 unzip_match(rzip_control *control, void *ss, struct runzip_s0 *s0,
 		failure_return(("Match length %"PRId64" exceeds format max\n", len), -1);
 
 	/* Tracked write position — avoids lseek(SEEK_CUR) every match. */
-	cur_pos = *out_pos;
+	cur_pos = st->out_pos;
 
 	/* Note the offset is in a different format v0.40+ */
-	offset = s0_vchars(control, ss, s0, chunk_bytes);
+	offset = s0_vchars(control, st, st->chunk_bytes);
 	if (unlikely(offset == -1))
 		return -1;
 
 	if (unlikely(offset < 1 || offset > cur_pos))
 		failure_return(("Match offset %"PRId64" out of range at pos %"PRId64"\n",
 			       offset, cur_pos), -1);
+	/* rzip never matches across chunks, and when chunks are rebuilt in
+	 * parallel the previous one may not be written yet */
+	if (unlikely(st->parallel && offset > cur_pos - st->chunk_start))
+		failure_return(("Match offset %"PRId64" reaches outside its chunk at pos %"PRId64"\n",
+			       offset, cur_pos), -1);
 
 	period = MIN(len, offset);
 	if (unlikely(period < 1))
 		fatal_return(("Failed fd history in unzip_match due to corrupt archive\n"), -1);
 
+	/* Mapped history: the first period never overlaps its destination,
+	 * later ones repeat it from the output just written */
+	if (st->hist) {
+		uchar *dst = hist_at(control, st, len);
+
+		if (unlikely(offset > st->out_pos - st->hist_base))
+			failure_return(("Match offset %"PRId64" reaches outside its chunk at pos %"PRId64"\n",
+				       offset, cur_pos), -1);
+		if (unlikely(!dst))
+			return -1;
+		memcpy(dst, dst - offset, (size_t)period);
+		match_expand(dst, period, offset, len);
+		match_cksum(control, st, dst, len);
+		st->out_pos += len;
+		return len;
+	}
+
 	/*
 	 * In-RAM history (stdout / tmp buffer): expand the match directly in
 	 * tmp_outbuf — no intermediate scratch, one integrity pass.
@@ -419,44 +463,90 @@ static i64 unzip_match(rzip_control *control, void *ss, struct runzip_s0 *s0,
 
 			memcpy(out + dest, out + hist, (size_t)period);
 			match_expand(out + dest, period, offset, len);
-			match_cksum(control, cksum, out + dest, len);
+			match_cksum(control, st, out + dest, len);
 			control->out_ofs = dest + len;
 			if (control->out_ofs > control->out_len)
 				control->out_len = control->out_ofs;
-			*out_pos += len;
+			st->out_pos += len;
 			return len;
 		}
 		/* Falls through when the match will not fit in tmp_outbuf. */
 	}
 
-	if (unlikely(seekto_fdhist(control, cur_pos - offset) == -1))
-		fatal_return(("Seek failed by %"PRId64" from %"PRId64" on history file in unzip_match\n",
-		      offset, cur_pos), -1);
-
 	/* File path (or tmp overflow): pull one period, expand full match in
 	 * scratch (len ≤ 0xFFFF), one write + one integrity pass. */
-	buf = runzip_get_buf(control, len);
+	buf = runzip_get_buf(st, len);
 	if (unlikely(!buf))
 		fatal_return(("Failed to malloc match buffer of size %"PRId64"\n", len), -1);
 
-	if (unlikely(read_fdhist(control, buf, period) != period))
-		fatal_return(("Failed to read %"PRId64" bytes in unzip_match\n", period), -1);
+	if (st->parallel) {
+		if (unlikely(pread(control->fd_hist, buf, (size_t)period,
+				   cur_pos - offset) != (ssize_t)period))
+			fatal_return(("Failed to pread %"PRId64" bytes in unzip_match\n", period), -1);
+	} else {
+		if (unlikely(seekto_fdhist(control, cur_pos - offset) == -1))
+			fatal_return(("Seek failed by %"PRId64" from %"PRId64" on history file in unzip_match\n",
+			      offset, cur_pos), -1);
+		if (unlikely(read_fdhist(control, buf, period) != period))
+			fatal_return(("Failed to read %"PRId64" bytes in unzip_match\n", period), -1);
+	}
 
 	match_expand(buf, period, offset, len);
 
-	if (unlikely(write_all(control, buf, len) != (ssize_t)len))
+	if (unlikely(put_out(control, st, buf, len) != len))
 		fatal_return(("Failed to write %"PRId64" bytes in unzip_match\n", len), -1);
 
-	match_cksum(control, cksum, buf, len);
-	*out_pos += len;
+	match_cksum(control, st, buf, len);
+	st->out_pos += len;
 	return len;
 }
 
+/* Walk the match tokens already buffered from stream 0 and ask for any
+ * distant history they will copy from to be paged in before it is needed.
+ * Called between tokens, when out_pos is the output of the next one. */
+static void hist_prefetch(rzip_control *control, struct runzip_state *st)
+{
+	struct runzip_s0 *s0 = &st->s0;
+	unsigned lb = control->chunk_bytes, ob = st->chunk_bytes;
+
+	if (st->pf_pos <= s0->pos) {
+		st->pf_pos = s0->pos;
+		st->pf_out = st->out_pos;
+	}
+	while (s0->end - st->pf_pos >= 1 + lb) {
+		i64 len = 0, offset = 0, src, end;
+		uchar *p = s0->buf + st->pf_pos;
+
+		memcpy(&len, p + 1, lb);
+		len = le64toh(len);
+		if (!*p) {
+			/* A zero length literal ends the chunk */
+			if (!len)
+				break;
+			st->pf_pos += 1 + lb;
+			st->pf_out += len;
+			continue;
+		}
+		if (s0->end - st->pf_pos < 1 + lb + ob)
+			break;
+		memcpy(&offset, p + 1 + lb, ob);
+		offset = le64toh(offset);
+		st->pf_pos += 1 + lb + ob;
+		src = st->pf_out - offset;
+		st->pf_out += len;
+		if (offset < HIST_PREFETCH_DIST || src < st->hist_base)
+			continue;
+		end = src + MIN(len, offset) - st->hist_base;
+		src = (src - st->hist_base) & ~(i64)(control->page_size - 1);
+		madvise(st->hist + src, (size_t)(end - src), MADV_WILLNEED);
+	}
+}
+
 /* Reverse a chunk prefilter over the reconstructed output region
  * [start, start + len) and feed the checksums with the restored original
  * bytes. Reconstruction happens in the filtered domain (matches reference
  * filtered history), so this must run after the whole chunk is written. */
-static bool unfilter_chunk(rzip_control *control, i64 start, i64 len, uint32 *cksum)
+static bool unfilter_chunk(rzip_control *control, struct runzip_state *st, i64 start, i64 len)
 {
 	struct lrz_filter_stream fs;
 	const i64 slice = 16 * 1024 * 1024;
@@ -466,7 +556,18 @@ static bool unfilter_chunk(rzip_control *control, i64 start, i64 len, uint32 *ck
 	if (!len)
 		return true;
 
-	lrz_filter_stream_init(&fs, control->chunk_filter, false);
+	lrz_filter_stream_init(&fs, st->chunk_filter, false);
+
+	if (st->hist) {
+		uchar *p = st->hist + (start - st->hist_base);
+
+		lrz_filter_stream_conv(&fs, p, len, true);
+		if (!HAS_MD5)
+			st->cksum = CrcUpdate(st->cksum, p, len);
+		if (!NO_MD5 && !st->parallel)
+			md5_ring_add(control, p, len);
+		return true;
+	}
 
 	if (TMP_OUTBUF) {
 		uchar *p = control->tmp_outbuf + (start - control->out_relofs);
@@ -478,9 +579,9 @@ static bool unfilter_chunk(rzip_control *control, i64 start, i64 len, uint32 *ck
 		}
 		lrz_filter_stream_conv(&fs, p, len, true);
 		if (!HAS_MD5)
-			*cksum = CrcUpdate(*cksum, p, len);
+			st->cksum = CrcUpdate(st->cksum, p, len);
 		if (!NO_MD5)
-			runzip_md5_update(control, p, len);
+			md5_ring_copy(control, p, len);
 		return true;
 	}
 
@@ -508,9 +609,9 @@ static bool unfilter_chunk(rzip_control *control, i64 start, i64 len, uint32 *ck
 			fatal_return(("Failed to pwrite in unfilter_chunk\n"), false);
 		}
 		if (!HAS_MD5)
-			*cksum = CrcUpdate(*cksum, buf, done);
-		if (!NO_MD5)
-			runzip_md5_update(control, buf, done);
+			st->cksum = CrcUpdate(st->cksum, buf, done);
+		if (!NO_MD5 && !st->parallel)
+			md5_ring_copy(control, buf, done);
 		carry = total - done;
 		if (carry)
 			memmove(buf, buf + done, (size_t)carry);
@@ -520,28 +621,104 @@ static bool unfilter_chunk(rzip_control *control, i64 start, i64 len, uint32 *ck
 	return true;
 }
 
-/* decompress a section of an open file. Call fatal_return(() on error
-   return the number of bytes that have been retrieved
- */
-static i64 runzip_chunk(rzip_control *control, int fd_in, i64 expected_size, i64 tally)
+/* Rather than write a prefiltered chunk out filtered and read it all back
+ * to unfilter it, rebuild it in private memory, where matches find their
+ * filtered history, and unfilter it to the output as reconstruction moves
+ * on. Only the branch converters can be run a piece at a time. */
+static bool unfilter_start(rzip_control *control, struct runzip_state *st, i64 size)
 {
-	uint32 good_cksum, cksum = 0;
-	i64 len, ofs, total = 0, out_pos, progress_at = 0;
-	int l = -1, p = 0;
-	char chunk_bytes;
-	struct runzip_s0 s0;
-	struct stat st;
-	uchar head;
-	void *ss;
-	bool err = false;
-	/* Progress at most every 64KiB (same cadence as compress). */
-	const i64 progress_bytes = 64 * 1024;
+	void *map;
+
+	if ((st->chunk_filter != LRZ_FILTER_X86 && st->chunk_filter != LRZ_FILTER_ARM64) ||
+	    TMP_OUTBUF || size <= 0 || (i64)(size_t)size != size ||
+	    size > control->ramsize - control->maxram ||
+	    (st->hist && (st->hist != control->hist_map ||
+			  st->chunk_start + size > st->out_end)))
+		return false;
+	map = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED) {
+		print_maxverbose("Unable to map %"PRId64" bytes to unfilter a chunk in\n", size);
+		return false;
+	}
+	if (!st->hist) {
+		st->unf_buf = malloc(UNFILTER_STEP);
+		if (unlikely(!st->unf_buf)) {
+			munmap(map, (size_t)size);
+			return false;
+		}
+	}
+	st->unf_map = map;
+	st->unf_size = size;
+	st->out_map = st->hist;
+	st->hist = map;
+	st->hist_base = st->unf_pos = st->chunk_start;
+	st->out_end = st->chunk_start + size;
+	lrz_filter_stream_init(&st->unf, st->chunk_filter, false);
+	print_maxverbose("Rebuilding prefiltered chunk of %"PRId64" bytes in memory\n", size);
+	return true;
+}
 
+/* Unfilter what has been rebuilt since the last call to the output and
+ * feed the checksums with it. A few bytes that may start an instruction
+ * are left for next time unless this is the end of the chunk. */
+static bool unfilter_flush(rzip_control *control, struct runzip_state *st, bool last)
+{
+	while (st->unf_pos < st->out_pos) {
+		i64 n = st->out_pos - st->unf_pos, done;
+		uchar *p;
+
+		if (st->out_map)
+			p = st->out_map + st->unf_pos;
+		else {
+			p = st->unf_buf;
+			n = MIN(n, UNFILTER_STEP);
+		}
+		memcpy(p, st->hist + (st->unf_pos - st->hist_base), (size_t)n);
+		done = lrz_filter_stream_conv(&st->unf, p, n, last && st->unf_pos + n == st->out_pos);
+		if (!done)
+			break;
+		if (!st->out_map) {
+			if (st->parallel) {
+				if (unlikely(pwrite(control->fd_out, p, (size_t)done, st->unf_pos) != (ssize_t)done))
+					fatal_return(("Failed to pwrite in unfilter_flush\n"), false);
+			} else if (unlikely(write_all(control, p, done) != done))
+				fatal_return(("Failed to write in unfilter_flush\n"), false);
+		}
+		if (!HAS_MD5)
+			st->cksum = CrcUpdate(st->cksum, p, done);
+		if (!NO_MD5 && !st->parallel) {
+			if (st->out_map)
+				md5_ring_add(control, p, done);
+			else
+				md5_ring_copy(control, p, done);
+		}
+		st->unf_pos += done;
+	}
+	return true;
+}
+
+/* Drop the private map and leave the chunk's history as it was before */
+static void unfilter_end(struct runzip_state *st)
+{
+	if (!st->unf_map)
+		return;
+	munmap(st->unf_map, (size_t)st->unf_size);
+	st->unf_map = NULL;
+	st->hist = st->out_map;
+	st->hist_base = 0;
+	dealloc(st->unf_buf);
+}
+
+/* Show decompression progress each time it crosses another 10%; *last is
+ * the percentage shown last */
+static void show_progress(rzip_control *control, i64 done, i64 expected_size, int *last)
+{
 	/* for display of progress */
 	unsigned long divisor[] = {1,1024,1048576,1073741824U};
 	char *suffix[] = {"","KB","MB","GB"};
 	double prog_done, prog_tsize;
-	int divisor_index;
+	int divisor_index, p;
 
 	if (expected_size > (i64)10737418240ULL)	/* > 10GB */
 		divisor_index = 3;
@@ -552,7 +729,262 @@ static i64 runzip_chunk(rzip_control *control, int fd_in, i64 expected_size, i64
 	else
 		divisor_index = 0;
 
+	p = (int)((100 * done) / expected_size);
+	if (p > 100)
+		p = 100;
+	if (p / 10 == *last / 10)
+		return;
 	prog_tsize = (long double)expected_size / (long double)divisor[divisor_index];
+	prog_done = (double)done / (double)divisor[divisor_index];
+	print_progress("%3d%%  %9.2f / %9.2f %s\r",
+			p, prog_done, prog_tsize,
+			suffix[divisor_index]);
+	*last = p;
+}
+
+/* MD5 of a chunk rebuilt on its own thread, from its mapped history or
+ * read back from the output */
+static bool chunk_md5(rzip_control *control, struct runzip_state *st, i64 start, i64 len)
+{
+	md5_ctx ctx;
+	uchar *buf;
+
+	md5_init_ctx(&ctx);
+	if (st->hist) {
+		md5_process_bytes(st->hist + (start - st->hist_base), (size_t)len, &ctx);
+		md5_finish_ctx(&ctx, st->digest);
+		return true;
+	}
+	buf = malloc(CKSUM_CHUNK);
+	if (unlikely(!buf))
+		fatal_return(("Failed to allocate chunk MD5 buffer\n"), false);
+	while (len > 0) {
+		i64 n = MIN(len, CKSUM_CHUNK);
+
+		if (unlikely(pread(control->fd_hist, buf, (size_t)n, start) != (ssize_t)n)) {
+			dealloc(buf);
+			fatal_return(("Failed to pread output for chunk MD5 at %"PRId64"\n", start), false);
+		}
+		md5_process_bytes(buf, (size_t)n, &ctx);
+		start += n;
+		len -= n;
+	}
+	dealloc(buf);
+	md5_finish_ctx(&ctx, st->digest);
+	return true;
+}
+
+/* A tree hash follows the end marker of stream 0 with the MD5 of the chunk.
+ * Chunks rebuilt in parallel hash themselves on their own thread, others
+ * take what the MD5 worker has built up since the last chunk. */
+static bool check_chunk_digest(rzip_control *control, struct runzip_state *st, i64 total)
+{
+	uchar stored[MD5_DIGEST_SIZE];
+
+	if (unlikely(s0_need(control, st, MD5_DIGEST_SIZE)))
+		failure_return(("Chunk MD5 missing (corrupt archive)\n"), false);
+	memcpy(stored, st->s0.buf + st->s0.pos, MD5_DIGEST_SIZE);
+	st->s0.pos += MD5_DIGEST_SIZE;
+
+	if (st->parallel) {
+		if (unlikely(!chunk_md5(control, st, st->out_pos - total, total)))
+			return false;
+	} else {
+		md5_ring_drain(control);
+		md5_finish_ctx(&control->ctx, st->digest);
+		md5_init_ctx(&control->ctx);
+	}
+	if (unlikely(memcmp(stored, st->digest, MD5_DIGEST_SIZE)))
+		failure_return(("Chunk MD5 check failed for %"PRId64" bytes at %"PRId64"\n",
+				total, st->out_pos - total), false);
+	print_maxverbose("Chunk MD5 of %"PRId64" bytes matches\n", total);
+	return true;
+}
+
+/* Fold a checked chunk digest into the tree hash root */
+static bool tree_add(rzip_control *control, const uchar *digest, i64 size)
+{
+	i64 *sizes;
+
+	sizes = realloc(control->tree_sizes, sizeof(i64) * (control->tree_chunks + 1));
+	if (unlikely(!sizes))
+		fatal_return(("Failed to realloc tree hash chunk sizes\n"), false);
+	control->tree_sizes = sizes;
+	sizes[control->tree_chunks++] = size;
+	md5_process_bytes(digest, MD5_DIGEST_SIZE, &control->tree_ctx);
+	return true;
+}
+
+/* The tree hash root of a written file, split as the archive's chunks were */
+static int tree_stream(rzip_control *control, FILE *stream, uchar *resblock)
+{
+	md5_ctx root, ctx;
+	uchar digest[MD5_DIGEST_SIZE], *buf;
+	int i;
+
+	buf = malloc(CKSUM_CHUNK);
+	if (unlikely(!buf))
+		return 1;
+	md5_init_ctx(&root);
+	for (i = 0; i < control->tree_chunks; i++) {
+		i64 len = control->tree_sizes[i];
+
+		md5_init_ctx(&ctx);
+		while (len > 0) {
+			size_t n = MIN(len, CKSUM_CHUNK);
+
+			if (fread(buf, 1, n, stream) != n) {
+				dealloc(buf);
+				return 1;
+			}
+			md5_process_bytes(buf, n, &ctx);
+			len -= n;
+		}
+		md5_finish_ctx(&ctx, digest);
+		md5_process_bytes(digest, MD5_DIGEST_SIZE, &root);
+	}
+	dealloc(buf);
+	md5_finish_ctx(&root, resblock);
+	return 0;
+}
+
+/* Rebuild a chunk whose streams are open in st->ss from its tokens, check
+ * it and close its streams. Returns the number of bytes written or -1 */
+static i64 rebuild_chunk(rzip_control *control, struct runzip_state *st,
+			 i64 expected_size, i64 tally)
+{
+	i64 len, total = 0, progress_at = 0;
+	uint32 good_cksum;
+	int l = -1;
+	uchar head;
+	bool err = false;
+	/* Progress at most every 64KiB (same cadence as compress). */
+	const i64 progress_bytes = 64 * 1024;
+
+	if (expected_size)
+		progress_at = tally + progress_bytes;
+
+	while (42) {
+		i64 u;
+
+		if (st->hist && !st->unf_map)
+			hist_prefetch(control, st);
+		len = read_header(control, st, &head);
+		if (!len && !head)
+			break;
+		if (unlikely(len == -1))
+			return -1;
+		switch (head) {
+			case 0:
+				u = unzip_literal(control, st, len);
+				if (unlikely(u == -1)) {
+					close_stream_in(control, st->ss);
+					return -1;
+				}
+				total += u;
+				break;
+
+			default:
+				u = unzip_match(control, st, len);
+				if (unlikely(u == -1)) {
+					close_stream_in(control, st->ss);
+					return -1;
+				}
+				total += u;
+				break;
+		}
+		if (st->unf_map && st->out_pos - st->unf_pos >= UNFILTER_STEP &&
+		    unlikely(!unfilter_flush(control, st, false))) {
+			close_stream_in(control, st->ss);
+			return -1;
+		}
+		/* Avoid double divide every token — check every 64KiB only. */
+		if (expected_size && tally + total >= progress_at) {
+			show_progress(control, tally + total, expected_size, &l);
+			progress_at = tally + total + progress_bytes;
+		}
+	}
+
+	/* Final progress for the chunk if we ended mid-interval. */
+	if (expected_size && total > 0)
+		show_progress(control, tally + total, expected_size, &l);
+
+	/* Reverse any chunk prefilter now the whole chunk is reconstructed;
+	 * this also computes the checksums of the original bytes. */
+	if (st->unf_map) {
+		if (unlikely(!unfilter_flush(control, st, true))) {
+			close_stream_in(control, st->ss);
+			return -1;
+		}
+		unfilter_end(st);
+	} else if (st->chunk_filter != LRZ_FILTER_NONE) {
+		if (unlikely(!unfilter_chunk(control, st, st->out_pos - total, total))) {
+			close_stream_in(control, st->ss);
+			return -1;
+		}
+	}
+
+	if (!HAS_MD5) {
+		good_cksum = s0_u32(control, st, &err);
+		if (unlikely(err)) {
+			close_stream_in(control, st->ss);
+			return -1;
+		}
+		if (unlikely(good_cksum != st->cksum)) {
+			close_stream_in(control, st->ss);
+			failure_return(("Bad checksum: 0x%08x - expected: 0x%08x\n", st->cksum, good_cksum), -1);
+		}
+		print_maxverbose("Checksum for block: 0x%08x\n", st->cksum);
+	}
+
+	if (TREE_HASH && unlikely(!check_chunk_digest(control, st, total))) {
+		close_stream_in(control, st->ss);
+		return -1;
+	}
+
+	if (unlikely(close_stream_in(control, st->ss)))
+		fatal("Failed to close stream!\n");
+
+	return total;
+}
+
+/* -t keeps nothing it rebuilds, so chunks of known size are rebuilt in
+ * memory instead of being written to the temporary output file. Histories
+ * held at once may use what ram the decompression buffers leave over. */
+static i64 test_hist_room(rzip_control *control)
+{
+	if (!TEST_ONLY || TMP_OUTBUF || ENCRYPT)
+		return 0;
+	return control->ramsize - control->maxram;
+}
+
+static uchar *test_hist(rzip_control *control, i64 size)
+{
+	void *map;
+
+	if ((i64)(size_t)size != size)
+		return NULL;
+	map = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED) {
+		print_maxverbose("Unable to map %"PRId64" bytes to test a chunk in\n", size);
+		return NULL;
+	}
+	print_maxverbose("Testing chunk of %"PRId64" bytes in memory\n", size);
+	return map;
+}
+
+/* decompress a section of an open file. Call fatal_return(() on error
+   return the number of bytes that have been retrieved
+ */
+static i64 runzip_chunk(rzip_control *control, int fd_in, i64 expected_size, i64 tally)
+{
+	struct runzip_state st;
+	char chunk_bytes;
+	struct stat st_in;
+	i64 ofs, total, size;
+
+	memset(&st, 0, sizeof(st));
 
 	/* Determine the chunk_byte width size. Versions < 0.4 used 4
 	 * bytes for all offsets, version 0.4 used 8 bytes. Versions 0.5+ use
@@ -571,7 +1003,7 @@ static i64 runzip_chunk(rzip_control *control, int fd_in, i64 expected_size, i64
 	}
 	/* 0.7 chunk headers carry a prefilter byte after chunk_bytes
 	 * (rolled into the 0.7 format and cemented by the 0.7.1 release) */
-	control->chunk_filter = LRZ_FILTER_NONE;
+	st.chunk_filter = LRZ_FILTER_NONE;
 	if (control->major_version > 0 || control->minor_version > 6) {
 		char chunk_filter;
 
@@ -579,23 +1011,24 @@ static i64 runzip_chunk(rzip_control *control, int fd_in, i64 expected_size, i64
 			fatal_return(("Failed to read chunk_filter in runzip_chunk\n"), -1);
 		if (unlikely(chunk_filter < 0 || chunk_filter > LRZ_CHUNK_FILTER_MAX))
 			failure_return(("chunk_filter %d is invalid in runzip_chunk\n", chunk_filter), -1);
-		control->chunk_filter = chunk_filter;
+		st.chunk_filter = chunk_filter;
 		if (chunk_filter)
 			print_maxverbose("Chunk prefiltered with filter %d\n", chunk_filter);
 	}
 	if (!tally && expected_size)
 		print_maxverbose("Expected size: %"PRId64"\n", expected_size);
 	print_maxverbose("Chunk byte width: %d\n", chunk_bytes);
+	st.chunk_bytes = chunk_bytes;
 
 	ofs = seekcur_fdin(control);
 	if (unlikely(ofs == -1))
 		fatal_return(("Failed to seek input file in runzip_fd\n"), -1);
 
-	if (fstat(fd_in, &st) || st.st_size - ofs == 0)
+	if (fstat(fd_in, &st_in) || st_in.st_size - ofs == 0)
 		return 0;
 
-	ss = open_stream_in(control, fd_in, NUM_STREAMS, chunk_bytes);
-	if (unlikely(!ss))
+	st.ss = open_stream_in(control, fd_in, NUM_STREAMS, chunk_bytes);
+	if (unlikely(!st.ss))
 		failure_return(("Failed to open_stream_in in runzip_chunk\n"), -1);
 
 	/* All chunks were unnecessarily encoded 8 bytes wide version 0.4x */
@@ -604,104 +1037,325 @@ static i64 runzip_chunk(rzip_control *control, int fd_in, i64 expected_size, i64
 	else
 		control->chunk_bytes = 2;
 
-	/* One SEEK_CUR per chunk; matches/literals advance out_pos. */
-	out_pos = seekcur_fdout(control);
-	if (unlikely(out_pos == -1)) {
-		close_stream_in(control, ss);
-		fatal_return(("Seek failed on out file in runzip_chunk\n"), -1);
+	size = ((struct stream_info *)st.ss)->size;
+	if (size > 0 && size <= test_hist_room(control))
+		st.hist = test_hist(control, size);
+	if (st.hist) {
+		/* Nothing reaches the temporary file, count from the tally */
+		st.out_pos = st.chunk_start = st.hist_base = tally;
+		st.out_end = tally + size;
+	} else {
+		/* One SEEK_CUR per chunk; matches/literals advance out_pos. */
+		st.out_pos = st.chunk_start = seekcur_fdout(control);
+		if (unlikely(st.out_pos == -1)) {
+			close_stream_in(control, st.ss);
+			fatal_return(("Seek failed on out file in runzip_chunk\n"), -1);
+		}
+		st.hist = control->hist_map;
+		st.out_end = control->hist_map_len;
+		unfilter_start(control, &st, size);
 	}
 
-	memset(&s0, 0, sizeof(s0));
-	if (expected_size)
-		progress_at = tally + progress_bytes;
+	total = rebuild_chunk(control, &st, expected_size, tally);
+	unfilter_end(&st);
+	dealloc(st.buf);
+	if (TREE_HASH && total >= 0 && unlikely(!tree_add(control, st.digest, total)))
+		total = -1;
+	if (st.hist != control->hist_map) {
+		if (!NO_MD5)
+			md5_ring_drain(control);
+		munmap(st.hist, (size_t)size);
+		return total;
+	}
+	/* Mapped writes leave the file offset behind */
+	if (control->hist_map && total > 0 &&
+	    unlikely(lseek(control->fd_out, st.out_pos, SEEK_SET) != st.out_pos))
+		fatal_return(("Failed to seek out file in runzip_chunk\n"), -1);
+	return total;
+}
 
-	while ((len = read_header(control, ss, &s0, &head)) || head) {
-		i64 u;
-		if (unlikely(len == -1))
-			return -1;
-		switch (head) {
-			case 0:
-				u = unzip_literal(control, ss, len, &cksum, &out_pos);
-				if (unlikely(u == -1)) {
-					close_stream_in(control, ss);
-					return -1;
-				}
-				total += u;
-				break;
+/* One chunk being rebuilt on its own thread */
+struct runzip_job {
+	rzip_control *control;
+	struct runzip_state st;
+	pthread_t thread;
+	i64 size;	/* Chunk size recorded in its header */
+	i64 total;
+	bool own_hist;	/* st.hist is this job's own test memory */
+	bool unf_held;	/* The job rebuilds in a private map of its size */
+};
 
-			default:
-				u = unzip_match(control, ss, &s0, len, &cksum, chunk_bytes,
-						&out_pos);
-				if (unlikely(u == -1)) {
-					close_stream_in(control, ss);
-					return -1;
+static void *runzip_job_thread(void *data)
+{
+	struct runzip_job *job = data;
+
+	job->total = rebuild_chunk(job->control, &job->st, 0, 0);
+	unfilter_end(&job->st);
+	dealloc(job->st.buf);
+	return NULL;
+}
+
+/* Chunks are rzipped with a fresh hash table each, so no match reaches
+ * outside its chunk, and unencrypted 0.6+ chunk headers record the chunk
+ * size. With a regular archive and output file, several chunks can be
+ * rebuilt at once, each into its own output range. A single chunk gains
+ * nothing from it and keeps the inline MD5. Older writers could set the
+ * eof flag of a middle chunk, so it only counts when the size is unknown. */
+static bool runzip_parallel_ok(rzip_control *control, int fd_in, i64 expected_size)
+{
+	struct stat st;
+	i64 ofs, size = 0;
+	uchar eof, chunk_bytes;
+
+	if (control->threads < 2 || TMP_INBUF || STDIN || TMP_OUTBUF || ENCRYPT ||
+	    STREAMING_BLOCKS || control->fd_out < 0 || control->fd_hist < 0 ||
+	    (control->major_version == 0 && control->minor_version < 6))
+		return false;
+	if (fstat(fd_in, &st) || !S_ISREG(st.st_mode))
+		return false;
+	ofs = seekcur_fdin(control);
+	if (ofs == -1 || pread(fd_in, &chunk_bytes, 1, ofs) != 1)
+		return false;
+	/* chunk_bytes, [chunk_filter], eof, size */
+	ofs += (control->major_version > 0 || control->minor_version > 6) ? 2 : 1;
+	if (pread(fd_in, &eof, 1, ofs) != 1 || chunk_bytes < 1 || chunk_bytes > 8 ||
+	    pread(fd_in, &size, chunk_bytes, ofs + 1) != chunk_bytes)
+		return false;
+	size = le64toh(size);
+	/* Rebuilding one chunk at a time is all there is room for */
+	if (size > control->maxram / 2) {
+		print_maxverbose("Chunks of %"PRId64" bytes too large to rebuild in parallel\n", size);
+		return false;
+	}
+	if (!expected_size)
+		return !eof;
+	return size < expected_size;
+}
+
+/* Rebuild up to one chunk per thread at once. Chunks are collected in
+ * archive order, so the MD5 of each is taken from the output as soon as
+ * every chunk before it is done. A tree hashed chunk has already checked
+ * its own MD5 and only its digest is added to the root. The streams of a
+ * chunk decode to about its size and may all be buffered at once, so
+ * chunks are only started while their sizes fit in maxram together. */
+static i64 runzip_parallel(rzip_control *control, int fd_in, i64 expected_size)
+{
+	i64 pos, out, total = 0, ret = -1, room, held = 0, queued = 0, dec_held = 0;
+	int jobs, started = 0, done = 0, l = -1;
+	bool more = true, pending = false;
+	struct runzip_job *job;
+
+	pos = seekcur_fdin(control);
+	out = seekcur_fdout(control);
+	if (unlikely(pos == -1 || out == -1))
+		fatal_return(("Failed to seek in runzip_parallel\n"), -1);
+
+	jobs = control->threads;
+	job = calloc(jobs, sizeof(struct runzip_job));
+	if (unlikely(!job))
+		fatal_return(("Failed to calloc jobs in runzip_parallel\n"), -1);
+	print_verbose("Rebuilding up to %d chunks in parallel\n", jobs);
+
+	/* Token lengths are 2 bytes wide in every 0.6+ archive */
+	control->chunk_bytes = 2;
+	room = test_hist_room(control);
+
+	while (more || pending || done < started) {
+		struct runzip_job *j;
+
+		while ((more || pending) && started - done < jobs) {
+			j = &job[started % jobs];
+			if (!pending) {
+				struct stream_info *sinfo;
+				i64 next;
+
+				memset(j, 0, sizeof(*j));
+				sinfo = open_stream_at(control, fd_in, NUM_STREAMS, pos, &next);
+				if (unlikely(!sinfo)) {
+					print_err("Failed to open chunk at %"PRId64" in runzip_parallel\n", pos);
+					goto out;
 				}
-				total += u;
+				pending = true;
+				j->control = control;
+				j->st.ss = sinfo;
+				j->st.chunk_bytes = sinfo->chunk_bytes;
+				j->st.chunk_filter = sinfo->chunk_filter;
+				j->st.parallel = true;
+				j->st.out_pos = j->st.chunk_start = out;
+				j->st.out_end = out + sinfo->size;
+				j->st.hist = control->hist_map;
+				j->size = sinfo->size;
+				print_maxverbose("Rebuilding chunk of %"PRId64" bytes at %"PRId64" from %"PRId64"\n",
+						 j->size, out, pos);
+				out += sinfo->size;
+				queued += sinfo->size;
+				pos = next;
+				more = expected_size ? queued < expected_size : !sinfo->eof;
+			}
+			if (dec_held + j->size > control->maxram && started > done) {
+				print_maxverbose("Waiting for ram to rebuild chunk of %"PRId64" bytes\n", j->size);
 				break;
-		}
-		/* Avoid double divide every token — check every 64KiB only. */
-		if (expected_size && tally + total >= progress_at) {
-			p = (int)((100 * (tally + total)) / expected_size);
-			if (p > 100)
-				p = 100;
-			if (p / 10 != l / 10) {
-				prog_done = (double)(tally + total) /
-					    (double)divisor[divisor_index];
-				print_progress("%3d%%  %9.2f / %9.2f %s\r",
-						p, prog_done, prog_tsize,
-						suffix[divisor_index]);
-				l = p;
 			}
-			progress_at = tally + total + progress_bytes;
+			if (j->size > 0 && j->size <= room) {
+				/* Wait for earlier chunks to free their memory
+				 * rather than write this one out */
+				if (held + j->size > room && started > done)
+					break;
+				j->st.hist = test_hist(control, j->size);
+				if (j->st.hist) {
+					j->st.hist_base = j->st.chunk_start;
+					j->own_hist = true;
+					held += j->size;
+				}
+			}
+			if (!j->own_hist && held + j->size <= control->ramsize - control->maxram &&
+			    unfilter_start(control, &j->st, j->size)) {
+				j->unf_held = true;
+				held += j->size;
+			}
+			if (unlikely(!create_pthread(control, &j->thread, NULL, runzip_job_thread, j)))
+				goto out;
+			dec_held += j->size;
+			pending = false;
+			started++;
 		}
-	}
 
-	/* Final progress for the chunk if we ended mid-interval. */
-	if (expected_size && total > 0) {
-		p = (int)((100 * (tally + total)) / expected_size);
-		if (p > 100)
-			p = 100;
-		if (p / 10 != l / 10) {
-			prog_done = (double)(tally + total) /
-				    (double)divisor[divisor_index];
-			print_progress("%3d%%  %9.2f / %9.2f %s\r",
-					p, prog_done, prog_tsize,
-					suffix[divisor_index]);
+		j = &job[done % jobs];
+		if (unlikely(!join_pthread(control, j->thread, NULL)))
+			goto out;
+		done++;
+		if (unlikely(j->total != j->size)) {
+			print_err("Chunk rebuilt to %"PRId64" bytes, expected %"PRId64"\n",
+				  j->total, j->size);
+			goto out;
 		}
+		if (TREE_HASH) {
+			if (unlikely(!tree_add(control, j->st.digest, j->size)))
+				goto out;
+		} else if (!NO_MD5 &&
+			   unlikely(!runzip_md5_range(control, &j->st, j->st.chunk_start, j->size)))
+			goto out;
+		if (j->own_hist) {
+			if (!NO_MD5)
+				md5_ring_drain(control);
+			munmap(j->st.hist, (size_t)j->size);
+			j->own_hist = false;
+			held -= j->size;
+		}
+		if (j->unf_held) {
+			j->unf_held = false;
+			held -= j->size;
+		}
+		dec_held -= j->size;
+		total += j->size;
+		control->blocks_done++;
+		if (expected_size)
+			show_progress(control, total, expected_size, &l);
 	}
 
-	/* Reverse any chunk prefilter now the whole chunk is reconstructed;
-	 * this also computes the checksums of the original bytes. */
-	if (control->chunk_filter != LRZ_FILTER_NONE) {
-		if (unlikely(!unfilter_chunk(control, out_pos - total, total, &cksum))) {
-			close_stream_in(control, ss);
-			return -1;
-		}
+	if (unlikely(expected_size && total != expected_size)) {
+		print_err("Rebuilt %"PRId64" bytes, expected %"PRId64"\n", total, expected_size);
+		goto out;
+	}
+	/* Leave both files where sequential decompression would have */
+	if (unlikely(lseek(control->fd_out, out, SEEK_SET) != out ||
+		     lseek(fd_in, pos, SEEK_SET) != pos)) {
+		print_err("Failed to seek after runzip_parallel\n");
+		goto out;
+	}
+	ret = total;
+out:
+	/* Never leave a job running on memory we are about to free */
+	while (done < started)
+		join_pthread(control, job[done++ % jobs].thread, NULL);
+	if (pending) {
+		struct runzip_job *j = &job[started % jobs];
+
+		unfilter_end(&j->st);
+		close_stream_in(control, j->st.ss);
+	}
+	for (done = 0; done < jobs; done++) {
+		if (job[done].own_hist)
+			munmap(job[done].st.hist, (size_t)job[done].size);
 	}
+	dealloc(job);
+	return ret;
+}
 
-	if (!HAS_MD5) {
-		good_cksum = s0_u32(control, ss, &s0, &err);
-		if (unlikely(err)) {
-			close_stream_in(control, ss);
-			return -1;
-		}
-		if (unlikely(good_cksum != cksum)) {
-			close_stream_in(control, ss);
-			failure_return(("Bad checksum: 0x%08x - expected: 0x%08x\n", cksum, good_cksum), -1);
-		}
-		print_maxverbose("Checksum for block: 0x%08x\n", cksum);
+/* Extend the output by size bytes at out, the current end of the file, and
+ * map the file shared as history up to there. The new space must also be
+ * reserved, so that running out of it fails here instead of faulting
+ * later. Only a native fallocate does that: the glibc fallback for
+ * filesystems without one writes zeros over the whole range. On failure
+ * the file is left as it was and written through fd_out instead. */
+static bool hist_map_at(rzip_control *control, i64 out, i64 size)
+{
+	i64 len = out + size;
+	void *map;
+
+	if ((i64)(size_t)len != len)
+		return false;
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+	if (ftruncate(control->fd_out, len) ||
+	    fallocate(control->fd_out, FALLOC_FL_KEEP_SIZE, out, size)) {
+		print_maxverbose("Unable to allocate %"PRId64" bytes of output, not mapping it\n",
+				 size);
+		if (unlikely(ftruncate(control->fd_out, out)))
+			print_err("Failed to truncate output back to %"PRId64"\n", out);
+		return false;
 	}
+#else
+	print_maxverbose("No native fallocate, not mapping output\n");
+	return false;
+#endif
+	map = mmap(NULL, (size_t)len, PROT_READ | PROT_WRITE, MAP_SHARED, control->fd_out, 0);
+	if (map == MAP_FAILED) {
+		print_maxverbose("Unable to map %"PRId64" bytes of output\n", len);
+		if (unlikely(ftruncate(control->fd_out, out)))
+			print_err("Failed to truncate output back to %"PRId64"\n", out);
+		return false;
+	}
+	control->hist_map = map;
+	control->hist_map_len = len;
+	print_maxverbose("Mapped %"PRId64" bytes of output as history\n", len);
+	return true;
+}
 
-	if (unlikely(close_stream_in(control, ss)))
-		fatal("Failed to close stream!\n");
+/* Map the whole output up front when it is a read-write regular file.
+ * Anything that stops the file being mapped leaves decompression writing
+ * through fd_out as before. */
+static void hist_map_open(rzip_control *control, i64 expected_size)
+{
+	struct stat st;
+	int flags;
+	i64 out;
 
-	return total;
+	if (TEST_ONLY || TMP_OUTBUF || control->fd_out < 0 || expected_size < 1)
+		return;
+	flags = fcntl(control->fd_out, F_GETFL);
+	if (flags == -1 || (flags & O_ACCMODE) != O_RDWR)
+		return;
+	if (fstat(control->fd_out, &st) || !S_ISREG(st.st_mode))
+		return;
+	out = seekcur_fdout(control);
+	if (out == -1 || out != st.st_size)
+		return;
+	hist_map_at(control, out, expected_size);
+}
+
+static void hist_map_close(rzip_control *control)
+{
+	if (!control->hist_map)
+		return;
+	munmap(control->hist_map, (size_t)control->hist_map_len);
+	control->hist_map = NULL;
+	control->hist_map_len = 0;
 }
 
 /* Decompress an open file. Call fatal_return(() on error
    return the number of bytes that have been retrieved
  */
-i64 runzip_fd(rzip_control *control, int fd_in, int fd_hist, i64 expected_size)
+static i64 runzip_file(rzip_control *control, int fd_in, int fd_hist, i64 expected_size)
 {
 	uchar md5_stored[MD5_DIGEST_SIZE];
 	struct timeval start,end;
@@ -711,7 +1365,9 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_hist, i64 expected_size)
 
 	if (!NO_MD5) {
 		md5_init_ctx (&control->ctx);
-		runzip_md5_start(control);
+		if (TREE_HASH)
+			md5_init_ctx(&control->tree_ctx);
+		md5_ring_start(control);
 		md5_live = 1;
 	}
 	gettimeofday(&start,NULL);
@@ -720,6 +1376,17 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_hist, i64 expected_size)
 	control->block_c_size = 0;
 	control->rcd_start = -1;
 
+	if (runzip_parallel_ok(control, fd_in, expected_size)) {
+		total = runzip_parallel(control, fd_in, expected_size);
+		if (unlikely(total < 0)) {
+			print_err("Failed to runzip_parallel in runzip_fd\n");
+			if (md5_live)
+				md5_ring_stop(control);
+			return -1;
+		}
+		goto rebuilt;
+	}
+
 	do {
 		/* Apply framed size from prior LRZC (0 for first / unframed). */
 		control->block_c_size = control->next_block_c_size;
@@ -731,7 +1398,7 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_hist, i64 expected_size)
 			if (u < 0 || total < expected_size) {
 				print_err("Failed to runzip_chunk in runzip_fd\n");
 				if (md5_live)
-					runzip_md5_stop(control);
+					md5_ring_stop(control);
 				return -1;
 			}
 		}
@@ -747,7 +1414,7 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_hist, i64 expected_size)
 			if (unlikely(!read_lrzc_header(control, fd_in, &c_size, &u_size))) {
 				print_err("Failed to read LRZC in runzip_fd\n");
 				if (md5_live)
-					runzip_md5_stop(control);
+					md5_ring_stop(control);
 				return -1;
 			}
 			/* c_size frames the next RCD + stream payload. */
@@ -762,7 +1429,7 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_hist, i64 expected_size)
 		if (unlikely(!flush_tmpout(control))) {
 			print_err("Failed to flush_tmpout in runzip_fd\n");
 			if (md5_live)
-				runzip_md5_stop(control);
+				md5_ring_stop(control);
 			return -1;
 		}
 
@@ -772,17 +1439,18 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_hist, i64 expected_size)
 			if (unlikely(!clear_tmpinfile(control))) {
 				print_err("Failed to clear_tmpinfile in runzip_fd\n");
 				if (md5_live)
-					runzip_md5_stop(control);
+					md5_ring_stop(control);
 				return -1;
 			}
 		}
 	} while (total < expected_size || (!expected_size && !control->eof));
 
+rebuilt:
 	/* Streaming multi-block with last never seen is truncated. */
 	if (STREAMING_BLOCKS && !control->eof && !control->last_block) {
 		print_err("Truncated streaming archive: no final block\n");
 		if (md5_live)
-			runzip_md5_stop(control);
+			md5_ring_stop(control);
 		return -1;
 	}
 
@@ -799,9 +1467,10 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_hist, i64 expected_size)
 		int i,j;
 
 		/* Flush final batch and join worker before finishing the digest. */
-		runzip_md5_stop(control);
+		md5_ring_stop(control);
 		md5_live = 0;
-		md5_finish_ctx (&control->ctx, control->md5_resblock);
+		md5_finish_ctx(TREE_HASH ? &control->tree_ctx : &control->ctx,
+			       control->md5_resblock);
 		if (HAS_MD5) {
 			i64 fdinend = seekto_fdinend(control);
 			i64 md5_wire = MD5_DIGEST_SIZE;
@@ -850,7 +1519,7 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_hist, i64 expected_size)
 		}
 
 		if (HASH_CHECK || MAX_VERBOSE) {
-			print_output("MD5: ");
+			print_output(TREE_HASH ? "MD5 tree root: " : "MD5: ");
 			for (i = 0; i < MD5_DIGEST_SIZE; i++)
 				print_output("%02x", control->md5_resblock[i] & 0xFF);
 			print_output("\n");
@@ -867,7 +1536,10 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_hist, i64 expected_size)
 				fatal_return(("Failed to seekto_fdhist in runzip_fd\n"), -1);
 			if (unlikely((md5_fstream = fdopen(fd_hist, "r")) == NULL))
 				fatal_return(("Failed to fdopen fd_hist in runzip_fd\n"), -1);
-			if (unlikely(md5_stream(md5_fstream, control->md5_resblock)))
+			if (TREE_HASH) {
+				if (unlikely(tree_stream(control, md5_fstream, control->md5_resblock)))
+					fatal_return(("Failed to hash the written file in runzip_fd\n"), -1);
+			} else if (unlikely(md5_stream(md5_fstream, control->md5_resblock)))
 				fatal_return(("Failed to md5_stream in runzip_fd\n"), -1);
 			/* We don't close the file here as it's closed in main */
 			for (i = 0; i < MD5_DIGEST_SIZE; i++)
@@ -888,8 +1560,172 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_hist, i64 expected_size)
 		}
 	}
 
-	dealloc(control->runzip_buf);
-	control->runzip_buf = NULL;
-	control->runzip_buf_len = 0;
+	return total;
+}
+
+i64 runzip_fd(rzip_control *control, int fd_in, int fd_hist, i64 expected_size)
+{
+	i64 ret;
+
+	hist_map_open(control, expected_size);
+	ret = runzip_file(control, fd_in, fd_hist, expected_size);
+	hist_map_close(control);
+	dealloc(control->tree_sizes);
+	control->tree_chunks = 0;
+	return ret;
+}
+
+/* Rebuild the chunk whose header is at pos into mapped scratch at *at, the
+ * end of the output, and keep the len bytes of it from skip on. Where the
+ * output cannot be mapped the chunk is rebuilt in memory and the kept bytes
+ * written out. */
+static bool range_chunk(rzip_control *control, int fd_in, i64 pos, i64 skip,
+			i64 len, i64 *at)
+{
+	struct runzip_state st;
+	struct stream_info *sinfo;
+	i64 next, size, total;
+	void *map = NULL;
+
+	memset(&st, 0, sizeof(st));
+	sinfo = open_stream_at(control, fd_in, NUM_STREAMS, pos, &next);
+	if (unlikely(!sinfo))
+		failure_return(("Failed to open chunk at %"PRId64"\n", pos), false);
+	size = sinfo->size;
+	if (hist_map_at(control, *at, size))
+		st.hist = control->hist_map;
+	else {
+		map = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (unlikely((i64)(size_t)size != size || map == MAP_FAILED)) {
+			close_stream_in(control, sinfo);
+			failure_return(("Unable to map %"PRId64" bytes to rebuild a chunk in\n",
+					size), false);
+		}
+		st.hist = map;
+		st.hist_base = *at;
+	}
+	print_verbose("Extracting %"PRId64" bytes from chunk of %"PRId64" bytes at %"PRId64"\n",
+		      len, size, pos);
+	st.ss = sinfo;
+	st.chunk_bytes = sinfo->chunk_bytes;
+	st.chunk_filter = sinfo->chunk_filter;
+	/* Positioned like a chunk rebuilt in parallel, with no MD5 to feed */
+	st.parallel = true;
+	st.out_pos = st.chunk_start = *at;
+	st.out_end = *at + size;
+
+	total = rebuild_chunk(control, &st, 0, 0);
+	dealloc(st.buf);
+	if (likely(total == size)) {
+		uchar *keep = st.hist + (*at - st.hist_base);
+
+		memmove(keep, keep + skip, (size_t)len);
+		if (STDOUT) {
+			if (unlikely(fwrite(keep, 1, (size_t)len, control->outFILE) != (size_t)len))
+				total = -1;
+		} else if (map && unlikely(pwrite(control->fd_out, keep, (size_t)len, *at) != (ssize_t)len))
+			total = -1;
+	}
+	if (map)
+		munmap(map, (size_t)size);
+	hist_map_close(control);
+	if (unlikely(total != size))
+		failure_return(("Failed to extract %"PRId64" bytes from chunk at %"PRId64"\n",
+				len, pos), false);
+	/* stdout has its copy, a file keeps it */
+	if (!STDOUT)
+		*at += len;
+	if (unlikely(ftruncate(control->fd_out, *at)))
+		fatal_return(("Failed to truncate output to %"PRId64"\n", *at), false);
+	return true;
+}
+
+/* Decompress only output bytes [range_start, range_end) of an open archive.
+ * Chunks wholly before the range are skipped using their headers, or the
+ * LRZC frame in front of them in streaming archives, without decompressing
+ * anything. Each chunk the range touches is rebuilt in full, since its
+ * matches may reach anywhere back in it, and the wanted part kept. The
+ * stored MD5 covers the whole file so only CRC32 archives can be checked.
+ * Returns the number of bytes extracted */
+i64 runzip_range(rzip_control *control, int fd_in, i64 expected_size)
+{
+	i64 start = control->range_start, end = control->range_end;
+	i64 pos, out = 0, at = 0, total = 0;
+	struct stat st;
+	int chunks = 0;
+	uchar eof = 0;
+
+	if (unlikely(ENCRYPT || STDIN || TMP_INBUF || TMP_OUTBUF ||
+		     (control->major_version == 0 && control->minor_version < 6)))
+		failure_return(("--range needs an unencrypted 0.6+ archive that is not read from stdin\n"), -1);
+	if (unlikely(fstat(fd_in, &st) || !S_ISREG(st.st_mode)))
+		failure_return(("--range needs the archive to be a regular file\n"), -1);
+	if (unlikely(control->fd_out < 0))
+		failure_return(("--range needs an output file to rebuild chunks in\n"), -1);
+	if (expected_size) {
+		if (unlikely(start >= expected_size))
+			failure_return(("Range starts at %"PRId64", beyond the end of the %"PRId64" byte file\n",
+					start, expected_size), -1);
+		if (end == -1 || end > expected_size)
+			end = expected_size;
+	}
+	if (HAS_MD5)
+		print_verbose("The stored MD5 covers the whole file, not checking it for a range\n");
+
+	pos = seekcur_fdin(control);
+	if (unlikely(pos == -1))
+		fatal_return(("Failed to seek input file in runzip_range\n"), -1);
+	control->block_c_size = 0;
+	control->rcd_start = -1;
+	/* Token lengths are 2 bytes wide in every 0.6+ archive */
+	control->chunk_bytes = 2;
+
+	/* A known size was clamped into end above; the eof flag of a middle
+	 * chunk may be wrong in archives from older -p > 1 writers */
+	while ((expected_size || !eof) && (end == -1 || out < end)) {
+		i64 size = 0, next;
+
+		/* Every streaming chunk after the first is framed with its
+		 * size and where it ends */
+		if (STREAMING_BLOCKS && chunks++) {
+			i64 c_size;
+
+			if (unlikely(lseek(fd_in, pos, SEEK_SET) != pos ||
+				     !read_lrzc_header(control, fd_in, &c_size, &size)))
+				failure_return(("Failed to read LRZC frame at %"PRId64"\n", pos), -1);
+			pos += LRZC_LEN;
+			if (size && out + size <= start) {
+				print_maxverbose("Skipping framed chunk of %"PRId64" bytes at %"PRId64"\n",
+						 size, pos);
+				out += size;
+				pos += c_size;
+				eof = control->last_block;
+				continue;
+			}
+		}
+		if (unlikely(!skip_chunk(control, fd_in, NUM_STREAMS, pos, &size, &eof, &next)))
+			failure_return(("Failed to read chunk at %"PRId64"\n", pos), -1);
+		if (out + size > start) {
+			i64 skip = MAX(start - out, 0), len = size - skip;
+
+			if (end != -1)
+				len = MIN(len, end - out - skip);
+			if (unlikely(!range_chunk(control, fd_in, pos, skip, len, &at)))
+				return -1;
+			total += len;
+			control->blocks_done++;
+		} else
+			print_maxverbose("Skipping chunk of %"PRId64" bytes at %"PRId64"\n", size, pos);
+		out += size;
+		pos = next;
+	}
+	if (unlikely(!total))
+		failure_return(("Range starts at %"PRId64", beyond the end of the %"PRId64" byte file\n",
+				start, out), -1);
+	if (STDOUT)
+		fflush(control->outFILE);
+	else if (unlikely(lseek(control->fd_out, at, SEEK_SET) != at))
+		fatal_return(("Failed to seek out file in runzip_range\n"), -1);
 	return total;
 }
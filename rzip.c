@@ -64,7 +64,6 @@
 #endif
 
 #define CHUNK_MULTIPLE (100 * 1024 * 1024)
-#define CKSUM_CHUNK 1024*1024
 #define GREAT_MATCH 1024
 #define MINIMUM_MATCH 31
 
@@ -262,9 +261,57 @@ static void sliding_mcpy(rzip_control *control, unsigned char *buf, i64 offset,
 	}
 }
 
+/* A match of stream 0 must repeat the n bytes ofs back from p */
+static bool replay_match(rzip_control *control, struct rzip_state *st,
+			 i64 p, i64 ofs, i64 n)
+{
+	if (!st->sliding)
+		return !memcmp(control->sb.buf_low + p - ofs, control->sb.buf_low + p, n);
+	control->do_mcpy(control, st->replay_buf, p - ofs, n);
+	control->do_mcpy(control, st->replay_buf + 0xFFFF, p, n);
+	return !memcmp(st->replay_buf, st->replay_buf + 0xFFFF, n);
+}
+
+/* Decode the tokens about to be flushed the way runzip will, checking each
+ * match against the input while it is still mapped. Literals are copied
+ * straight from the input, so only their lengths need to add up. */
+static void s0_replay(rzip_control *control, struct rzip_state *st)
+{
+	uchar *tok = st->replay_tok;
+	unsigned i;
+
+	for (i = 0; i < st->s0_len && !st->replay_done; i++) {
+		i64 len = 0, ofs = 0;
+
+		tok[st->replay_have++] = st->s0_buf[i];
+		if (st->replay_have < 3 || (tok[0] == 1 && st->replay_have < 3 + st->chunk_bytes))
+			continue;
+		st->replay_have = 0;
+		memcpy(&len, tok + 1, 2);
+		len = le64toh(len);
+		if (tok[0] == 1) {
+			memcpy(&ofs, tok + 3, st->chunk_bytes);
+			ofs = le64toh(ofs);
+			if (unlikely(!ofs || ofs > st->replay_pos ||
+				     len > st->chunk_size - st->replay_pos ||
+				     !replay_match(control, st, st->replay_pos, ofs, len)))
+				failure("rzip match of %"PRId64" bytes at %"PRId64" does not replay\n",
+					len, st->replay_pos);
+		} else if (unlikely(tok[0]))
+			failure("Invalid rzip token %d at %"PRId64"\n", tok[0], st->replay_pos);
+		else if (!len)
+			st->replay_done = true;
+		st->replay_pos += len;
+		if (unlikely(st->replay_pos > st->chunk_size))
+			failure("rzip tokens run past the chunk at %"PRId64"\n", st->replay_pos);
+	}
+}
+
 /* ---- Stream 0 (rzip control) write batching ---- */
 static void s0_flush(rzip_control *control, struct rzip_state *st)
 {
+	if (CHECK_FILE)
+		s0_replay(control, st);
 	if (st->s0_len) {
 		write_stream(control, st->ss, 0, st->s0_buf, st->s0_len);
 		st->s0_len = 0;
@@ -841,80 +888,27 @@ static void show_distrib(rzip_control *control, struct rzip_state *st)
 	}
 }
 
-/* Dedicated MD5 worker: one long-lived thread, large batches, reused buffer. */
-static void *md5_worker(void *data)
+/* Queue [offset, offset+len) of the chunk for MD5. A single map stays put
+ * until the chunk is done so it is hashed in place, while the sliding
+ * windows move under the search and are copied. */
+static void md5_queue(rzip_control *control, struct rzip_state *st, i64 offset, i64 len)
 {
-	rzip_control *control = (rzip_control *)data;
-
-	while (42) {
-		cksem_wait(control, &control->cksum_worksem);
-		if (control->checksum.shutdown) {
-			cksem_post(control, &control->cksumsem);
-			break;
-		}
-		if (control->checksum.len > 0)
-			md5_process_bytes(control->checksum.buf, control->checksum.len,
-					  &control->ctx);
-		cksem_post(control, &control->cksumsem);
+	if (!st->sliding) {
+		md5_ring_add(control, control->sb.buf_low + offset, len);
+		return;
 	}
-	return NULL;
-}
-
-static void md5_thread_start(rzip_control *control)
-{
-	i64 cap = CKSUM_CHUNK;
-
-	round_to_page(&cap);
-	control->checksum.capacity = cap;
-	control->checksum.buf = malloc((size_t)cap);
-	if (unlikely(!control->checksum.buf))
-		failure("Failed to allocate MD5 batch buffer\n");
-	control->checksum.len = 0;
-	control->checksum.shutdown = 0;
-
-	cksem_init(control, &control->cksumsem);
-	cksem_post(control, &control->cksumsem);
-	cksem_init(control, &control->cksum_worksem);
-
-	if (unlikely(!create_pthread(control, &control->md5_thread, NULL, md5_worker, control)))
-		failure("Failed to start MD5 worker thread\n");
-}
-
-static void md5_thread_stop(rzip_control *control)
-{
-	/* Wait until the worker is idle, then ask it to exit. */
-	cksem_wait(control, &control->cksumsem);
-	control->checksum.shutdown = 1;
-	control->checksum.len = 0;
-	cksem_post(control, &control->cksum_worksem);
-	if (unlikely(!join_pthread(control, control->md5_thread, NULL)))
-		failure("Failed to join MD5 worker thread\n");
-	dealloc(control->checksum.buf);
-	control->checksum.capacity = 0;
-}
-
-/* Queue [offset, offset+len) from the sliding/single map for MD5. */
-static void md5_queue(rzip_control *control, i64 offset, i64 len)
-{
 	while (len > 0) {
-		i64 n = MIN(len, control->checksum.capacity);
+		i64 space, n;
+		uchar *p = md5_ring_space(control, &space);
 
-		cksem_wait(control, &control->cksumsem);
-		control->do_mcpy(control, control->checksum.buf, offset, n);
-		control->checksum.len = n;
-		cksem_post(control, &control->cksum_worksem);
+		n = MIN(len, space);
+		control->do_mcpy(control, p, offset, n);
+		md5_ring_commit(control, n);
 		offset += n;
 		len -= n;
 	}
 }
 
-/* Wait until all submitted MD5 work is finished. */
-static void md5_drain(rzip_control *control)
-{
-	cksem_wait(control, &control->cksumsem);
-	cksem_post(control, &control->cksumsem);
-}
-
 static inline void hash_search(rzip_control *control, struct rzip_state *st,
 			       double pct_base, double pct_multiple)
 {
@@ -975,6 +969,14 @@ static inline void hash_search(rzip_control *control, struct rzip_state *st,
 	st->tag_clean_ptr = 0;
 	st->hash_count = 0;
 	st->s0_len = 0;
+	st->replay_have = 0;
+	st->replay_done = false;
+	st->replay_pos = 0;
+	if (CHECK_FILE && st->sliding) {
+		st->replay_buf = malloc(2 * 0xFFFF);
+		if (unlikely(!st->replay_buf))
+			failure("Failed to allocate replay buffer in hash_search\n");
+	}
 
 	p = 0;
 	end = st->chunk_size - MINIMUM_MATCH;
@@ -1069,7 +1071,7 @@ static inline void hash_search(rzip_control *control, struct rzip_state *st,
 				i64 n = MIN(control->checksum.capacity,
 					    st->chunk_size - cksum_limit);
 
-				md5_queue(control, cksum_limit, n);
+				md5_queue(control, st, cksum_limit, n);
 				cksum_limit += n;
 			}
 		}
@@ -1084,15 +1086,34 @@ static inline void hash_search(rzip_control *control, struct rzip_state *st,
 	/* Finish any unhashed tail of this chunk, then wait for the worker. */
 	if (!NO_MD5) {
 		if (!st->chunk_md5_done && cksum_limit < st->chunk_size)
-			md5_queue(control, cksum_limit, st->chunk_size - cksum_limit);
-		md5_drain(control);
+			md5_queue(control, st, cksum_limit, st->chunk_size - cksum_limit);
+		md5_ring_drain(control);
 	}
 
 	/* End-of-stream marker only (head=0, len=0). No trailing CRC32;
 	 * integrity is MD5 when magic[21] is set. Match/literal offsets are
 	 * complete before this marker and do not depend on a CRC field. */
 	put_literal(control, st, 0, 0);
+
+	/* A tree hash follows the marker with the MD5 of this chunk alone
+	 * and folds it into the root */
+	if (TREE_HASH) {
+		uchar digest[MD5_DIGEST_SIZE];
+
+		md5_finish_ctx(&control->ctx, digest);
+		md5_init_ctx(&control->ctx);
+		md5_process_bytes(digest, MD5_DIGEST_SIZE, &control->tree_ctx);
+		s0_write(control, st, digest, MD5_DIGEST_SIZE);
+	}
 	s0_flush(control, st);
+
+	if (CHECK_FILE) {
+		if (unlikely(!st->replay_done || st->replay_pos != st->chunk_size))
+			failure("rzip tokens replay %"PRId64" of %"PRId64" bytes\n",
+				st->replay_pos, st->chunk_size);
+		print_maxverbose("Replayed rzip tokens of %"PRId64" byte chunk\n", st->chunk_size);
+		dealloc(st->replay_buf);
+	}
 }
 
 
@@ -1255,13 +1276,23 @@ rzip_chunk(rzip_control *control, struct rzip_state *st, int fd_in, int fd_out,
 			sb->buf_low = newbuf;
 		}
 		if (kind != LRZ_FILTER_NONE) {
+			struct lrz_filter_par fp;
+			int n;
+
 			/* The stored md5 must be of the original bytes, so
-			 * hash the chunk before converting it. */
-			if (!NO_MD5) {
-				md5_queue(control, 0, st->chunk_size);
-				st->chunk_md5_done = true;
+			 * each slice is hashed before it is converted, the
+			 * next one hashing while those before it convert. */
+			lrz_filter_par_init(control, &fp, sb->buf_low, st->chunk_size, kind, true);
+			for (n = 0; n < fp.slices; n++) {
+				if (!NO_MD5) {
+					md5_queue(control, st, fp.slice[n].buf - sb->buf_low, fp.slice[n].len);
+					md5_ring_drain(control);
+				}
+				lrz_filter_par_run(&fp, n);
 			}
-			lrz_filter_convert_mem(sb->buf_low, st->chunk_size, kind, true);
+			if (unlikely(!lrz_filter_par_finish(&fp)))
+				failure("Failed to prefilter chunk in rzip_chunk\n");
+			st->chunk_md5_done = !NO_MD5;
 			control->chunk_filter = kind;
 			print_verbose("Chunk prefiltered with %s branch conversion\n",
 				      kind == LRZ_FILTER_X86 ? "x86" : "arm64");
@@ -1331,6 +1362,8 @@ void rzip_fd(rzip_control *control, int fd_in, int fd_out)
 	init_mutex(control, &control->control_lock);
 	if (!NO_MD5)
 		md5_init_ctx(&control->ctx);
+	if (TREE_HASH)
+		md5_init_ctx(&control->tree_ctx);
 
 	st = calloc(1, sizeof(*st));
 	if (unlikely(!st))
@@ -1350,7 +1383,7 @@ void rzip_fd(rzip_control *control, int fd_in, int fd_out)
 
 	/* Start MD5 worker after early setup so failures above need no join. */
 	if (!NO_MD5)
-		md5_thread_start(control);
+		md5_ring_start(control);
 
 	if (!STDIN) {
 		len = control->st_size = s.st_size;
@@ -1615,11 +1648,12 @@ retry:
 	}
 
 	if (!NO_MD5) {
-		md5_thread_stop(control);
+		md5_ring_stop(control);
 		/* Temporary workaround till someone fixes apple md5 */
-		md5_finish_ctx(&control->ctx, control->md5_resblock);
+		md5_finish_ctx(TREE_HASH ? &control->tree_ctx : &control->ctx,
+			       control->md5_resblock);
 		if (HASH_CHECK || MAX_VERBOSE) {
-			print_output("MD5: ");
+			print_output(TREE_HASH ? "MD5 tree root: " : "MD5: ");
 			for (j = 0; j < MD5_DIGEST_SIZE; j++)
 				print_output("%02x", control->md5_resblock[j] & 0xFF);
 			print_output("\n");
@@ -44,6 +44,7 @@
 #include <lzo/lzoconf.h>
 #include <lzo/lzo1x.h>
 #include <lz4.h>
+#include <lz4hc.h>
 #ifdef HAVE_ERRNO_H
 # include <errno.h>
 #endif
@@ -57,11 +58,16 @@
 #endif
 
 #include <inttypes.h>
+#include <math.h>
 #include <stdatomic.h>
 #include <string.h>
 
 /* LZMA C Wrapper */
 #include "lzma/C/LzmaLib.h"
+#include "lzma/C/LzmaEnc.h"
+#include "lzma/C/LzmaDec.h"
+#include "lzma/C/Alloc.h"
+#include "lzma/C/7zCrc.h"
 
 #include "util.h"
 #include "lrzip_core.h"
@@ -69,6 +75,17 @@
 
 #define STREAM_BUFSIZE (1024 * 1024 * 10)
 
+/* libbz2 has no reset call, so its state is recycled through the
+ * allocator instead: a worker's arrays are kept when a stream ends and
+ * handed back when the next stream of the same block size asks for them. */
+#define BZ_CACHE_SLOTS 4
+
+struct bz_cache {
+	void *ptr[BZ_CACHE_SLOTS];
+	size_t size[BZ_CACHE_SLOTS];
+	bool used[BZ_CACHE_SLOTS];
+};
+
 static struct compress_thread {
 	uchar *s_buf;	/* Uncompressed buffer -> Compressed buffer */
 	uchar c_type;	/* Compression type */
@@ -78,6 +95,21 @@ static struct compress_thread {
 	struct stream_info *sinfo;
 	int streamno;
 	uchar salt[SALT_LEN];
+	uchar nonce[LRZ_AEAD_NONCE_LEN];	/* AEAD nonce and tag of the */
+	uchar tag[LRZ_AEAD_TAG_LEN];		/* block sealed in s_buf */
+	CLzmaEncHandle lzma_enc;	/* Encoder kept between blocks */
+	int lzma_level, lzma_fb, lzma_threads;	/* Properties lzma_enc was set */
+	u32 lzma_dictsize;			/* up with */
+	uchar lzma_props[5];	/* Encoded properties of the lzma block in s_buf */
+	z_stream *zstrm;	/* Deflate stream kept between blocks */
+	int zlevel;		/* Level zstrm was initialised with */
+	struct bz_cache *bz;	/* Reusable bzip2 state allocations */
+	lzo_bytep lzo_wrkmem;	/* LZO work memory kept between blocks */
+	void *lz4_state;	/* LZ4 / LZ4HC state kept between blocks */
+	void *zpaq;		/* ZPAQ models and JIT code kept between blocks */
+	uchar *prime;		/* Tail of the stream's previous block, if any */
+	i64 prime_len;
+	i64 mem_held;		/* Admitted footprint of the current job */
 } *cthreads;
 
 typedef struct stream_thread_struct {
@@ -90,6 +122,34 @@ static long output_thread;
 static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t output_cond = PTHREAD_COND_INITIALIZER;
 
+/* Decompression look-ahead. ucomp_queued blocks holding ucomp_ram bytes
+ * have been started and not yet taken, across every chunk being
+ * reconstructed and ahead_sinfo, the next chunk once every block of the
+ * current one has been started. in_lock protects these and serialises the
+ * seek and read pairs on the archive when chunks are rebuilt in parallel. */
+static pthread_mutex_t in_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stream_info *ahead_sinfo;
+
+/* Decoded bytes published by decompression threads, see uncomp_thread */
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+
+/* How much plain LZMA is decoded between publishing progress */
+#define LZMA_READY_STEP (1024 * 1024)
+static i64 ucomp_ram;
+static int ucomp_queued;
+
+/* Backend memory admission. Each compression job reserves its buffers and
+ * backend overhead from mem_budget before it is started and returns them
+ * once its block is written, so the number of jobs running at once follows
+ * the memory each one really needs. When not every worker fits at once
+ * (mem_tight), workers also drop their cached backend state after each
+ * block so idle workers do not pin memory the running ones need. */
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mem_cond = PTHREAD_COND_INITIALIZER;
+static i64 mem_budget, mem_reserved;
+static bool mem_tight;
+
 bool init_mutex(rzip_control *control, pthread_mutex_t *mutex)
 {
 	if (unlikely(pthread_mutex_init(mutex, NULL)))
@@ -125,6 +185,26 @@ static bool cond_broadcast(rzip_control *control, pthread_cond_t *cond)
 	return true;
 }
 
+/* Called in job order by the single producer, so an admitted job never
+ * waits on one admitted after it. A job is always let in when nothing else
+ * holds memory, however large, so progress is guaranteed. */
+static void mem_reserve(rzip_control *control, i64 need)
+{
+	lock_mutex(control, &mem_lock);
+	while (mem_reserved && mem_reserved + need > mem_budget)
+		cond_wait(control, &mem_cond, &mem_lock);
+	mem_reserved += need;
+	unlock_mutex(control, &mem_lock);
+}
+
+static void mem_release(rzip_control *control, i64 held)
+{
+	lock_mutex(control, &mem_lock);
+	mem_reserved -= held;
+	cond_broadcast(control, &mem_cond);
+	unlock_mutex(control, &mem_lock);
+}
+
 bool create_pthread(rzip_control *control, pthread_t *thread, pthread_attr_t * attr,
 	void * (*start_routine)(void *), void *arg)
 {
@@ -156,10 +236,213 @@ bool join_pthread(rzip_control *control, pthread_t th, void **thread_return)
 */
 static int lz4_compresses(rzip_control *control, uchar *s_buf, i64 s_len);
 
+/* A cheap look at a block before choosing what to do with it: the order 0
+ * entropy of its bytes, and how often a 4 byte sequence repeats one seen
+ * shortly before, which is roughly what an LZ coder can exploit. Only up to
+ * PROBE_SLICES evenly spaced slices are examined so the cost is fixed. */
+#define PROBE_SLICES 16
+#define PROBE_SLICE_LEN 4096
+#define PROBE_HASH_BITS 12
+
+/* Above PROBE_STORE_BITS with almost no repeats a block looks like noise;
+ * below PROBE_WEAK_BITS or with frequent repeats it clearly compresses. */
+#define PROBE_STORE_BITS 7.9
+#define PROBE_STORE_MATCHES 5
+#define PROBE_WEAK_BITS 7.0
+#define PROBE_WEAK_MATCHES 30
+
+struct block_probe {
+	double entropy;		/* bits per byte, 0 .. 8 */
+	int match_pm;		/* positions repeating a recent sequence, per 1000 */
+};
+
+static void probe_block(const uchar *buf, i64 len, struct block_probe *bp)
+{
+	u32 hist[4][256], last[1 << PROBE_HASH_BITS];
+	i64 stride, slen, nslices, i, j, total = 0, matches = 0;
+
+	memset(hist, 0, sizeof(hist));
+	if (len <= PROBE_SLICES * PROBE_SLICE_LEN) {
+		nslices = 1;
+		slen = stride = len;
+	} else {
+		nslices = PROBE_SLICES;
+		slen = PROBE_SLICE_LEN;
+		stride = len / PROBE_SLICES;
+	}
+
+	for (i = 0; i < nslices; i++) {
+		const uchar *p = buf + i * stride;
+
+		/* Four interleaved tables keep runs of equal bytes from stalling
+		 * on the same counter, and let the compiler unroll freely */
+		for (j = 0; j + 4 <= slen; j += 4) {
+			hist[0][p[j]]++;
+			hist[1][p[j + 1]]++;
+			hist[2][p[j + 2]]++;
+			hist[3][p[j + 3]]++;
+		}
+		for (; j < slen; j++)
+			hist[0][p[j]]++;
+
+		/* Positions are stored + 1 so that 0 means an empty slot */
+		memset(last, 0, sizeof(last));
+		for (j = 0; j + 4 <= slen; j++) {
+			u32 v, h;
+
+			memcpy(&v, p + j, 4);
+			h = (v * 2654435761u) >> (32 - PROBE_HASH_BITS);
+			if (last[h] && !memcmp(p + last[h] - 1, p + j, 4))
+				matches++;
+			last[h] = j + 1;
+		}
+		total += slen;
+	}
+
+	bp->entropy = 0;
+	for (i = 0; i < 256; i++) {
+		u32 n = hist[0][i] + hist[1][i] + hist[2][i] + hist[3][i];
+		double f;
+
+		if (!n)
+			continue;
+		f = (double)n / total;
+		bp->entropy -= f * log2(f);
+	}
+	bp->match_pm = total ? matches * 1000 / total : 0;
+}
+
+static void *bz_cache_alloc(void *opaque, int items, int size)
+{
+	struct bz_cache *bz = opaque;
+	size_t len = (size_t)items * size;
+	int i, spare = -1;
+
+	for (i = 0; i < BZ_CACHE_SLOTS; i++) {
+		if (bz->used[i])
+			continue;
+		if (bz->ptr[i] && bz->size[i] == len) {
+			bz->used[i] = true;
+			return bz->ptr[i];
+		}
+		if (spare == -1 || !bz->ptr[i])
+			spare = i;
+	}
+	if (spare == -1)
+		return malloc(len);
+	free(bz->ptr[spare]);
+	bz->ptr[spare] = malloc(len);
+	bz->size[spare] = bz->ptr[spare] ? len : 0;
+	bz->used[spare] = !!bz->ptr[spare];
+	return bz->ptr[spare];
+}
+
+static void bz_cache_free(void *opaque, void *addr)
+{
+	struct bz_cache *bz = opaque;
+	int i;
+
+	for (i = 0; i < BZ_CACHE_SLOTS; i++) {
+		if (bz->ptr[i] == addr) {
+			bz->used[i] = false;
+			return;
+		}
+	}
+	free(addr);
+}
+
+static bool bz_cache_setup(struct bz_cache **bzp, bz_stream *strm)
+{
+	if (!*bzp) {
+		*bzp = calloc(1, sizeof(struct bz_cache));
+		if (unlikely(!*bzp))
+			return false;
+	}
+	memset(strm, 0, sizeof(*strm));
+	strm->bzalloc = bz_cache_alloc;
+	strm->bzfree = bz_cache_free;
+	strm->opaque = *bzp;
+	return true;
+}
+
+static void bz_cache_release(struct bz_cache **bzp)
+{
+	struct bz_cache *bz = *bzp;
+	int i;
+
+	if (!bz)
+		return;
+	for (i = 0; i < BZ_CACHE_SLOTS; i++)
+		free(bz->ptr[i]);
+	dealloc(*bzp);
+}
+
+/* compress2() and uncompress() on a stream that stays initialised between
+ * blocks, feeding it in uInt sized pieces the same way. */
+static int zlib_deflate_buf(z_stream *zs, uchar *dest, unsigned long *dest_len,
+			    uchar *src, i64 src_len)
+{
+	const uInt max = (uInt)-1;
+	unsigned long left = *dest_len;
+	int err;
+
+	if (unlikely(deflateReset(zs) != Z_OK))
+		return Z_STREAM_ERROR;
+	zs->next_out = dest;
+	zs->avail_out = 0;
+	zs->next_in = src;
+	zs->avail_in = 0;
+	do {
+		if (!zs->avail_out) {
+			zs->avail_out = left > (unsigned long)max ? max : (uInt)left;
+			left -= zs->avail_out;
+		}
+		if (!zs->avail_in) {
+			zs->avail_in = src_len > (i64)max ? max : (uInt)src_len;
+			src_len -= zs->avail_in;
+		}
+		err = deflate(zs, src_len ? Z_NO_FLUSH : Z_FINISH);
+	} while (err == Z_OK);
+	*dest_len = zs->total_out;
+	return err == Z_STREAM_END ? Z_OK : err;
+}
+
+static int zlib_inflate_buf(z_stream *zs, uchar *dest, unsigned long *dest_len,
+			    uchar *src, i64 src_len)
+{
+	const uInt max = (uInt)-1;
+	unsigned long left = *dest_len;
+	int err;
+
+	if (unlikely(inflateReset(zs) != Z_OK))
+		return Z_STREAM_ERROR;
+	zs->next_out = dest;
+	zs->avail_out = 0;
+	zs->next_in = src;
+	zs->avail_in = 0;
+	do {
+		if (!zs->avail_out) {
+			zs->avail_out = left > (unsigned long)max ? max : (uInt)left;
+			left -= zs->avail_out;
+		}
+		if (!zs->avail_in) {
+			zs->avail_in = src_len > (i64)max ? max : (uInt)src_len;
+			src_len -= zs->avail_in;
+		}
+		err = inflate(zs, Z_NO_FLUSH);
+	} while (err == Z_OK);
+	*dest_len = zs->total_out;
+	if (err == Z_STREAM_END)
+		return Z_OK;
+	if (err == Z_NEED_DICT || (err == Z_BUF_ERROR && left + zs->avail_out))
+		return Z_DATA_ERROR;
+	return err;
+}
+
 /*
   ***** COMPRESSION FUNCTIONS *****
 
-  ZPAQ, BZIP, GZIP, LZMA, LZO
+  ZPAQ, BZIP, GZIP, LZMA, LZO, LZ4
 
   try to compress a buffer. If compression fails for whatever reason then
   leave uncompressed. Return the compression type in c_type and resulting
@@ -185,8 +468,8 @@ static int zpaq_compress_buf(rzip_control *control, struct compress_thread *cthr
 
 	c_len = 0;
 
-	zpaq_compress(c_buf, &c_len, cthread->s_buf, cthread->s_len, control->compression_level / 4 + 1,
-		      control->msgout, SHOW_PROGRESS ? true: false, thread);
+	zpaq_compress(c_buf, &c_len, c_size, cthread->s_buf, cthread->s_len, control->compression_level / 4 + 1,
+		      control->msgout, SHOW_PROGRESS ? true: false, thread, &cthread->zpaq);
 
 	if (unlikely(c_len >= cthread->c_len)) {
 		print_maxverbose("Incompressible block\n");
@@ -202,6 +485,34 @@ static int zpaq_compress_buf(rzip_control *control, struct compress_thread *cthr
 	return 0;
 }
 
+/* BZ2_bzBuffToBuffCompress with the worker's recycled allocations */
+static int bzip2_buf_compress(rzip_control *control, struct compress_thread *cthread,
+			      uchar *c_buf, u32 *dlen)
+{
+	bz_stream strm;
+	int ret;
+
+	if (unlikely(!bz_cache_setup(&cthread->bz, &strm)))
+		return BZ_MEM_ERROR;
+	ret = BZ2_bzCompressInit(&strm, control->compression_level, 0,
+				 control->compression_level * 10);
+	if (ret != BZ_OK)
+		return ret;
+	strm.next_in = (char *)cthread->s_buf;
+	strm.avail_in = cthread->s_len;
+	strm.next_out = (char *)c_buf;
+	strm.avail_out = *dlen;
+	ret = BZ2_bzCompress(&strm, BZ_FINISH);
+	if (ret == BZ_FINISH_OK)
+		ret = BZ_OUTBUFF_FULL;
+	else if (ret == BZ_STREAM_END) {
+		*dlen -= strm.avail_out;
+		ret = BZ_OK;
+	}
+	BZ2_bzCompressEnd(&strm);
+	return ret;
+}
+
 static int bzip2_compress_buf(rzip_control *control, struct compress_thread *cthread)
 {
 	u32 dlen = round_up_page(control, cthread->s_len);
@@ -217,9 +528,7 @@ static int bzip2_compress_buf(rzip_control *control, struct compress_thread *cth
 		return -1;
 	}
 
-	bzip2_ret = BZ2_bzBuffToBuffCompress((char *)c_buf, &dlen,
-		(char *)cthread->s_buf, cthread->s_len,
-		control->compression_level, 0, control->compression_level * 10);
+	bzip2_ret = bzip2_buf_compress(control, cthread, c_buf, &dlen);
 
 	/* if compressed data is bigger then original data leave as
 	 * CTYPE_NONE */
@@ -263,8 +572,28 @@ static int gzip_compress_buf(rzip_control *control, struct compress_thread *cthr
 		return -1;
 	}
 
-	gzip_ret = compress2(c_buf, &dlen, cthread->s_buf, cthread->s_len,
-		control->compression_level);
+	if (cthread->zstrm && cthread->zlevel != control->compression_level) {
+		deflateEnd(cthread->zstrm);
+		dealloc(cthread->zstrm);
+	}
+	if (!cthread->zstrm) {
+		cthread->zstrm = calloc(1, sizeof(z_stream));
+		if (unlikely(!cthread->zstrm)) {
+			print_err("Unable to allocate z_stream in gzip_compress_buf\n");
+			dealloc(c_buf);
+			return -1;
+		}
+		if (unlikely(deflateInit(cthread->zstrm, control->compression_level) != Z_OK)) {
+			dealloc(cthread->zstrm);
+			dealloc(c_buf);
+			print_maxverbose("deflateInit failed\n");
+			return -1;
+		}
+		cthread->zlevel = control->compression_level;
+	}
+
+	gzip_ret = zlib_deflate_buf(cthread->zstrm, c_buf, &dlen, cthread->s_buf,
+				    cthread->s_len);
 
 	/* if compressed data is bigger then original data leave as
 	 * CTYPE_NONE */
@@ -304,15 +633,109 @@ static int ctype_filter_kind(int ctype)
 	return LRZ_FILTER_NONE;
 }
 
+static void lzma_enc_release(struct compress_thread *cthread)
+{
+	if (cthread->lzma_enc) {
+		LzmaEnc_Destroy(cthread->lzma_enc, &g_Alloc, &g_Alloc);
+		cthread->lzma_enc = NULL;
+	}
+}
+
+/* Each worker keeps its encoder, with the match finder hash and window
+ * tables it allocated, from block to block; LzmaEnc_MemEncode resets the
+ * state for every new block. It is only recreated when the properties
+ * change, such as when a low memory retry shrinks the dictionary. */
+static SRes lzma_enc_setup(struct compress_thread *cthread, int level, u32 dictsize,
+			   int fb, int threads)
+{
+	CLzmaEncProps props;
+	SRes res;
+
+	if (cthread->lzma_enc && cthread->lzma_level == level &&
+	    cthread->lzma_dictsize == dictsize && cthread->lzma_fb == fb &&
+	    cthread->lzma_threads == threads)
+		return SZ_OK;
+
+	lzma_enc_release(cthread);
+	cthread->lzma_enc = LzmaEnc_Create(&g_Alloc);
+	if (unlikely(!cthread->lzma_enc))
+		return SZ_ERROR_MEM;
+
+	LzmaEncProps_Init(&props);
+	props.level = level;
+	props.dictSize = dictsize;
+	props.fb = fb;
+	props.numThreads = threads;
+	res = LzmaEnc_SetProps(cthread->lzma_enc, &props);
+	if (unlikely(res != SZ_OK)) {
+		lzma_enc_release(cthread);
+		return res;
+	}
+	cthread->lzma_level = level;
+	cthread->lzma_dictsize = dictsize;
+	cthread->lzma_fb = fb;
+	cthread->lzma_threads = threads;
+	return SZ_OK;
+}
+
+/* only 7 levels with lzma, scale them. --ultra instead uses the lzma level
+ * scale directly with an explicit large dictionary, and 273 fast bytes like
+ * xz -e for maximum ratio. */
+static int lzma_pick_level(rzip_control *control, int *fb)
+{
+	int level;
+
+	if (ULTRA) {
+		level = control->compression_level;
+		if (!level)
+			level = 1;
+		else if (level > 9)
+			level = 9;
+		*fb = 273;
+	} else {
+		level = control->compression_level * 7 / 9;
+		if (!level)
+			level = 1;
+		*fb = -1;
+	}
+	return level;
+}
+
+/* dict size is bytes 1-4 of the properties, little endian */
+static u32 lzma_props_dict(const uchar *props)
+{
+	return props[1] | props[2] << 8 | props[3] << 16 | (u32)props[4] << 24;
+}
+
+/* How much of a block of len bytes is kept to prime the next block of its
+ * stream with: no more than the encoder's dictionary can reach back into.
+ * The match finder has to be run over the prime as well, so outside of
+ * --ultra it is held to a quarter of the block, which keeps most of the
+ * gain for a fraction of the extra work. */
+static i64 prime_size(rzip_control *control, i64 len)
+{
+	CLzmaEncProps props;
+	int fb;
+
+	LzmaEncProps_Init(&props);
+	props.level = lzma_pick_level(control, &fb);
+	lock_mutex(control, &control->control_lock);
+	props.dictSize = control->lzma_dictsize;
+	unlock_mutex(control, &control->control_lock);
+	if (!ULTRA)
+		len /= 4;
+	return MIN(len, (i64)LzmaEncProps_GetDictSize(&props));
+}
+
 static int lzma_compress_buf(rzip_control *control, struct compress_thread *cthread)
 {
 	unsigned char lzma_properties[5]; /* lzma properties, encoded */
 	int lzma_level, lzma_fb, lzma_ret;
-	size_t prop_size = 5; /* return value for lzma_properties */
+	SizeT prop_size; /* return value for lzma_properties */
 	u32 dictsize;
 	int filter;
-	uchar *c_buf;
-	size_t dlen;
+	uchar *c_buf, *src;
+	SizeT dlen, prime, hdr = 0;
 
 	if (!lz4_compresses(control, cthread->s_buf, cthread->s_len))
 		return 0;
@@ -327,22 +750,29 @@ static int lzma_compress_buf(rzip_control *control, struct compress_thread *cthr
 	if (filter != LRZ_FILTER_NONE)
 		lrz_filter_convert_mem(cthread->s_buf, cthread->s_len, filter, true);
 
-	/* only 7 levels with lzma, scale them. --ultra instead uses the lzma
-	 * level scale directly with an explicit large dictionary, and 273
-	 * fast bytes like xz -e for maximum ratio. */
-	if (ULTRA) {
-		lzma_level = control->compression_level;
-		if (!lzma_level)
-			lzma_level = 1;
-		else if (lzma_level > 9)
-			lzma_level = 9;
-		lzma_fb = 273;
-	} else {
-		lzma_level = control->compression_level * 7 / 9;
-		if (!lzma_level)
-			lzma_level = 1;
-		lzma_fb = -1;
+	/* A primed block is encoded from its prime and data laid out one
+	 * after the other, and stores the length of the prime it used in
+	 * front of the lzma data. Filtered blocks are not primed since the
+	 * prime holds unfiltered bytes. */
+	src = cthread->s_buf;
+	if (filter == LRZ_FILTER_NONE && cthread->prime) {
+		src = malloc(cthread->prime_len + cthread->s_len);
+		if (likely(src)) {
+			memcpy(src, cthread->prime, cthread->prime_len);
+			memcpy(src + cthread->prime_len, cthread->s_buf, cthread->s_len);
+			hdr = 4;
+		} else
+			src = cthread->s_buf;
 	}
+	if (hdr)
+		print_maxverbose("Priming lzma block with up to %"PRId64" bytes\n", cthread->prime_len);
+	else
+		cthread->prime_len = 0;
+	/* -c decodes the block again after the same prime */
+	if (!hdr || !CHECK_FILE)
+		dealloc(cthread->prime);
+
+	lzma_level = lzma_pick_level(control, &lzma_fb);
 
 	print_maxverbose("Starting lzma back end compression thread...\n");
 retry:
@@ -359,20 +789,41 @@ retry:
 		goto restore_filter_fail;
 	}
 
-	/* LZMA SDK 26.02 LzmaCompress: level + threads; props returned in
+	/* LZMA SDK 26.02 encoder: level + threads; props returned in
 	 * lzma_properties (5 bytes). Default dict size per level is larger
 	 * than the old 4.63/9.x tables. */
-
-	lzma_ret = LzmaCompress(c_buf, &dlen, cthread->s_buf,
-		(size_t)cthread->s_len, lzma_properties, &prop_size,
-				lzma_level,
-				dictsize, /* dict size scaled to level and ram */
-				-1, -1, -1, lzma_fb, /* lc, lp, pb, fb */
-				control->threads > 1 || ULTRA ? 2 : 1);
-				/* ultra packs whole streams into single blocks, so
-				 * keep the encoder's match finder thread. */
-				/* LZMA spec has threads = 1 or 2 only. */
+	lzma_ret = lzma_enc_setup(cthread, lzma_level,
+				  dictsize, /* dict size scaled to level and ram */
+				  lzma_fb,
+				  control->threads > 1 || ULTRA ? 2 : 1);
+				  /* ultra packs whole streams into single blocks, so
+				   * keep the encoder's match finder thread. */
+				  /* LZMA spec has threads = 1 or 2 only. */
+	if (lzma_ret == SZ_OK) {
+		prop_size = LZMA_PROPS_SIZE;
+		lzma_ret = LzmaEnc_WriteProperties(cthread->lzma_enc, lzma_properties, &prop_size);
+	}
+	if (lzma_ret == SZ_OK) {
+		/* Matches cannot reach further back than the dictionary */
+		prime = MIN((SizeT)cthread->prime_len, lzma_props_dict(lzma_properties));
+		dlen -= hdr;
+		lzma_ret = LzmaEnc_MemEncodePrimed(cthread->lzma_enc, c_buf + hdr, &dlen,
+						   src + cthread->prime_len - prime,
+						   prime + (SizeT)cthread->s_len, prime, 0, NULL,
+						   &g_Alloc, &g_Alloc);
+		dlen += hdr;
+		if (hdr) {
+			u32 le_prime = htole32((u32)prime);
+
+			memcpy(c_buf, &le_prime, 4);
+		}
+	}
 	if (lzma_ret != SZ_OK) {
+		/* An overflow leaves the encoder reusable; anything else
+		 * drops it, and with it any memory it held, before we retry
+		 * or give up. */
+		if (lzma_ret != SZ_ERROR_OUTPUT_EOF)
+			lzma_enc_release(cthread);
 		switch (lzma_ret) {
 			case SZ_ERROR_MEM:
 				break;
@@ -410,6 +861,8 @@ retry:
 			/* If lzma cannot allocate any dictionary, fall back to
 			 * bzip2 so the block does not remain uncompressed. */
 			print_verbose("Unable to allocate enough RAM for any sized compression window, falling back to bzip2 compression.\n");
+			if (src != cthread->s_buf)
+				dealloc(src);
 			if (filter != LRZ_FILTER_NONE)
 				lrz_filter_convert_mem(cthread->s_buf, cthread->s_len, filter, false);
 			return bzip2_compress_buf(control, cthread);
@@ -425,19 +878,17 @@ retry:
 		goto restore_filter_ok;
 	}
 
+	/* -c decodes the block with its own properties, as the shared ones
+	 * may change under it */
+	memcpy(cthread->lzma_props, lzma_properties, 5);
+
 	/* Make sure multiple threads don't race on writing lzma_properties.
 	 * If a low memory retry gave some block a smaller dictionary, keep
 	 * the largest so the decoder allocates enough window for every
 	 * block. */
 	lock_mutex(control, &control->control_lock);
 	if (control->lzma_prop_set) {
-		/* dict size is bytes 1-4 of the properties, little endian */
-		u32 stored_dict = control->lzma_properties[1] | control->lzma_properties[2] << 8 |
-			control->lzma_properties[3] << 16 | (u32)control->lzma_properties[4] << 24;
-		u32 this_dict = lzma_properties[1] | lzma_properties[2] << 8 |
-			lzma_properties[3] << 16 | (u32)lzma_properties[4] << 24;
-
-		if (this_dict > stored_dict)
+		if (lzma_props_dict(lzma_properties) > lzma_props_dict(control->lzma_properties))
 			memcpy(control->lzma_properties, lzma_properties, 5);
 	}
 	if (!control->lzma_prop_set) {
@@ -452,20 +903,29 @@ retry:
 	unlock_mutex(control, &control->control_lock);
 
 	cthread->c_len = dlen;
+	if (src != cthread->s_buf)
+		dealloc(src);
 	dealloc(cthread->s_buf);
 	cthread->s_buf = c_buf;
-	cthread->c_type = filter == LRZ_FILTER_NONE ? CTYPE_LZMA :
-		CTYPE_LZMA_BCJ + filter - LRZ_FILTER_X86;
+	if (hdr)
+		cthread->c_type = CTYPE_LZMA_PRIMED;
+	else
+		cthread->c_type = filter == LRZ_FILTER_NONE ? CTYPE_LZMA :
+			CTYPE_LZMA_BCJ + filter - LRZ_FILTER_X86;
 	return 0;
 
 restore_filter_ok:
 	/* Blocks left uncompressed must hold the original bytes, so undo
 	 * any in place filter conversion. */
+	if (src != cthread->s_buf)
+		dealloc(src);
 	if (filter != LRZ_FILTER_NONE)
 		lrz_filter_convert_mem(cthread->s_buf, cthread->s_len, filter, false);
 	return 0;
 
 restore_filter_fail:
+	if (src != cthread->s_buf)
+		dealloc(src);
 	if (filter != LRZ_FILTER_NONE)
 		lrz_filter_convert_mem(cthread->s_buf, cthread->s_len, filter, false);
 	return -1;
@@ -475,47 +935,145 @@ static int lzo_compress_buf(rzip_control *control, struct compress_thread *cthre
 {
 	lzo_uint in_len = cthread->s_len;
 	lzo_uint dlen = round_up_page(control, in_len + in_len / 16 + 64 + 3);
-	lzo_bytep wrkmem;
 	uchar *c_buf;
-	int ret = -1;
 
-	wrkmem = (lzo_bytep) calloc(1, LZO1X_1_MEM_COMPRESS);
-	if (unlikely(wrkmem == NULL)) {
-		print_maxverbose("Failed to malloc wkmem\n");
-		return ret;
+	/* The work memory needs no initialisation between blocks */
+	if (!cthread->lzo_wrkmem) {
+		cthread->lzo_wrkmem = (lzo_bytep) calloc(1, LZO1X_1_MEM_COMPRESS);
+		if (unlikely(cthread->lzo_wrkmem == NULL)) {
+			print_maxverbose("Failed to malloc wkmem\n");
+			return -1;
+		}
 	}
 
 	c_buf = malloc(dlen);
 	if (!c_buf) {
 		print_err("Unable to allocate c_buf in lzo_compress_buf");
-		goto out_free;
+		return -1;
 	}
 
 	/* lzo1x_1_compress does not return anything but LZO_OK so we ignore
 	 * the return value */
-	lzo1x_1_compress(cthread->s_buf, in_len, c_buf, &dlen, wrkmem);
-	ret = 0;
+	lzo1x_1_compress(cthread->s_buf, in_len, c_buf, &dlen, cthread->lzo_wrkmem);
 
 	if (dlen >= in_len){
 		/* Incompressible, leave as CTYPE_NONE */
 		print_maxverbose("Incompressible block\n");
 		dealloc(c_buf);
-		goto out_free;
+		return 0;
 	}
 
 	cthread->c_len = dlen;
 	dealloc(cthread->s_buf);
 	cthread->s_buf = c_buf;
 	cthread->c_type = CTYPE_LZO;
-out_free:
-	dealloc(wrkmem);
-	return ret;
+	return 0;
+}
+
+/* Levels 1-3 use the fast coder with decreasing acceleration, higher
+ * levels lz4hc, level 7 mapping to its default */
+#define LZ4_FAST_LEVELS 3
+static const int lz4hc_levels[10] = { 0, 0, 0, 0, 4, 6, 8, 9, 10, 12 };
+
+static int lz4_compress_buf(rzip_control *control, struct compress_thread *cthread)
+{
+	int level = control->compression_level, in_len, dlen;
+	uchar *c_buf;
+
+	if (unlikely(cthread->s_len > LZ4_MAX_INPUT_SIZE)) {
+		print_maxverbose("Block too large for lz4, leaving uncompressed\n");
+		return 0;
+	}
+	if (level < 1)
+		level = 1;
+	else if (level > 9)
+		level = 9;
+	in_len = cthread->s_len;
+	dlen = LZ4_compressBound(in_len);
+
+	/* Both coders initialise the state themselves on each call */
+	if (!cthread->lz4_state) {
+		cthread->lz4_state = malloc(MAX(LZ4_sizeofState(), LZ4_sizeofStateHC()));
+		if (unlikely(!cthread->lz4_state)) {
+			print_maxverbose("Failed to malloc lz4 state\n");
+			return -1;
+		}
+	}
+
+	c_buf = malloc(dlen);
+	if (!c_buf) {
+		print_err("Unable to allocate c_buf in lz4_compress_buf");
+		return -1;
+	}
+
+	if (level <= LZ4_FAST_LEVELS)
+		dlen = LZ4_compress_fast_extState(cthread->lz4_state, (const char *)cthread->s_buf,
+						  (char *)c_buf, in_len, dlen, LZ4_FAST_LEVELS + 1 - level);
+	else
+		dlen = LZ4_compress_HC_extStateHC(cthread->lz4_state, (const char *)cthread->s_buf,
+						  (char *)c_buf, in_len, dlen, lz4hc_levels[level]);
+
+	if (!dlen || dlen >= in_len) {
+		/* Incompressible, leave as CTYPE_NONE */
+		print_maxverbose("Incompressible block\n");
+		dealloc(c_buf);
+		return 0;
+	}
+
+	cthread->c_len = dlen;
+	dealloc(cthread->s_buf);
+	cthread->s_buf = c_buf;
+	cthread->c_type = CTYPE_LZ4;
+	return 0;
+}
+
+/* Blocks that look like noise are stored, ones with little structure get a
+ * fast coder, and the rest get the policy's strongest choice. */
+enum { PROBE_STORE, PROBE_WEAK, PROBE_STRONG };
+
+static const uchar auto_ctypes[3][3] = {
+	/*		   store	weak		strong */
+	[LRZ_AUTO_SPEED - 1] =	  { CTYPE_NONE,	CTYPE_LZO,	CTYPE_GZIP },
+	[LRZ_AUTO_BALANCED - 1] = { CTYPE_NONE,	CTYPE_GZIP,	CTYPE_LZMA },
+	[LRZ_AUTO_RATIO - 1] =	  { CTYPE_NONE,	CTYPE_LZMA,	CTYPE_LZMA },
+};
+
+static int auto_compress_buf(rzip_control *control, struct compress_thread *cthread)
+{
+	struct block_probe bp;
+	int class;
+	uchar ctype;
+
+	probe_block(cthread->s_buf, cthread->s_len, &bp);
+	if (bp.entropy > PROBE_STORE_BITS && bp.match_pm < PROBE_STORE_MATCHES)
+		class = PROBE_STORE;
+	else if (bp.entropy > PROBE_WEAK_BITS || bp.match_pm < PROBE_WEAK_MATCHES)
+		class = PROBE_WEAK;
+	else
+		class = PROBE_STRONG;
+	ctype = auto_ctypes[control->auto_policy - 1][class];
+
+	print_maxverbose("Auto probe: %.2f bits/byte, %d/1000 repeats, using %s\n",
+			 bp.entropy, bp.match_pm,
+			 ctype == CTYPE_NONE ? "none" : ctype == CTYPE_LZO ? "lzo" :
+			 ctype == CTYPE_GZIP ? "gzip" : "lzma");
+
+	switch (ctype) {
+	case CTYPE_LZO:
+		return lzo_compress_buf(control, cthread);
+	case CTYPE_GZIP:
+		return gzip_compress_buf(control, cthread);
+	case CTYPE_LZMA:
+		return lzma_compress_buf(control, cthread);
+	default:
+		return 0;
+	}
 }
 
 /*
   ***** DECOMPRESSION FUNCTIONS *****
 
-  ZPAQ, BZIP, GZIP, LZMA, LZO
+  ZPAQ, BZIP, GZIP, LZMA, LZO, LZ4
 
   try to decompress a buffer. Return 0 on success and -1 on failure.
 */
@@ -536,7 +1094,7 @@ static int zpaq_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_t
 	dlen = 0;
 	zd_ret = zpaq_decompress(ucthread->s_buf, &dlen, c_buf, ucthread->c_len,
 			control->msgout, SHOW_PROGRESS ? true: false, thread,
-				ucthread->u_len);
+				ucthread->u_len, &ucthread->zpaq);
 
 	if (unlikely(zd_ret < 0)) {
 		print_err("Attempted to write beyond expected output size, corrupted input.\n");
@@ -556,6 +1114,33 @@ out:
 	return ret;
 }
 
+/* BZ2_bzBuffToBuffDecompress with the slot's recycled allocations */
+static int bzip2_buf_decompress(struct uncomp_thread *ucthread, uchar *dest, u32 *dlen,
+				uchar *c_buf)
+{
+	bz_stream strm;
+	int ret;
+
+	if (unlikely(!bz_cache_setup((struct bz_cache **)&ucthread->bz_mem, &strm)))
+		return BZ_MEM_ERROR;
+	ret = BZ2_bzDecompressInit(&strm, 0, 0);
+	if (ret != BZ_OK)
+		return ret;
+	strm.next_in = (char *)c_buf;
+	strm.avail_in = ucthread->c_len;
+	strm.next_out = (char *)dest;
+	strm.avail_out = *dlen;
+	ret = BZ2_bzDecompress(&strm);
+	if (ret == BZ_OK)
+		ret = strm.avail_out ? BZ_UNEXPECTED_EOF : BZ_OUTBUFF_FULL;
+	else if (ret == BZ_STREAM_END) {
+		*dlen -= strm.avail_out;
+		ret = BZ_OK;
+	}
+	BZ2_bzDecompressEnd(&strm);
+	return ret;
+}
+
 static int bzip2_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_thread *ucthread)
 {
 	u32 dlen = ucthread->u_len;
@@ -570,7 +1155,7 @@ static int bzip2_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_
 		goto out;
 	}
 
-	bzerr = BZ2_bzBuffToBuffDecompress((char*)ucthread->s_buf, &dlen, (char*)c_buf, ucthread->c_len, 0, 0);
+	bzerr = bzip2_buf_decompress(ucthread, ucthread->s_buf, &dlen, c_buf);
 	if (unlikely(bzerr != BZ_OK)) {
 		print_err("Failed to decompress buffer - bzerr=%d\n", bzerr);
 		ret = -1;
@@ -604,7 +1189,18 @@ static int gzip_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_t
 		goto out;
 	}
 
-	gzerr = uncompress(ucthread->s_buf, &dlen, c_buf, ucthread->c_len);
+	if (!ucthread->zstrm) {
+		z_stream *zs = calloc(1, sizeof(z_stream));
+
+		if (unlikely(!zs || inflateInit(zs) != Z_OK)) {
+			dealloc(zs);
+			print_err("Failed to initialise inflate stream\n");
+			ret = -1;
+			goto out;
+		}
+		ucthread->zstrm = zs;
+	}
+	gzerr = zlib_inflate_buf(ucthread->zstrm, ucthread->s_buf, &dlen, c_buf, ucthread->c_len);
 	if (unlikely(gzerr != Z_OK)) {
 		print_err("Failed to decompress buffer - gzerr=%d\n", gzerr);
 		ret = -1;
@@ -624,24 +1220,140 @@ out:
 	return ret;
 }
 
-static int lzma_decompress_buf(rzip_control *control, struct uncomp_thread *ucthread)
+static void publish_ready(rzip_control *control, struct uncomp_thread *ucthread,
+			  i64 ready, bool done)
+{
+	lock_mutex(control, &ready_lock);
+	ucthread->ready = ready;
+	ucthread->done |= done;
+	cond_broadcast(control, &ready_cond);
+	unlock_mutex(control, &ready_lock);
+}
+
+/* Decode one whole block into dest, the equivalent of LzmaUncompress but
+ * with the decoder state kept in the thread slot. Its probability tables
+ * are only reallocated when the properties ask for a different size, and
+ * the decoder is reinitialised for every block. With publish, the output
+ * is decoded LZMA_READY_STEP at a time and what is done made ready. A
+ * primed block finds its prime in the first prime bytes of dest and is
+ * decoded after it. */
+static SRes lzma_dec_block(rzip_control *control, struct uncomp_thread *ucthread,
+			   uchar *dest, SizeT *dest_len, const uchar *src, SizeT *src_len,
+			   const uchar *props, SizeT prime, bool publish)
+{
+	SizeT out_size = *dest_len, in_size = *src_len, in_pos = 0;
+	ELzmaStatus status;
+	CLzmaDec *dec;
+	SRes res;
+
+	*dest_len = *src_len = 0;
+	/* The range coder needs its 5 init bytes */
+	if (unlikely(in_size < 5))
+		return SZ_ERROR_INPUT_EOF;
+	dec = ucthread->lzma_dec;
+	if (!dec) {
+		dec = ucthread->lzma_dec = malloc(sizeof(CLzmaDec));
+		if (unlikely(!dec))
+			return SZ_ERROR_MEM;
+		LzmaDec_Construct(dec);
+	}
+	res = LzmaDec_AllocateProbs(dec, props, LZMA_PROPS_SIZE, &g_Alloc);
+	if (unlikely(res != SZ_OK))
+		return res;
+	dec->dic = dest;
+	dec->dicBufSize = out_size;
+	LzmaDec_InitPrimed(dec, prime);
+	do {
+		SizeT limit = publish ? MIN(out_size, dec->dicPos + LZMA_READY_STEP) : out_size;
+		SizeT in_len = in_size - in_pos;
+
+		res = LzmaDec_DecodeToDic(dec, limit, src + in_pos, &in_len, LZMA_FINISH_ANY, &status);
+		in_pos += in_len;
+		if (publish)
+			publish_ready(control, ucthread, dec->dicPos, false);
+	} while (res == SZ_OK && status == LZMA_STATUS_NOT_FINISHED && dec->dicPos < out_size);
+	*src_len = in_pos;
+	*dest_len = dec->dicPos - prime;
+	/* Never leave a pointer to the block buffer behind */
+	dec->dic = NULL;
+	if (res == SZ_OK && status == LZMA_STATUS_NEEDS_MORE_INPUT)
+		res = SZ_ERROR_INPUT_EOF;
+	return res;
+}
+
+/* Free the backend state a decompression slot has kept between blocks */
+static void ucthread_release(struct uncomp_thread *ucthread)
+{
+	if (ucthread->lzma_dec) {
+		LzmaDec_FreeProbs(ucthread->lzma_dec, &g_Alloc);
+		dealloc(ucthread->lzma_dec);
+	}
+	if (ucthread->zstrm) {
+		inflateEnd(ucthread->zstrm);
+		dealloc(ucthread->zstrm);
+	}
+	bz_cache_release((struct bz_cache **)&ucthread->bz_mem);
+	zpaq_free(ucthread->zpaq);
+	ucthread->zpaq = NULL;
+}
+
+/* With publish the block may be read while it decodes, so its output
+ * buffer is published first and kept, even across a failed attempt. A
+ * primed block is decoded after the prime it names, copied from the tail of
+ * the stream's previous block, and skip marks where its own data starts. */
+static int lzma_decompress_buf(rzip_control *control, struct uncomp_thread *ucthread,
+			       const struct stream *s, const uchar *props, bool publish)
 {
 	size_t dlen = ucthread->u_len;
 	int ret = 0, lzmaerr;
-	uchar *c_buf;
-	SizeT c_len = ucthread->c_len;
+	uchar *c_buf, *src;
+	SizeT c_len = ucthread->c_len, skip = 0;
 
-	c_buf = ucthread->s_buf;
-	ucthread->s_buf = malloc(round_up_page(control, dlen));
+	c_buf = src = ucthread->s_buf;
+	if (ucthread->c_type == CTYPE_LZMA_PRIMED) {
+		u32 le_prime;
+
+		if (unlikely(c_len < 4)) {
+			print_err("Primed lzma block of %"PRId64" bytes is too short\n", (i64)c_len);
+			return -1;
+		}
+		memcpy(&le_prime, c_buf, 4);
+		skip = le32toh(le_prime);
+		if (unlikely((i64)skip > s->prime_len)) {
+			print_err("Block primed with %"PRId64" bytes but only %"PRId64" are kept\n",
+				  (i64)skip, s->prime_len);
+			return -1;
+		}
+		src += 4;
+		c_len -= 4;
+	}
+
+	if (publish && ucthread->dec_buf)
+		ucthread->s_buf = ucthread->dec_buf;
+	else
+		ucthread->s_buf = malloc(round_up_page(control, skip + dlen));
 	if (unlikely(!ucthread->s_buf)) {
-		print_err("Failed to allocate %"PRId64" bytes for decompression\n", (i64)dlen);
+		print_err("Failed to allocate %"PRId64" bytes for decompression\n", (i64)(skip + dlen));
 		ret = -1;
 		goto out;
 	}
-
-	/* LZMA SDK: pass control->lzma_properties
-	 * which is needed for proper uncompress */
-	lzmaerr = LzmaUncompress(ucthread->s_buf, &dlen, c_buf, &c_len, control->lzma_properties, 5);
+	if (skip)
+		memcpy(ucthread->s_buf, s->prime + s->prime_len - skip, skip);
+
+	if (publish && !ucthread->dec_buf) {
+		lock_mutex(control, &ready_lock);
+		ucthread->dec_buf = ucthread->s_buf;
+		ucthread->skip = skip;
+		unlock_mutex(control, &ready_lock);
+	} else if (!publish)
+		ucthread->skip = skip;
+
+	/* LZMA SDK: pass the lzma properties
+	 * which are needed for proper uncompress */
+	dlen += skip;
+	/* A block with a CRC is only made ready once it has been checked */
+	lzmaerr = lzma_dec_block(control, ucthread, ucthread->s_buf, &dlen, src, &c_len,
+				 props, skip, publish && !ucthread->has_crc);
 	if (unlikely(lzmaerr)) {
 		print_err("Failed to decompress buffer - lzmaerr=%d\n", lzmaerr);
 		ret = -1;
@@ -655,7 +1367,8 @@ static int lzma_decompress_buf(rzip_control *control, struct uncomp_thread *ucth
 		dealloc(c_buf);
 out:
 	if (ret == -1) {
-		dealloc(ucthread->s_buf);
+		if (ucthread->s_buf != ucthread->dec_buf)
+			dealloc(ucthread->s_buf);
 		ucthread->s_buf = c_buf;
 	}
 	return ret;
@@ -695,6 +1408,39 @@ out:
 	return ret;
 }
 
+static int lz4_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_thread *ucthread)
+{
+	int ret = 0, dlen;
+	uchar *c_buf;
+
+	if (unlikely(ucthread->u_len > LZ4_MAX_INPUT_SIZE || ucthread->c_len > INT_MAX)) {
+		print_err("Invalid lz4 block size %"PRId64" / %"PRId64"\n", ucthread->c_len, ucthread->u_len);
+		return -1;
+	}
+
+	c_buf = ucthread->s_buf;
+	ucthread->s_buf = malloc(round_up_page(control, ucthread->u_len));
+	if (unlikely(!ucthread->s_buf)) {
+		print_err("Failed to allocate %"PRId64" bytes for decompression\n", ucthread->u_len);
+		ret = -1;
+		goto out;
+	}
+
+	dlen = LZ4_decompress_safe((const char *)c_buf, (char *)ucthread->s_buf,
+				   ucthread->c_len, ucthread->u_len);
+	if (unlikely(dlen != ucthread->u_len)) {
+		print_err("Inconsistent length after decompression. Got %d bytes, expected %"PRId64"\n", dlen, ucthread->u_len);
+		ret = -1;
+	} else
+		dealloc(c_buf);
+out:
+	if (ret == -1) {
+		dealloc(ucthread->s_buf);
+		ucthread->s_buf = c_buf;
+	}
+	return ret;
+}
+
 /* WORK FUNCTIONS */
 
 /* Look at whether we're writing to a ram location or physical files and write
@@ -1019,6 +1765,21 @@ bool wait_streamout_threads(rzip_control *control)
 	return true;
 }
 
+/* Free the backend state a compression worker has kept between blocks */
+static void cthread_release(struct compress_thread *cthread)
+{
+	lzma_enc_release(cthread);
+	if (cthread->zstrm) {
+		deflateEnd(cthread->zstrm);
+		dealloc(cthread->zstrm);
+	}
+	bz_cache_release(&cthread->bz);
+	dealloc(cthread->lzo_wrkmem);
+	dealloc(cthread->lz4_state);
+	zpaq_free(cthread->zpaq);
+	cthread->zpaq = NULL;
+}
+
 bool close_streamout_threads(rzip_control *control)
 {
 	int i, close_thread = output_thread;
@@ -1031,6 +1792,8 @@ bool close_streamout_threads(rzip_control *control)
 		if (++close_thread == control->threads)
 			close_thread = 0;
 	}
+	for (i = 0; i < control->threads; i++)
+		cthread_release(&cthreads[i]);
 	dealloc(cthreads);
 	dealloc(control->pthreads);
 	return true;
@@ -1149,9 +1912,8 @@ void *open_stream_out(rzip_control *control, int f, unsigned int n, i64 chunk_li
 {
 	struct stream_info *sinfo;
 	unsigned int i, testbufs;
-	bool threadlimit = false, memlimit = false;
-	i64 testsize, limit;
-	uchar *testmalloc;
+	i64 testsize, limit, jobsize;
+	int fit;
 
 	sinfo = calloc(1, sizeof(struct stream_info));
 	if (unlikely(!sinfo))
@@ -1162,6 +1924,9 @@ void *open_stream_out(rzip_control *control, int f, unsigned int n, i64 chunk_li
 
 	sinfo->chunk_bytes = cbytes;
 	sinfo->chunk_filter = control->chunk_filter;
+	/* Taken now: compress threads write the header after rzip may have
+	 * moved on and set control->eof for a later chunk */
+	sinfo->eof = control->eof;
 	sinfo->num_streams = n;
 	sinfo->fd = f;
 
@@ -1171,75 +1936,40 @@ void *open_stream_out(rzip_control *control, int f, unsigned int n, i64 chunk_li
 		return NULL;
 	}
 
-	/* Find the largest we can make the window based on ability to malloc
-	 * ram. We need 2 buffers for each compression thread and the overhead
-	 * of each compression back end. No 2nd buf is required when there is
-	 * no back end compression. We limit the total regardless to 1/3 ram
-	 * for when the OS lies due to heavy overcommit. */
+	/* Find the largest we can make the window based on usable ram. We
+	 * need 2 buffers for each compression job and the overhead of the
+	 * compression back end. No 2nd buf is required when there is no back
+	 * end compression. Trial mallocs prove nothing under overcommit, so
+	 * this is pure arithmetic. */
 	if (NO_COMPRESS)
 		testbufs = 1;
 	else
 		testbufs = 2;
 
-	testsize = (limit * testbufs) + (control->overhead * control->threads);
+	fit = control->threads;
+	testsize = (limit * testbufs) + (control->overhead * fit);
 	if (testsize > control->usable_ram)
-		limit = (control->usable_ram - (control->overhead * control->threads)) / testbufs;
-
-	/* If we don't have enough ram for the number of threads, decrease the
-	 * number of threads till we do, or only have one thread. */
-	while (limit < STREAM_BUFSIZE && limit < chunk_limit) {
-		if (control->threads > 1) {
-			--control->threads;
-			threadlimit = true;
-		} else
-			break;
-		limit = (control->usable_ram - (control->overhead * control->threads)) / testbufs;
+		limit = (control->usable_ram - (control->overhead * fit)) / testbufs;
+
+	/* If not every thread's job fits, size the blocks for as many as do.
+	 * The thread count itself is left alone: how many jobs run at once is
+	 * decided per block by the memory admission in clear_buffer. */
+	while (limit < STREAM_BUFSIZE && limit < chunk_limit && fit > 1) {
+		--fit;
+		limit = (control->usable_ram - (control->overhead * fit)) / testbufs;
 		limit = MIN(limit, chunk_limit);
 	}
-	if (threadlimit) {
-		print_output("Minimising number of threads to %d to limit memory usage\n",
-			     control->threads);
-	}
 	/* Use a nominal minimum size should we fail all previous shrinking */
 	if (limit < STREAM_BUFSIZE) {
 		limit = MAX(limit, STREAM_BUFSIZE);
-		if (threadlimit || memlimit)
+		if (fit < control->threads)
 			print_output("Warning, low memory for chosen compression settings\n");
 	}
 	limit = MIN(limit, chunk_limit);
-retest_malloc:
-	testsize = limit + (control->overhead * control->threads);
-	testmalloc = malloc(testsize);
-	if (!testmalloc) {
-		memlimit = true;
-		limit = limit / 10 * 9;
-		if (limit < 100000000) {
-			/* If we can't even allocate 100MB then we'll never
-			 * succeed */
-			print_err("Unable to allocate enough memory for operation\n");
-			dealloc(sinfo->s);
-			dealloc(sinfo);
-			return NULL;
-		}
-		goto retest_malloc;
-	}
-	if (!NO_COMPRESS) {
-		char *testmalloc2 = malloc(limit);
-
-		if (!testmalloc2) {
-			dealloc(testmalloc);
-			limit = limit / 10 * 9;
-			goto retest_malloc;
-		}
-		dealloc(testmalloc2);
-	}
-	dealloc(testmalloc);
-	print_maxverbose("Succeeded in testing %"PRId64" sized malloc for back end compression\n", testsize);
 
 	/* Make the bufsize no smaller than STREAM_BUFSIZE. Round up the
-	 * bufsize to fit X threads into it */
-	sinfo->bufsize = MIN(limit, MAX((limit + control->threads - 1) / control->threads,
-					STREAM_BUFSIZE));
+	 * bufsize to fit X jobs into it */
+	sinfo->bufsize = MIN(limit, MAX((limit + fit - 1) / fit, STREAM_BUFSIZE));
 
 	if (control->threads > 1)
 		print_maxverbose("Using up to %d threads to compress up to %"PRId64" bytes each.\n",
@@ -1248,6 +1978,15 @@ retest_malloc:
 		print_maxverbose("Using only 1 thread to compress up to %"PRId64" bytes\n",
 			sinfo->bufsize);
 
+	jobsize = sinfo->bufsize * testbufs + control->overhead;
+	lock_mutex(control, &mem_lock);
+	mem_budget = control->usable_ram;
+	mem_tight = jobsize * control->threads > mem_budget;
+	unlock_mutex(control, &mem_lock);
+	if (mem_tight)
+		print_verbose("Memory allows about %d of %d compression threads to run at once\n",
+			      (int)MAX(mem_budget / jobsize, 1), control->threads);
+
 	for (i = 0; i < n; i++) {
 		sinfo->s[i].buf = calloc(sinfo->bufsize , 1);
 		if (unlikely(!sinfo->s[i].buf)) {
@@ -1313,8 +2052,10 @@ static bool decrypt_header(rzip_control *control, uchar *head, uchar *c_type,
 	}
 }
 
-/* prepare a set of n streams for reading on file descriptor f */
-void *open_stream_in(rzip_control *control, int f, int n, char chunk_bytes)
+/* Read the stream headers of a chunk on file descriptor f. The chunk's eof
+ * flag and size are kept in sinfo; open_stream_in hands them to control once
+ * runzip actually reaches the chunk. */
+static struct stream_info *open_sinfo(rzip_control *control, int f, int n, char chunk_bytes)
 {
 	struct uncomp_thread *ucthreads;
 	struct stream_info *sinfo;
@@ -1332,9 +2073,11 @@ void *open_stream_in(rzip_control *control, int f, int n, char chunk_bytes)
 		total_threads = control->threads + 2;
 	else
 		total_threads = control->threads + 1;
-	threads = control->pthreads = calloc(total_threads, sizeof(pthread_t));
-	if (unlikely(!threads))
+	sinfo->pthreads = threads = calloc(total_threads, sizeof(pthread_t));
+	if (unlikely(!threads)) {
+		dealloc(sinfo);
 		return NULL;
+	}
 
 	sinfo->ucthreads = ucthreads = calloc(total_threads, sizeof(struct uncomp_thread));
 	if (unlikely(!ucthreads)) {
@@ -1343,9 +2086,11 @@ void *open_stream_in(rzip_control *control, int f, int n, char chunk_bytes)
 		fatal_return(("Unable to calloc ucthreads in open_stream_in\n"), NULL);
 	}
 
+	sinfo->slots = total_threads;
 	sinfo->num_streams = n;
 	sinfo->fd = f;
 	sinfo->chunk_bytes = chunk_bytes;
+	sinfo->head_pos = get_readseek(control, f);
 
 	sinfo->s = calloc(n, sizeof(struct stream));
 	if (unlikely(!sinfo->s)) {
@@ -1355,18 +2100,15 @@ void *open_stream_in(rzip_control *control, int f, int n, char chunk_bytes)
 		return NULL;
 	}
 
-	sinfo->s[0].total_threads = 1;
-	sinfo->s[1].total_threads = total_threads - 1;
-
 	if (control->major_version == 0 && control->minor_version > 5) {
 		/* Read in flag that tells us if there are more chunks after
 		 * this. Ignored if we know the final file size */
 		print_maxverbose("Reading eof flag at %"PRId64"\n", get_readseek(control, f));
-		if (unlikely(read_u8(control, f, &control->eof))) {
+		if (unlikely(read_u8(control, f, &sinfo->eof))) {
 			print_err("Failed to read eof flag in open_stream_in\n");
 			goto failed;
 		}
-		print_maxverbose("EOF: %d\n", control->eof);
+		print_maxverbose("EOF: %d\n", sinfo->eof);
 
 		/* Read in the expected chunk size */
 		if (!ENCRYPT) {
@@ -1377,7 +2119,6 @@ void *open_stream_in(rzip_control *control, int f, int n, char chunk_bytes)
 			}
 			sinfo->size = le64toh(sinfo->size);
 			print_maxverbose("Chunk size: %"PRId64"\n", sinfo->size);
-			control->st_size += sinfo->size;
 			if (unlikely(sinfo->chunk_bytes < 1 || sinfo->chunk_bytes > 8 || sinfo->size < 0)) {
 				print_err("Invalid chunk data size %"PRId64" bytes %d\n", sinfo->size, sinfo->chunk_bytes);
 				goto failed;
@@ -1388,12 +2129,6 @@ void *open_stream_in(rzip_control *control, int f, int n, char chunk_bytes)
 	if (unlikely(sinfo->initial_pos == -1))
 		goto failed;
 
-	/* Frame end from LRZC c_size for this RCD (set by runzip_fd). */
-	if (control->block_c_size > 0 && control->rcd_start >= 0)
-		sinfo->payload_end = control->rcd_start + control->block_c_size;
-	else
-		sinfo->payload_end = 0;
-
 	/* Only trust fstat on regular files. TMP_INBUF / pipes do not have a
 	 * reliable final size yet; last_head is still bounded by payload_end. */
 	if (!TMP_INBUF) {
@@ -1408,9 +2143,8 @@ void *open_stream_in(rzip_control *control, int f, int n, char chunk_bytes)
 		uchar c, enc_head[LRZ_AEAD_NONCE_LEN + 25 + LRZ_AEAD_TAG_LEN];
 		i64 v1, v2;
 
-		sinfo->s[i].base_thread = i;
-		sinfo->s[i].uthread_no = sinfo->s[i].base_thread;
-		sinfo->s[i].unext_thread = sinfo->s[i].base_thread;
+		sinfo->s[i].qhead = sinfo->s[i].qtail = -1;
+		sinfo->s[i].live = -1;
 
 		if (ENCRYPT) {
 			i64 hlen = lrz_enc_header_disk_len(control);
@@ -1490,7 +2224,7 @@ again:
 		}
 	}
 
-	return (void *)sinfo;
+	return sinfo;
 
 failed:
 	dealloc(sinfo->s);
@@ -1500,19 +2234,226 @@ failed:
 	return NULL;
 }
 
-#define MIN_SIZE (ENCRYPT_AEAD ? 0 : (ENCRYPT ? CBC_LEN : 0))
-
-/* Once the final data has all been written to the block header, we go back
- * and write salt/nonce before it, and encrypt the header in place.
- * ofs is the start of the 25-byte clear header relative to initial_pos. */
-static bool rewrite_encrypted(rzip_control *control, struct stream_info *sinfo, i64 ofs)
+/* Add to an runzip list to safely deallocate memory after all threads have
+ * returned. */
+static void add_to_rulist(rzip_control *control, struct stream_info *sinfo)
 {
-	uchar *buf, *head;
-	i64 cur_ofs, prefix;
-
-	cur_ofs = get_seek(control, sinfo->fd) - sinfo->initial_pos;
-	if (unlikely(cur_ofs == -1))
-		return false;
+	struct runzip_node *node = calloc(1, sizeof(struct runzip_node));
+
+	if (unlikely(!node))
+		failure("Failed to calloc struct node in add_rulist\n");
+	node->sinfo = sinfo;
+	node->pthreads = sinfo->pthreads;
+
+	lock_mutex(control, &control->control_lock);
+	node->prev = control->ruhead;
+	control->ruhead = node;
+	unlock_mutex(control, &control->control_lock);
+}
+
+/* Free what a joined slot still holds: its block, and after a failure
+ * the output it was decoding into as well */
+static void ucomp_free_bufs(struct uncomp_thread *uci)
+{
+	if (uci->dec_buf != uci->s_buf)
+		dealloc(uci->dec_buf);
+	uci->dec_buf = NULL;
+	dealloc(uci->s_buf);
+}
+
+/* Wait for the blocks a look-ahead chunk has in flight and let it go */
+static void drop_ahead(rzip_control *control)
+{
+	struct stream_info *sinfo = ahead_sinfo;
+	int i;
+
+	ahead_sinfo = NULL;
+	/* Primed blocks would otherwise wait for blocks never taken */
+	lock_mutex(control, &ready_lock);
+	for (i = 0; i < sinfo->num_streams; i++)
+		sinfo->s[i].taken = INT_MAX;
+	cond_broadcast(control, &ready_cond);
+	unlock_mutex(control, &ready_lock);
+	for (i = 0; i < sinfo->slots; i++) {
+		struct uncomp_thread *uci = &sinfo->ucthreads[i];
+
+		if (!uci->busy)
+			continue;
+		lock_mutex(control, &output_lock);
+		sinfo->next_thread = i;
+		cond_broadcast(control, &output_cond);
+		unlock_mutex(control, &output_lock);
+		join_pthread(control, sinfo->pthreads[i], NULL);
+		uci->busy = 0;
+		ucomp_free_bufs(uci);
+		lock_mutex(control, &in_lock);
+		ucomp_ram -= uci->m_alloced;
+		ucomp_queued--;
+		unlock_mutex(control, &in_lock);
+		uci->m_alloced = 0;
+	}
+	for (i = 0; i < sinfo->slots; i++)
+		ucthread_release(&sinfo->ucthreads[i]);
+	add_to_rulist(control, sinfo);
+}
+
+/* Read the chunk byte width and prefilter that precede a chunk's stream
+ * headers (0.6+ archives), then open its streams */
+static struct stream_info *open_chunk(rzip_control *control, int f, int n)
+{
+	uchar chunk_bytes, chunk_filter = LRZ_FILTER_NONE;
+	struct stream_info *sinfo;
+
+	if (unlikely(read_u8(control, f, &chunk_bytes) ||
+		     chunk_bytes < 1 || chunk_bytes > 8))
+		return NULL;
+	if (control->major_version > 0 || control->minor_version > 6) {
+		if (unlikely(read_u8(control, f, &chunk_filter) ||
+			     chunk_filter > LRZ_CHUNK_FILTER_MAX))
+			return NULL;
+	}
+	sinfo = open_sinfo(control, f, n, chunk_bytes);
+	if (sinfo)
+		sinfo->chunk_filter = chunk_filter;
+	return sinfo;
+}
+
+/* Hand a chunk's eof flag, size and LRZC frame end over once runzip
+ * reaches it */
+static void *use_sinfo(rzip_control *control, struct stream_info *sinfo)
+{
+	if (control->major_version > 0 || control->minor_version > 5)
+		control->eof = sinfo->eof;
+	control->st_size += sinfo->size;
+
+	/* Frame end from LRZC c_size for this RCD (set by runzip_fd). */
+	if (control->block_c_size > 0 && control->rcd_start >= 0)
+		sinfo->payload_end = control->rcd_start + control->block_c_size;
+	else
+		sinfo->payload_end = 0;
+
+	return (void *)sinfo;
+}
+
+/* prepare a set of n streams for reading on file descriptor f */
+void *open_stream_in(rzip_control *control, int f, int n, char chunk_bytes)
+{
+	struct stream_info *sinfo = NULL;
+
+	/* The look-ahead may already have opened this chunk and started
+	 * decompressing its first blocks */
+	if (ahead_sinfo) {
+		if (ahead_sinfo->fd == f && ahead_sinfo->num_streams == n &&
+		    ahead_sinfo->chunk_bytes == chunk_bytes &&
+		    ahead_sinfo->head_pos == get_readseek(control, f)) {
+			sinfo = ahead_sinfo;
+			ahead_sinfo = NULL;
+			print_maxverbose("Chunk at %"PRId64" already opened by look-ahead\n",
+					 sinfo->head_pos);
+		} else
+			drop_ahead(control);
+	}
+	if (!sinfo)
+		sinfo = open_sinfo(control, f, n, chunk_bytes);
+	if (unlikely(!sinfo))
+		return NULL;
+	return use_sinfo(control, sinfo);
+}
+
+/* Follow every stream's chain of block headers without reading payloads to
+ * find where the chunk ends and the next one begins. Only plain archives
+ * can be walked; their headers are not encrypted. */
+static i64 chunk_end(rzip_control *control, struct stream_info *sinfo)
+{
+	int read_len = sinfo->chunk_bytes, i;
+	i64 total = sinfo->total_read;
+
+	for (i = 0; i < sinfo->num_streams; i++) {
+		i64 head = sinfo->s[i].last_head;
+
+		while (head) {
+			i64 c_len, u_len, last_head;
+			uchar c_type;
+
+			if (unlikely(read_seekto(control, sinfo, head) ||
+				     read_u8(control, sinfo->fd, &c_type) ||
+				     read_val(control, sinfo->fd, &c_len, read_len) ||
+				     read_val(control, sinfo->fd, &u_len, read_len) ||
+				     read_val(control, sinfo->fd, &last_head, read_len)))
+				return -1;
+			c_len = le64toh(c_len);
+			last_head = le64toh(last_head);
+			if (unlikely(c_len < 0 || (last_head && last_head <= head)))
+				fatal_return(("Invalid block header at %"PRId64" walking chunk\n",
+					     sinfo->initial_pos + head), -1);
+			total += 1 + read_len * 3 + c_len;
+			head = last_head;
+		}
+	}
+	return sinfo->initial_pos + total;
+}
+
+/* Open the chunk whose header starts at pos on f so it can be
+ * reconstructed alongside others, and return where the next chunk starts
+ * in next_pos. Callers reading several chunks at once must all go through
+ * here and the stream functions, which serialise access to f. */
+void *open_stream_at(rzip_control *control, int f, int n, i64 pos, i64 *next_pos)
+{
+	struct stream_info *sinfo = NULL;
+
+	lock_mutex(control, &in_lock);
+	if (likely(lseek(f, pos, SEEK_SET) == pos))
+		sinfo = open_chunk(control, f, n);
+	if (likely(sinfo)) {
+		/* Each chunk is on its own, nothing to look ahead to */
+		sinfo->looked_ahead = true;
+		*next_pos = chunk_end(control, sinfo);
+		if (unlikely(*next_pos == -1)) {
+			unlock_mutex(control, &in_lock);
+			add_to_rulist(control, sinfo);
+			return NULL;
+		}
+	}
+	unlock_mutex(control, &in_lock);
+	if (unlikely(!sinfo))
+		return NULL;
+	return use_sinfo(control, sinfo);
+}
+
+/* Find the size and eof flag of the chunk whose header starts at pos on f,
+ * and where the next one starts, without decompressing any of it */
+bool skip_chunk(rzip_control *control, int f, int n, i64 pos, i64 *size,
+		uchar *eof, i64 *next_pos)
+{
+	struct stream_info *sinfo = NULL;
+
+	lock_mutex(control, &in_lock);
+	if (likely(lseek(f, pos, SEEK_SET) == pos))
+		sinfo = open_chunk(control, f, n);
+	if (likely(sinfo))
+		*next_pos = chunk_end(control, sinfo);
+	unlock_mutex(control, &in_lock);
+	if (unlikely(!sinfo))
+		return false;
+	*size = sinfo->size;
+	*eof = sinfo->eof;
+	add_to_rulist(control, sinfo);
+	return *next_pos != -1;
+}
+
+#define MIN_SIZE (ENCRYPT_AEAD ? 0 : (ENCRYPT ? CBC_LEN : 0))
+
+/* Once the final data has all been written to the block header, we go back
+ * and write salt/nonce before it, and encrypt the header in place.
+ * ofs is the start of the 25-byte clear header relative to initial_pos. */
+static bool rewrite_encrypted(rzip_control *control, struct stream_info *sinfo, i64 ofs)
+{
+	uchar *buf, *head;
+	i64 cur_ofs, prefix;
+
+	cur_ofs = get_seek(control, sinfo->fd) - sinfo->initial_pos;
+	if (unlikely(cur_ofs == -1))
+		return false;
 
 	if (ENCRYPT_AEAD) {
 		uchar clear[25], sealed[LRZ_AEAD_NONCE_LEN + 25 + LRZ_AEAD_TAG_LEN];
@@ -1565,6 +2506,66 @@ error:
 	return false;
 }
 
+/* With -c every block is decoded again as soon as it is compressed, by the
+ * thread that compressed it, and must give back data of the CRC32 the
+ * original data had. */
+static bool verify_block(rzip_control *control, struct compress_thread *cti, long i, u32 crc)
+{
+	struct uncomp_thread v = { .c_type = cti->c_type, .c_len = cti->c_len, .u_len = cti->s_len };
+	struct stream ps = { .prime = cti->prime, .prime_len = cti->prime_len };
+	int ret = -1;
+
+	v.s_buf = malloc(cti->c_len);
+	if (unlikely(!v.s_buf)) {
+		print_err("Failed to allocate %"PRId64" bytes to verify a block\n", cti->c_len);
+		return false;
+	}
+	memcpy(v.s_buf, cti->s_buf, cti->c_len);
+	switch (v.c_type) {
+		case CTYPE_LZMA:
+		case CTYPE_LZMA_PRIMED:
+			ret = lzma_decompress_buf(control, &v, &ps, cti->lzma_props, false);
+			break;
+		case CTYPE_LZMA_BCJ:
+		case CTYPE_LZMA_BCJ_ARM64:
+		case CTYPE_LZMA_DELTA1:
+		case CTYPE_LZMA_DELTA2:
+		case CTYPE_LZMA_DELTA3:
+		case CTYPE_LZMA_DELTA4:
+			ret = lzma_decompress_buf(control, &v, NULL, cti->lzma_props, false);
+			if (!ret)
+				lrz_filter_convert_mem(v.s_buf, v.u_len,
+						       ctype_filter_kind(v.c_type), false);
+			break;
+		case CTYPE_LZO:
+			ret = lzo_decompress_buf(control, &v);
+			break;
+		case CTYPE_LZ4:
+			ret = lz4_decompress_buf(control, &v);
+			break;
+		case CTYPE_BZIP2:
+			ret = bzip2_decompress_buf(control, &v);
+			break;
+		case CTYPE_GZIP:
+			ret = gzip_decompress_buf(control, &v);
+			break;
+		case CTYPE_ZPAQ:
+			ret = zpaq_decompress_buf(control, &v, i);
+			break;
+	}
+	if (!ret && CrcCalc(v.s_buf + v.skip, (size_t)v.u_len) != crc)
+		ret = -1;
+	dealloc(v.s_buf);
+	ucthread_release(&v);
+	if (unlikely(ret)) {
+		print_err("Block of %"PRId64" bytes in stream %d did not decompress back to its data\n",
+			  cti->s_len, cti->streamno);
+		return false;
+	}
+	print_maxverbose("Verified %"PRId64" byte block of stream %d\n", cti->s_len, cti->streamno);
+	return true;
+}
+
 /* Enter with s_buf allocated; s_buf points to the data (possibly compressed)
  * and is freed here. Output to the archive is strictly ordered by
  * output_thread so last_head links stay consistent. Every exit path must
@@ -1580,6 +2581,7 @@ static void *compthread(void *data)
 	const char *fatal_msg = NULL;
 	i64 padded_len;
 	int write_len;
+	u32 crc = 0;
 
 	dealloc(data);
 	cti = &cthreads[i];
@@ -1591,6 +2593,8 @@ static void *compthread(void *data)
 	}
 	cti->c_type = CTYPE_NONE;
 	cti->c_len = cti->s_len;
+	if (BLOCK_CRC || CHECK_FILE)
+		crc = CrcCalc(cti->s_buf, (size_t)cti->s_len);
 
 	/* Cludge for STDOUT: default lc/lp/pb byte to 93 if magic must be
 	 * written before any LZMA job has published real properties. Guard
@@ -1607,10 +2611,14 @@ retry:
 	 * being 31 bytes so don't bother trying to compress anything less
 	 * than 64 bytes. */
 	if (!NO_COMPRESS && cti->c_len >= 64) {
-		if (LZMA_COMPRESS)
+		if (control->auto_policy)
+			ret = auto_compress_buf(control, cti);
+		else if (LZMA_COMPRESS)
 			ret = lzma_compress_buf(control, cti);
 		else if (LZO_COMPRESS)
 			ret = lzo_compress_buf(control, cti);
+		else if (LZ4_COMPRESS)
+			ret = lz4_compress_buf(control, cti);
 		else if (BZIP2_COMPRESS)
 			ret = bzip2_compress_buf(control, cti);
 		else if (ZLIB_COMPRESS)
@@ -1623,6 +2631,29 @@ retry:
 		}
 	}
 
+	if (!ret && CHECK_FILE && cti->c_type != CTYPE_NONE &&
+	    unlikely(!verify_block(control, cti, i, crc))) {
+		fatal_msg = "Failed to verify block in compthread\n";
+		goto out;
+	}
+
+	/* With --block-crc the block ends with the CRC32 of its uncompressed
+	 * data, for the thread decompressing it to check. Empty blocks stay
+	 * empty so that readers still skip them. */
+	if (!ret && BLOCK_CRC && cti->s_len) {
+		uchar *buf = realloc(cti->s_buf, cti->c_len + 4);
+
+		if (unlikely(!buf)) {
+			fatal_msg = "Failed to realloc s_buf for block CRC in compthread\n";
+			goto out;
+		}
+		cti->s_buf = buf;
+		crc = htole32(crc);
+		memcpy(buf + cti->c_len, &crc, 4);
+		cti->c_len += 4;
+		cti->c_type |= CTYPE_CRC;
+	}
+
 	padded_len = cti->c_len;
 	if (!ret && padded_len < MIN_SIZE) {
 		/* We need to pad out each block to at least be CBC_LEN bytes
@@ -1638,6 +2669,26 @@ retry:
 			goto out;
 	}
 
+	/* Encrypt in place while still running alongside the other workers;
+	 * only writing the result out has to wait for our turn. */
+	if (!ret && ENCRYPT_AEAD) {
+		uchar aad[8];
+		size_t aad_len = 0;
+
+		aead_fill_aad(control, 0x02, aad, &aad_len);
+		if (unlikely(!lrz_aead_seal_inplace(control, LRZ_AEAD_KEY_DATA, aad, aad_len,
+						    cti->s_buf, (size_t)padded_len,
+						    cti->nonce, cti->tag))) {
+			fatal_msg = "Failed to AEAD-seal payload in compthread\n";
+			goto out;
+		}
+	} else if (!ret && ENCRYPT) {
+		if (unlikely(!get_rand(control, cti->salt, SALT_LEN)))
+			goto out;
+		if (unlikely(!lrz_encrypt(control, cti->s_buf, padded_len, cti->salt)))
+			goto out;
+	}
+
 	/* If compression fails for whatever reason multithreaded, then wait
 	 * for the previous thread to finish, serialising the work to decrease
 	 * the memory requirements, increasing the chance of success */
@@ -1676,7 +2727,7 @@ retry:
 			/* Continuation streaming block: LRZC before RCD */
 			if (control->blocks_done > 0) {
 				if (unlikely(!write_lrzc_header(control, ctis->fd,
-						ctis->size, control->eof))) {
+						ctis->size, ctis->eof))) {
 					unlock_mutex(control, &control->control_lock);
 					goto out;
 				}
@@ -1695,8 +2746,8 @@ retry:
 
 		/* Write whether this is the last chunk, followed by the size
 		 * of this chunk. In streaming mode this matches block-last. */
-		print_maxverbose("Writing EOF flag as %d\n", control->eof);
-		write_u8(control, control->eof);
+		print_maxverbose("Writing EOF flag as %d\n", ctis->eof);
+		write_u8(control, ctis->eof);
 		if (!ENCRYPT)
 			write_val(control, ctis->size, ctis->chunk_bytes);
 
@@ -1795,38 +2846,20 @@ retry:
 	}
 
 	if (ENCRYPT_AEAD) {
-		size_t slen = LRZ_AEAD_NONCE_LEN + (size_t)padded_len + LRZ_AEAD_TAG_LEN;
-		uchar *sealed, aad[8];
-		size_t aad_len = 0;
+		print_maxverbose("Compthread %ld writing data at %"PRId64"\n", i, ctis->cur_pos);
 
-		sealed = malloc(slen);
-		if (unlikely(!sealed)) {
-			fatal_msg = "Failed to malloc AEAD payload buffer in compthread\n";
-			goto out;
-		}
-		aead_fill_aad(control, 0x02, aad, &aad_len);
-		if (unlikely(!lrz_aead_seal(control, LRZ_AEAD_KEY_DATA, aad, aad_len,
-					    cti->s_buf, (size_t)padded_len, sealed, &slen))) {
-			dealloc(sealed);
-			fatal_msg = "Failed to AEAD-seal payload in compthread\n";
-			goto out;
-		}
-		if (unlikely(write_buf(control, sealed, (i64)slen))) {
-			dealloc(sealed);
+		if (unlikely(write_buf(control, cti->nonce, LRZ_AEAD_NONCE_LEN) ||
+			     write_buf(control, cti->s_buf, padded_len) ||
+			     write_buf(control, cti->tag, LRZ_AEAD_TAG_LEN))) {
 			fatal_msg = "Failed to write AEAD payload in compthread\n";
 			goto out;
 		}
-		ctis->cur_pos += (i64)slen;
-		dealloc(sealed);
+		ctis->cur_pos += LRZ_AEAD_NONCE_LEN + padded_len + LRZ_AEAD_TAG_LEN;
 	} else if (ENCRYPT) {
-		if (unlikely(!get_rand(control, cti->salt, SALT_LEN)))
-			goto out;
 		if (unlikely(write_buf(control, cti->salt, SALT_LEN))) {
 			fatal_msg = "Failed to write block salt in compthread\n";
 			goto out;
 		}
-		if (unlikely(!lrz_encrypt(control, cti->s_buf, padded_len, cti->salt)))
-			goto out;
 		ctis->cur_pos += SALT_LEN;
 
 		print_maxverbose("Compthread %ld writing data at %"PRId64"\n", i, ctis->cur_pos);
@@ -1875,6 +2908,12 @@ out:
 
 	if (cti->s_buf)
 		dealloc(cti->s_buf);
+	dealloc(cti->prime);
+
+	if (mem_tight)
+		cthread_release(cti);
+	mem_release(control, cti->mem_held);
+	cti->mem_held = 0;
 
 	cksem_post(control, &cti->cksem);
 
@@ -1889,6 +2928,7 @@ out:
 static void clear_buffer(rzip_control *control, struct stream_info *sinfo, int streamno, int newbuf)
 {
 	pthread_t *threads = control->pthreads;
+	struct stream *ss = &sinfo->s[streamno];
 	stream_thread_struct *s;
 	static int i = 0;
 
@@ -1897,8 +2937,33 @@ static void clear_buffer(rzip_control *control, struct stream_info *sinfo, int s
 
 	cthreads[i].sinfo = sinfo;
 	cthreads[i].streamno = streamno;
-	cthreads[i].s_buf = sinfo->s[streamno].buf;
-	cthreads[i].s_len = sinfo->s[streamno].buflen;
+	cthreads[i].s_buf = ss->buf;
+	cthreads[i].s_len = ss->buflen;
+	cthreads[i].prime = ss->prime;
+	cthreads[i].prime_len = ss->prime_len;
+	ss->prime = NULL;
+	ss->prime_len = 0;
+
+	/* Keep the tail of this block to prime the next one with before the
+	 * thread can filter it in place */
+	if (PRIME && newbuf && ss->buflen >= 4) {
+		ss->prime_len = prime_size(control, ss->buflen);
+		ss->prime = malloc(ss->prime_len);
+		if (unlikely(!ss->prime))
+			failure("Unable to malloc prime of size %"PRId64" in clear_buffer\n", ss->prime_len);
+		memcpy(ss->prime, ss->buf + ss->buflen - ss->prime_len, ss->prime_len);
+	}
+
+	/* Wait for room for its output buffer and backend overhead, and for
+	 * a primed block its prime laid out in front of a copy of it. -c
+	 * decodes a copy of the compressed block, no larger than s_len, into
+	 * a buffer of its own after any prime. */
+	cthreads[i].mem_held = cthreads[i].s_len * (NO_COMPRESS ? 1 : 2) + control->overhead;
+	if (cthreads[i].prime)
+		cthreads[i].mem_held += cthreads[i].prime_len * 2 + cthreads[i].s_len;
+	if (CHECK_FILE && !NO_COMPRESS)
+		cthreads[i].mem_held += cthreads[i].s_len * 2 + cthreads[i].prime_len;
+	mem_reserve(control, cthreads[i].mem_held);
 
 	print_maxverbose("Starting thread %d to compress %"PRId64" bytes from stream %d\n",
 			 i, cthreads[i].s_len, streamno);
@@ -1933,12 +2998,60 @@ void flush_buffer(rzip_control *control, struct stream_info *sinfo, int streamno
 	clear_buffer(control, sinfo, streamno, 1);
 }
 
+/* A primed block needs the tail of the block before it, which is kept
+ * once that block is taken. Returns false if the stream is closed first. */
+static bool wait_prime(rzip_control *control, struct stream_info *sinfo,
+		       struct uncomp_thread *uci)
+{
+	struct stream *s = &sinfo->s[uci->streamno];
+	bool ret;
+
+	lock_mutex(control, &ready_lock);
+	while (s->taken < uci->seq)
+		cond_wait(control, &ready_cond, &ready_lock);
+	ret = s->taken == uci->seq;
+	unlock_mutex(control, &ready_lock);
+	return ret;
+}
+
+/* Check a block written with --block-crc as soon as it is decoded, naming
+ * it as -i does */
+static bool check_block_crc(rzip_control *control, struct uncomp_thread *uci)
+{
+	u32 crc = CrcCalc(uci->s_buf + uci->skip, (size_t)uci->u_len);
+
+	if (unlikely(crc != uci->crc))
+		failure_return(("Block %d of stream %d at offset %"PRId64" failed its CRC32 check: 0x%08x, expected 0x%08x\n",
+				uci->seq + 1, uci->streamno, uci->head_ofs, crc, uci->crc), false);
+	return true;
+}
+
+/* Authenticate and decrypt a block read by start_block in place. */
+static bool open_block(rzip_control *control, struct uncomp_thread *uci)
+{
+	i64 padded_len = MAX(uci->c_len, MIN_SIZE);
+
+	if (ENCRYPT_AEAD) {
+		uchar aad[8];
+		size_t aad_len = 0;
+
+		aead_fill_aad(control, 0x02, aad, &aad_len);
+		if (unlikely(!lrz_aead_open_inplace(control, LRZ_AEAD_KEY_DATA, aad, aad_len,
+						    uci->s_buf, (size_t)padded_len,
+						    uci->nonce, uci->tag)))
+			failure_return(("Payload AEAD check failed (corrupt or wrong password)\n"), false);
+		return true;
+	}
+	return lrz_decrypt(control, uci->s_buf, padded_len, uci->salt);
+}
+
 static void *ucompthread(void *data)
 {
 	stream_thread_struct *sts = data;
 	rzip_control *control = sts->control;
+	struct stream_info *sinfo = sts->sinfo;
 	int waited = 0, ret = 0, i = sts->i;
-	struct uncomp_thread *uci = &sts->sinfo->ucthreads[i];
+	struct uncomp_thread *uci = &sinfo->ucthreads[i];
 
 	dealloc(data);
 
@@ -1947,11 +3060,33 @@ static void *ucompthread(void *data)
 		setpriority(PRIO_PROCESS, 0, (control->nice_val=control->current_priority));
 	}
 
+	if (uci->sealed) {
+		if (unlikely(!open_block(control, uci))) {
+			publish_ready(control, uci, 0, true);
+			return (void *)1;
+		}
+		uci->sealed = false;
+	}
+	if (uci->has_crc) {
+		uci->c_len -= 4;
+		memcpy(&uci->crc, uci->s_buf + uci->c_len, 4);
+		uci->crc = le32toh(uci->crc);
+	}
+
 retry:
 	if (uci->c_type != CTYPE_NONE) {
 		switch (uci->c_type) {
 			case CTYPE_LZMA:
-				ret = lzma_decompress_buf(control, uci);
+				ret = lzma_decompress_buf(control, uci, NULL, control->lzma_properties, true);
+				break;
+			case CTYPE_LZMA_PRIMED:
+				if (unlikely(!wait_prime(control, sinfo, uci))) {
+					/* The stream was closed, nobody will take this */
+					publish_ready(control, uci, 0, true);
+					return (void *)1;
+				}
+				ret = lzma_decompress_buf(control, uci, &sinfo->s[uci->streamno],
+							  control->lzma_properties, true);
 				break;
 			case CTYPE_LZMA_BCJ:
 			case CTYPE_LZMA_BCJ_ARM64:
@@ -1959,7 +3094,7 @@ retry:
 			case CTYPE_LZMA_DELTA2:
 			case CTYPE_LZMA_DELTA3:
 			case CTYPE_LZMA_DELTA4:
-				ret = lzma_decompress_buf(control, uci);
+				ret = lzma_decompress_buf(control, uci, NULL, control->lzma_properties, false);
 				if (!ret)
 					lrz_filter_convert_mem(uci->s_buf, uci->u_len,
 							       ctype_filter_kind(uci->c_type), false);
@@ -1967,6 +3102,9 @@ retry:
 			case CTYPE_LZO:
 				ret = lzo_decompress_buf(control, uci);
 				break;
+			case CTYPE_LZ4:
+				ret = lz4_decompress_buf(control, uci);
+				break;
 			case CTYPE_BZIP2:
 				ret = bzip2_decompress_buf(control, uci);
 				break;
@@ -1977,6 +3115,7 @@ retry:
 				ret = zpaq_decompress_buf(control, uci, i);
 				break;
 			default:
+				publish_ready(control, uci, 0, true);
 				failure_return(("Dunno wtf decompression type to use!\n"), NULL);
 				break;
 		}
@@ -1985,55 +3124,49 @@ retry:
 	/* As per compression, serialise the decompression if it fails in
 	 * parallel */
 	if (unlikely(ret)) {
-		if (unlikely(waited))
+		if (unlikely(waited)) {
+			publish_ready(control, uci, uci->ready, true);
 			failure_return(("Failed to decompress in ucompthread\n"), (void*)1);
+		}
 		print_maxverbose("Unable to decompress in parallel, waiting for previous thread to complete before trying again\n");
 		/* We do not strictly need to wait for this, so it's used when
 		 * decompression fails due to inadequate memory to try again
 		 * serialised. */
 		lock_mutex(control, &output_lock);
-		while (output_thread != i)
+		while (sinfo->next_thread != i)
 			cond_wait(control, &output_cond, &output_lock);
 		unlock_mutex(control, &output_lock);
 		waited = 1;
 		goto retry;
 	}
 
+	if (uci->has_crc && unlikely(!check_block_crc(control, uci))) {
+		publish_ready(control, uci, 0, true);
+		return (void *)1;
+	}
+
 	print_maxverbose("Thread %d decompressed %"PRId64" bytes from stream %d\n", i, uci->u_len, uci->streamno);
+	publish_ready(control, uci, uci->u_len, true);
 
 	return NULL;
 }
 
-/* fill a buffer from a stream - return -1 on failure */
-static int fill_buffer(rzip_control *control, struct stream_info *sinfo, struct stream *s, int streamno)
+/* Read the next block header of a stream and start decompressing the block
+ * in slot, queueing the slot behind the stream's earlier blocks. Returns -1
+ * on failure. */
+static int start_block(rzip_control *control, struct stream_info *sinfo, int streamno, int slot)
 {
 	i64 u_len, c_len, last_head, padded_len, header_length = 0, max_len;
 	uchar enc_head[LRZ_AEAD_NONCE_LEN + 25 + LRZ_AEAD_TAG_LEN], blocksalt[SALT_LEN];
-	struct uncomp_thread *ucthreads = sinfo->ucthreads;
-	pthread_t *threads = control->pthreads;
+	struct uncomp_thread *uci = &sinfo->ucthreads[slot];
+	struct stream *s = &sinfo->s[streamno];
 	stream_thread_struct *sts;
 	uchar c_type, *s_buf;
-	void *thr_return;
+	bool has_crc;
 
-	dealloc(s->buf);
-	s->buf = NULL;
-	s->buflen = 0;
-	s->bufp = 0;
-	/*
-	 * eos means no further compressed blocks will be started, but
-	 * prefetched ucomp threads may still hold decompressed data.
-	 * Drain those while busy; only then return empty. Returning empty
-	 * as soon as eos is set drops the rest of the stream (literals
-	 * short-read and match offsets go past the truncated output).
-	 */
-	if (s->eos) {
-		if (!ucthreads[s->unext_thread].busy)
-			return 0;
-		goto out;
-	}
-fill_another:
-	if (unlikely(ucthreads[s->uthread_no].busy))
+	if (unlikely(uci->busy))
 		failure_return(("Trying to start a busy thread, this shouldn't happen!\n"), -1);
+	uci->head_ofs = sinfo->initial_pos + s->last_head;
 
 	if (unlikely(read_seekto(control, sinfo, s->last_head)))
 		return -1;
@@ -2093,6 +3226,9 @@ fill_another:
 	c_len = le64toh(c_len);
 	u_len = le64toh(u_len);
 	last_head = le64toh(last_head);
+	/* Blocks written with --block-crc end with the CRC32 of their data */
+	has_crc = c_type & CTYPE_CRC;
+	c_type &= ~CTYPE_CRC;
 	print_maxverbose("Fill_buffer stream %d c_len %"PRId64" u_len %"PRId64" last_head %"PRId64"\n", streamno, c_len, u_len, last_head);
 
 	/* It is possible for there to be an empty match block at the end of
@@ -2156,10 +3292,13 @@ fill_another:
 	if (unlikely(c_type != CTYPE_NONE && c_type != CTYPE_BZIP2 &&
 		     c_type != CTYPE_LZO && c_type != CTYPE_LZMA &&
 		     c_type != CTYPE_GZIP && c_type != CTYPE_ZPAQ &&
+		     c_type != CTYPE_LZ4 && c_type != CTYPE_LZMA_PRIMED &&
 		     !(c_type >= CTYPE_LZMA_BCJ && c_type <= CTYPE_LZMA_DELTA4))) {
 		fatal_return(("Invalid compression type %d in stream block\n", c_type), -1);
 	}
-	if (unlikely(c_type == CTYPE_NONE && c_len != u_len)) {
+	if (unlikely(has_crc && c_len <= 4))
+		fatal_return(("Block of %"PRId64" bytes is too short for its CRC\n", c_len), -1);
+	if (unlikely(c_type == CTYPE_NONE && c_len - (has_crc ? 4 : 0) != u_len)) {
 		fatal_return(("Stored block c_len %"PRId64" != u_len %"PRId64"\n",
 			     c_len, u_len), -1);
 	}
@@ -2203,122 +3342,272 @@ fill_another:
 	if (unlikely(!s_buf))
 		fatal_return(("Unable to malloc buffer of size %"PRId64" in fill_buffer\n", max_len), -1);
 	/* Count full allocation toward prefetch budget (not just u_len). */
-	sinfo->ram_alloced += max_len;
+	ucomp_ram += max_len;
 
-	if (ENCRYPT_AEAD) {
-		size_t slen = LRZ_AEAD_NONCE_LEN + (size_t)padded_len + LRZ_AEAD_TAG_LEN;
-		size_t pt_len = (size_t)max_len;
-		uchar *sealed, aad[8];
-		size_t aad_len = 0;
-
-		sealed = malloc(slen);
-		if (unlikely(!sealed)) {
-			dealloc(s_buf);
-			sinfo->ram_alloced -= max_len;
-			fatal_return(("Unable to malloc AEAD ciphertext in fill_buffer\n"), -1);
-		}
-		if (unlikely(read_buf(control, sinfo->fd, sealed, (i64)slen))) {
-			dealloc(sealed);
-			dealloc(s_buf);
-			sinfo->ram_alloced -= max_len;
-			return -1;
-		}
-		sinfo->total_read += (i64)slen;
-		aead_fill_aad(control, 0x02, aad, &aad_len);
-		if (unlikely(!lrz_aead_open(control, LRZ_AEAD_KEY_DATA, aad, aad_len,
-					    sealed, slen, s_buf, &pt_len))) {
-			dealloc(sealed);
-			dealloc(s_buf);
-			sinfo->ram_alloced -= max_len;
-			failure_return(("Payload AEAD check failed (corrupt or wrong password)\n"), -1);
-		}
-		dealloc(sealed);
-	} else {
-		if (unlikely(read_buf(control, sinfo->fd, s_buf, padded_len))) {
-			dealloc(s_buf);
-			sinfo->ram_alloced -= max_len;
-			return -1;
-		}
-		sinfo->total_read += padded_len;
-
-		if (unlikely(ENCRYPT && !lrz_decrypt(control, s_buf, padded_len, blocksalt))) {
-			dealloc(s_buf);
-			sinfo->ram_alloced -= max_len;
-			return -1;
-		}
+	/* Only read the block here; its thread authenticates and decrypts it
+	 * in place, so encrypted blocks decode as parallel as plain ones. */
+	if (ENCRYPT_AEAD && unlikely(read_buf(control, sinfo->fd, uci->nonce, LRZ_AEAD_NONCE_LEN))) {
+		dealloc(s_buf);
+		ucomp_ram -= max_len;
+		return -1;
 	}
-
-	ucthreads[s->uthread_no].s_buf = s_buf;
-	ucthreads[s->uthread_no].c_len = c_len;
-	ucthreads[s->uthread_no].u_len = u_len;
-	ucthreads[s->uthread_no].m_alloced = max_len;
-	ucthreads[s->uthread_no].c_type = c_type;
-	ucthreads[s->uthread_no].streamno = streamno;
+	if (unlikely(read_buf(control, sinfo->fd, s_buf, padded_len))) {
+		dealloc(s_buf);
+		ucomp_ram -= max_len;
+		return -1;
+	}
+	if (ENCRYPT_AEAD && unlikely(read_buf(control, sinfo->fd, uci->tag, LRZ_AEAD_TAG_LEN))) {
+		dealloc(s_buf);
+		ucomp_ram -= max_len;
+		return -1;
+	}
+	sinfo->total_read += padded_len;
+	if (ENCRYPT_AEAD)
+		sinfo->total_read += LRZ_AEAD_NONCE_LEN + LRZ_AEAD_TAG_LEN;
+	else if (ENCRYPT)
+		memcpy(uci->salt, blocksalt, SALT_LEN);
+	uci->sealed = ENCRYPT;
+
+	uci->s_buf = s_buf;
+	uci->c_len = c_len;
+	uci->u_len = u_len;
+	uci->m_alloced = max_len;
+	uci->c_type = c_type;
+	uci->has_crc = has_crc;
+	uci->streamno = streamno;
+	uci->dec_buf = NULL;
+	uci->ready = 0;
+	uci->done = false;
+	uci->seq = s->started;
+	uci->skip = 0;
 	s->last_head = last_head;
 
 	/* List this thread as busy */
-	ucthreads[s->uthread_no].busy = 1;
-	print_maxverbose("Starting thread %ld to decompress %"PRId64" bytes from stream %d\n",
-			 s->uthread_no, padded_len, streamno);
+	uci->busy = 1;
+	print_maxverbose("Starting thread %d to decompress %"PRId64" bytes from stream %d\n",
+			 slot, padded_len, streamno);
 
 	sts = malloc(sizeof(stream_thread_struct));
 	if (unlikely(!sts)) {
-		ucthreads[s->uthread_no].busy = 0;
-		ucthreads[s->uthread_no].s_buf = NULL;
-		ucthreads[s->uthread_no].m_alloced = 0;
+		uci->busy = 0;
+		uci->s_buf = NULL;
+		uci->m_alloced = 0;
 		dealloc(s_buf);
-		sinfo->ram_alloced -= max_len;
+		ucomp_ram -= max_len;
 		fatal_return(("Unable to malloc in fill_buffer"), -1);
 	}
-	sts->i = s->uthread_no;
+	sts->i = slot;
 	sts->control = control;
 	sts->sinfo = sinfo;
-	if (unlikely(!create_pthread(control, &threads[s->uthread_no], NULL, ucompthread, sts))) {
-		ucthreads[s->uthread_no].busy = 0;
-		ucthreads[s->uthread_no].s_buf = NULL;
-		ucthreads[s->uthread_no].m_alloced = 0;
+	if (unlikely(!create_pthread(control, &sinfo->pthreads[slot], NULL, ucompthread, sts))) {
+		uci->busy = 0;
+		uci->s_buf = NULL;
+		uci->m_alloced = 0;
 		dealloc(sts);
 		dealloc(s_buf);
-		sinfo->ram_alloced -= max_len;
+		ucomp_ram -= max_len;
 		return -1;
 	}
+	ucomp_queued++;
+	s->started++;
 
-	if (++s->uthread_no == s->base_thread + s->total_threads)
-		s->uthread_no = s->base_thread;
+	uci->next = -1;
+	if (s->qtail == -1)
+		s->qhead = slot;
+	else
+		sinfo->ucthreads[s->qtail].next = slot;
+	s->qtail = slot;
 skip_empty:
-	/* Reached the end of this stream, no more data to read in, otherwise
-	 * see if the next thread is free to grab more data. We also check that
-	 * we're not going to be allocating too much ram to generate all these
-	 * threads. */
+	/* Reached the end of this stream, no more data to read in */
 	if (!last_head)
 		s->eos = 1;
-	else if (s->uthread_no != s->unext_thread && !ucthreads[s->uthread_no].busy &&
-		 sinfo->ram_alloced < control->maxram)
-			goto fill_another;
-out:
-	lock_mutex(control, &output_lock);
-	output_thread = s->unext_thread;
-	cond_broadcast(control, &output_cond);
-	unlock_mutex(control, &output_lock);
+	return 0;
+}
+
+/* Once every block of the chunk being reconstructed has been started, open
+ * the next chunk the same way runzip_chunk would so its first blocks can
+ * decompress while this one is finished off and written out. Only regular
+ * files without LRZC framing are read ahead. */
+static struct stream_info *open_ahead(rzip_control *control, struct stream_info *sinfo)
+{
+	if (unlikely(read_seekto(control, sinfo, sinfo->total_read)))
+		return NULL;
+	print_maxverbose("Looking ahead to chunk at %"PRId64"\n",
+			 sinfo->initial_pos + sinfo->total_read);
+	return open_chunk(control, sinfo->fd, sinfo->num_streams);
+}
+
+/* Keep the decompression threads fed. Blocks are started in archive order
+ * across all streams, and then into the next chunk, while ram and the slot
+ * count allow. A slot is always left for every stream that has nothing
+ * queued, and the stream runzip is waiting on (need) gets its next block
+ * started regardless of budget. */
+static int prefetch_blocks(rzip_control *control, struct stream_info *sinfo, int need)
+{
+	struct uncomp_thread *ucthreads = sinfo->ucthreads;
+
+	while (42) {
+		int i, streamno = -1, starved = 0, nfree = 0, slot = -1;
+
+		for (i = 0; i < sinfo->num_streams; i++) {
+			struct stream *s = &sinfo->s[i];
+
+			if (s->eos)
+				continue;
+			if (s->qhead == -1)
+				starved++;
+			if (streamno == -1 || s->last_head < sinfo->s[streamno].last_head)
+				streamno = i;
+		}
+		for (i = 0; i < sinfo->slots; i++) {
+			if (ucthreads[i].busy)
+				continue;
+			if (slot == -1)
+				slot = i;
+			nfree++;
+		}
+
+		if (need >= 0 && !sinfo->s[need].eos && sinfo->s[need].qhead == -1) {
+			streamno = need;
+			if (unlikely(slot == -1))
+				failure_return(("No free decompression thread, this shouldn't happen!\n"), -1);
+		} else if (ucomp_queued >= sinfo->slots || ucomp_ram >= control->maxram)
+			return 0;
+		else if (streamno == -1)
+			break;
+		else if (nfree - 1 < starved - (sinfo->s[streamno].qhead == -1))
+			return 0;
+
+		if (unlikely(start_block(control, sinfo, streamno, slot)))
+			return -1;
+	}
+
+	/* Every block of this chunk is under way */
+	if (sinfo == ahead_sinfo)
+		return 0;
+	if (!ahead_sinfo) {
+		if (sinfo->looked_ahead || sinfo->eof || !sinfo->infile_size ||
+		    TMP_INBUF || STDIN || STREAMING_BLOCKS ||
+		    (control->major_version == 0 && control->minor_version < 6))
+			return 0;
+		sinfo->looked_ahead = true;
+		ahead_sinfo = open_ahead(control, sinfo);
+		if (!ahead_sinfo)
+			return 0;
+	}
+	return prefetch_blocks(control, ahead_sinfo, -1);
+}
+
+/* Join the slot at the head of the stream's queue and make its whole
+ * block the stream's buffer. Returns -1 on failure. */
+static int take_block(rzip_control *control, struct stream_info *sinfo, struct stream *s)
+{
+	int slot = s->qhead;
+	struct uncomp_thread *uci = &sinfo->ucthreads[slot];
+	void *thr_return;
 
 	/* join_pthread here will make it wait till the data is ready */
 	thr_return = NULL;
-	if (unlikely(!join_pthread(control, threads[s->unext_thread], &thr_return) || !!thr_return))
+	if (unlikely(!join_pthread(control, sinfo->pthreads[slot], &thr_return) || !!thr_return))
 		return -1;
-	ucthreads[s->unext_thread].busy = 0;
-
-	print_maxverbose("Taking decompressed data from thread %ld\n", s->unext_thread);
-	s->buf = ucthreads[s->unext_thread].s_buf;
-	ucthreads[s->unext_thread].s_buf = NULL;
-	s->buflen = ucthreads[s->unext_thread].u_len;
-	sinfo->ram_alloced -= ucthreads[s->unext_thread].m_alloced;
-	ucthreads[s->unext_thread].m_alloced = 0;
+	uci->busy = 0;
+	s->qhead = uci->next;
+	if (s->qhead == -1)
+		s->qtail = -1;
+
+	print_maxverbose("Taking decompressed data from thread %d\n", slot);
+	s->buf = uci->s_buf;
+	uci->s_buf = uci->dec_buf = NULL;
+	s->buflen = uci->skip + uci->u_len;
+	s->live = -1;
+	lock_mutex(control, &in_lock);
+	ucomp_ram -= uci->m_alloced;
+	ucomp_queued--;
+	unlock_mutex(control, &in_lock);
+	uci->m_alloced = 0;
+
+	/* Keep the tail of the block for the next one to be primed with. It
+	 * is only read once taken says so, and only replaced after that
+	 * block is taken in turn. */
+	if (PRIME && lzma_props_dict(control->lzma_properties)) {
+		i64 len = MIN(uci->u_len, (i64)lzma_props_dict(control->lzma_properties));
+		uchar *prime = realloc(s->prime, len);
+
+		if (unlikely(!prime))
+			fatal_return(("Unable to realloc prime of size %"PRId64" in take_block\n", len), -1);
+		memcpy(prime, s->buf + s->buflen - len, len);
+		s->prime = prime;
+		s->prime_len = len;
+	}
+	lock_mutex(control, &ready_lock);
+	s->taken++;
+	cond_broadcast(control, &ready_cond);
+	unlock_mutex(control, &ready_lock);
+	return 0;
+}
+
+/* Wait for the block being read while it decodes to make more than
+ * s->buflen bytes ready, taking it over once it is done */
+static int wait_ready(rzip_control *control, struct stream_info *sinfo, struct stream *s)
+{
+	struct uncomp_thread *uci = &sinfo->ucthreads[s->live];
+	bool done;
+
+	lock_mutex(control, &ready_lock);
+	while (uci->ready <= s->buflen && !uci->done)
+		cond_wait(control, &ready_cond, &ready_lock);
+	s->buflen = uci->ready;
+	done = uci->done;
+	unlock_mutex(control, &ready_lock);
+	if (done)
+		return take_block(control, sinfo, s);
+	return 0;
+}
+
+/* fill a buffer from a stream - return -1 on failure */
+static int fill_buffer(rzip_control *control, struct stream_info *sinfo, struct stream *s, int streamno)
+{
+	struct uncomp_thread *uci;
+	int slot, ret;
+
+	dealloc(s->buf);
+	s->buf = NULL;
+	s->buflen = 0;
 	s->bufp = 0;
 
-	if (++s->unext_thread == s->base_thread + s->total_threads)
-		s->unext_thread = s->base_thread;
+	lock_mutex(control, &in_lock);
+	ret = prefetch_blocks(control, sinfo, streamno);
+	unlock_mutex(control, &in_lock);
+	if (unlikely(ret))
+		return -1;
+	/* eos with nothing left queued: the stream is finished */
+	slot = s->qhead;
+	if (slot == -1)
+		return 0;
+	uci = &sinfo->ucthreads[slot];
 
-	return 0;
+	lock_mutex(control, &output_lock);
+	sinfo->next_thread = slot;
+	cond_broadcast(control, &output_cond);
+	unlock_mutex(control, &output_lock);
+
+	/* Start on a block that is still decoding as soon as some of it is */
+	lock_mutex(control, &ready_lock);
+	while (!uci->ready && !uci->done)
+		cond_wait(control, &ready_cond, &ready_lock);
+	if (!uci->done) {
+		s->buf = uci->dec_buf;
+		s->buflen = uci->ready;
+		s->live = slot;
+	}
+	/* A primed block's buffer starts with its prime */
+	s->bufp = uci->skip;
+	unlock_mutex(control, &ready_lock);
+	if (s->live == slot) {
+		print_maxverbose("Reading from thread %d while it decompresses\n", slot);
+		return 0;
+	}
+	return take_block(control, sinfo, s);
 }
 
 /* write some data to a stream. Return -1 on failure */
@@ -2366,6 +3655,11 @@ i64 read_stream(rzip_control *control, void *ss, int streamno, uchar *p, i64 len
 		}
 
 		if (len && s->bufp == s->buflen) {
+			if (s->live != -1) {
+				if (unlikely(wait_ready(control, sinfo, s)))
+					return -1;
+				continue;
+			}
 			if (unlikely(fill_buffer(control, sinfo, s, streamno)))
 				return -1;
 			if (s->bufp == s->buflen)
@@ -2409,33 +3703,19 @@ int close_stream_out(rzip_control *control, void *ss)
 	return 0;
 }
 
-/* Add to an runzip list to safely deallocate memory after all threads have
- * returned. */
-static void add_to_rulist(rzip_control *control, struct stream_info *sinfo)
-{
-	struct runzip_node *node = calloc(1, sizeof(struct runzip_node));
-
-	if (unlikely(!node))
-		failure("Failed to calloc struct node in add_rulist\n");
-	node->sinfo = sinfo;
-	node->pthreads = control->pthreads;
-
-	lock_mutex(control, &control->control_lock);
-	node->prev = control->ruhead;
-	control->ruhead = node;
-	unlock_mutex(control, &control->control_lock);
-}
-
 /* close down an input stream */
 int close_stream_in(rzip_control *control, void *ss)
 {
 	struct stream_info *sinfo = ss;
-	int i;
+	int i, ret, busy = 0;
 
+	lock_mutex(control, &in_lock);
 	print_maxverbose("Closing stream at %"PRId64", want to seek to %"PRId64"\n",
-			 get_readseek(control, control->fd_in),
+			 get_readseek(control, sinfo->fd),
 			 sinfo->initial_pos + sinfo->total_read);
-	if (unlikely(read_seekto(control, sinfo, sinfo->total_read)))
+	ret = read_seekto(control, sinfo, sinfo->total_read);
+	unlock_mutex(control, &in_lock);
+	if (unlikely(ret))
 		return -1;
 
 	/* LRZC c_size must match bytes consumed from RCD start through streams. */
@@ -2449,10 +3729,45 @@ int close_stream_in(rzip_control *control, void *ss)
 		}
 	}
 
-	for (i = 0; i < sinfo->num_streams; i++)
-		dealloc(sinfo->s[i].buf);
+	for (i = 0; i < sinfo->num_streams; i++) {
+		struct stream *s = &sinfo->s[i];
+
+		/* The last block may have been read in full before its thread
+		 * was done with it */
+		while (s->live != -1) {
+			if (unlikely(wait_ready(control, sinfo, s)))
+				return -1;
+		}
+		dealloc(s->buf);
+		/* Release primed blocks still waiting for a block before them */
+		lock_mutex(control, &ready_lock);
+		s->taken = INT_MAX;
+		cond_broadcast(control, &ready_cond);
+		unlock_mutex(control, &ready_lock);
+	}
+
+	/* Every block has normally been taken by now; any slot still decoding
+	 * after a failure is left to finish but no longer counts as queued. */
+	for (i = 0; i < sinfo->slots; i++) {
+		struct uncomp_thread *uci = &sinfo->ucthreads[i];
+
+		if (!uci->busy) {
+			ucthread_release(uci);
+			continue;
+		}
+		lock_mutex(control, &in_lock);
+		ucomp_ram -= uci->m_alloced;
+		ucomp_queued--;
+		unlock_mutex(control, &in_lock);
+		uci->m_alloced = 0;
+		busy++;
+	}
+	/* A primed block may still be copying its prime */
+	if (!busy) {
+		for (i = 0; i < sinfo->num_streams; i++)
+			dealloc(sinfo->s[i].prime);
+	}
 
-	output_thread = 0;
 	/* We cannot safely release the sinfo and pthread data here till all
 	 * threads are shut down. */
 	add_to_rulist(control, sinfo);
@@ -2460,38 +3775,42 @@ int close_stream_in(rzip_control *control, void *ss)
 	return 0;
 }
 
-/* As others are slow and lz4 very fast, it is worth doing a quick lz4 pass
-   to see if there is any compression at all with lz4 first. It is unlikely
-   that others will be able to compress if lz4 is unable to drop a single byte
-   so do not compress any block that is incompressible by lz4.
-   The test runs only on the first backend block that reaches here; the
-   result is reused for all later blocks in this compression job. */
+/* As others are slow, every block is first checked for any sign of
+   compressibility. The byte histogram and repeat probe settle most blocks
+   outright; only the uncertain ones get a quick lz4 pass, since it is
+   unlikely that others will be able to compress if lz4 is unable to drop a
+   single byte. Each block is judged on its own so one incompressible region
+   does not decide the fate of the rest of the archive. */
 static int lz4_compresses(rzip_control *control, uchar *s_buf, i64 s_len)
 {
+	struct block_probe bp;
 	int dlen, test_len;
 	char *c_buf = NULL, *test_buf = (char *)s_buf;
 	int ret = 0;
 	int workcounter = 0;	/* count # of passes */
 	int best_dlen = INT_MAX; /* save best compression estimate */
 
-	if (!LZ4_TEST)
+	/* --auto has already probed the block and chosen for it */
+	if (!LZ4_TEST || control->auto_policy)
 		return 1;
 
-	/* Serialise the one-shot test so only a single block is measured. */
-	lock_mutex(control, &control->control_lock);
-	if (control->lz4_test_done) {
-		ret = control->lz4_compressible ? 1 : 0;
-		unlock_mutex(control, &control->control_lock);
-		return ret;
+	probe_block(s_buf, s_len, &bp);
+	if (bp.entropy < PROBE_WEAK_BITS || bp.match_pm >= PROBE_WEAK_MATCHES) {
+		print_maxverbose("Block of %"PRId64" compressible by probe: %.2f bits/byte, %d/1000 repeats\n",
+				 s_len, bp.entropy, bp.match_pm);
+		return 1;
+	}
+	if (bp.entropy > PROBE_STORE_BITS && bp.match_pm < PROBE_STORE_MATCHES) {
+		print_maxverbose("Block of %"PRId64" incompressible by probe: %.2f bits/byte, %d/1000 repeats\n",
+				 s_len, bp.entropy, bp.match_pm);
+		return 0;
 	}
 
 	dlen = MIN(s_len, STREAM_BUFSIZE);
 	test_len = MIN(dlen, STREAM_BUFSIZE >> 8);
 	c_buf = malloc(dlen);
-	if (unlikely(!c_buf)) {
-		unlock_mutex(control, &control->control_lock);
+	if (unlikely(!c_buf))
 		fatal_return(("Unable to allocate c_buf in lz4_compresses\n"), 0);
-	}
 
 	/* Test progressively larger blocks at a time and as soon as anything
 	   compressible is found, jump out as a success */
@@ -2513,18 +3832,14 @@ static int lz4_compresses(rzip_control *control, uchar *s_buf, i64 s_len)
 	} while (test_len <= dlen);
 
 	if (!ret)
-		print_maxverbose("lz4 testing FAILED for chunk %ld. %d Passes (applied to all blocks)\n",
+		print_maxverbose("lz4 testing FAILED for block %"PRId64". %d Passes\n",
 				 s_len, workcounter);
 	else {
-		print_maxverbose("lz4 testing OK for chunk %ld. Compressed size = %5.2F%% of chunk, %d Passes (applied to all blocks)\n",
+		print_maxverbose("lz4 testing OK for block %"PRId64". Compressed size = %5.2F%% of block, %d Passes\n",
 				s_len, 100 * ((double) best_dlen / (double) test_len), workcounter);
 	}
 
 	dealloc(c_buf);
 
-	control->lz4_compressible = ret ? true : false;
-	control->lz4_test_done = true;
-	unlock_mutex(control, &control->control_lock);
-
 	return ret;
 }
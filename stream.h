@@ -37,6 +37,9 @@ bool wait_streamout_threads(rzip_control *control);
 bool close_streamout_threads(rzip_control *control);
 void *open_stream_out(rzip_control *control, int f, unsigned int n, i64 chunk_limit, char cbytes);
 void *open_stream_in(rzip_control *control, int f, int n, char cbytes);
+void *open_stream_at(rzip_control *control, int f, int n, i64 pos, i64 *next_pos);
+bool skip_chunk(rzip_control *control, int f, int n, i64 pos, i64 *size,
+		uchar *eof, i64 *next_pos);
 void flush_buffer(rzip_control *control, struct stream_info *sinfo, int stream);
 void write_stream(rzip_control *control, void *ss, int streamno, uchar *p, i64 len);
 i64 read_stream(rzip_control *control, void *ss, int streamno, uchar *p, i64 len);
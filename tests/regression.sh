@@ -4,9 +4,10 @@
 #
 # Part 1: Classic gold-file CLI tests (compat `lrz` behaviour).
 # Part 2: Round-trip matrix (content shapes, backends, STDIO, encryption).
-# Part 3: --ultra single block mode and constrained memory behaviour.
+# Part 3: --ultra single block mode, --prime and constrained memory behaviour.
 # Part 4: --filter prefilter round-trips and block type recording.
 # Part 5: pre-rzip chunk conversion round-trips and probes.
+# Part 6: --auto per-block backend selection.
 #
 # Copyright (C) 2016 Ole Tange and Free Software Foundation, Inc.
 # Copyright (C) 2026 Con Kolivas
@@ -421,6 +422,283 @@ run_roundtrip_tests() {
 		run_one "enc/file/small/${be_tag}" small "$be" file 1
 	done
 
+	log "--- Encrypted batch with --session-key ---"
+	# One run over several files derives the password key once, and so
+	# does reading them back in one run; each archive still opens on its
+	# own and only with the right password.
+	local sess="$WORKDIR_RT/session"
+	mkdir -p "$sess"
+	seq 1 50000 > "$sess/a"
+	seq 7 60000 > "$sess/b"
+	if "$LRZIP" "${BASE_FLAGS[@]}" -vvv --session-key --encrypt=testpass "$sess/a" "$sess/b" >"$sess/log" 2>&1 &&
+	   [[ $(grep -c "Reusing session master key" "$sess/log") -eq 1 ]] &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -vvv -t --encrypt=testpass "$sess/a.lrz" "$sess/b.lrz" >"$sess/log" 2>&1 &&
+	   [[ $(grep -c "Reusing session master key" "$sess/log") -eq 1 ]] &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -d --encrypt=testpass -o "$sess/b.out" "$sess/b.lrz" >/dev/null 2>&1 &&
+	   cmp -s "$sess/b" "$sess/b.out" &&
+	   ! "$LRZIP" "${BASE_FLAGS[@]}" -d --encrypt=wrongpass -o "$sess/a.out" "$sess/a.lrz" >/dev/null 2>&1; then
+		log "PASS  enc/session-key"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  enc/session-key"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	# Blocks are sealed by several compression threads at once, each
+	# setting its own AES key; both ciphers must read back with one thread.
+	local encp="$WORKDIR_RT/enc-threads"
+	mkdir -p "$encp"
+	seq 1 3000000 > "$encp/in"
+	if "$LRZIP" "${BASE_FLAGS[@]}" -l -p 4 --encrypt=testpass -o "$encp/gcm.lrz" "$encp/in" >/dev/null 2>&1 &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -d -p 1 --encrypt=testpass -o "$encp/gcm.out" "$encp/gcm.lrz" >/dev/null 2>&1 &&
+	   cmp -s "$encp/in" "$encp/gcm.out" &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -l -p 4 --legacy-encrypt --encrypt=testpass -o "$encp/cbc.lrz" "$encp/in" >/dev/null 2>&1 &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -d -p 1 --encrypt=testpass -o "$encp/cbc.out" "$encp/cbc.lrz" >/dev/null 2>&1 &&
+	   cmp -s "$encp/in" "$encp/cbc.out"; then
+		log "PASS  enc/threads"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  enc/threads"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+
+	log "--- LZ4 backend (fast and hc levels) ---"
+	for profile in empty small zeros_small zeros_large incom_small incom_large; do
+		run_one "file/${profile}/lz4" "$profile" "--lz4" file 0
+	done
+	run_one "file/small/lz4hc" small "--lz4 -L 9" file 0
+	run_one "file/zeros_large/lz4hc" zeros_large "--lz4 -L 9" file 0
+	run_one "stdio/small/lz4" small "--lz4" stdio 0
+	run_one "enc/file/small/lz4" small "--lz4" file 1
+	local lz4in="$WORKDIR_RT/lz4.txt"
+	seq 1 200000 > "$lz4in"
+	"$LRZIP" "${BASE_FLAGS[@]}" --lz4 -o "$lz4in.lrz" "$lz4in" >/dev/null 2>&1
+	if "$LRZIP" -i -vv "$lz4in.lrz" 2>/dev/null | grep -q 'rzip + lz4'; then
+		log "PASS  lz4/info-method"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  lz4/info-method"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	if "$LRZIP" "${BASE_FLAGS[@]}" --lz4 -l -o "$lz4in.2.lrz" "$lz4in" >/dev/null 2>&1; then
+		log "FAIL  lz4/one-backend-only"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	else
+		log "PASS  lz4/one-backend-only"
+		PASS_OK=$((PASS_OK + 1))
+	fi
+
+	log "--- Per-block compressibility test ---"
+	# An incompressible head must not stop later blocks being compressed:
+	# each block is tested on its own.
+	local mixed="$WORKDIR_RT/randhead.bin"
+	dd if=/dev/urandom of="$mixed" bs=1M count=12 status=none
+	seq 1 3000000 >> "$mixed"
+	if "$LRZIP" "${BASE_FLAGS[@]}" -p 4 -o "$mixed.lrz" "$mixed" >/dev/null 2>&1 &&
+	   [[ $(wc -c < "$mixed.lrz") -lt $(( $(wc -c < "$mixed") / 2 )) ]] &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -d -o "$mixed.out" "$mixed.lrz" >/dev/null 2>&1 &&
+	   cmp -s "$mixed" "$mixed.out"; then
+		log "PASS  file/randhead/per-block-test"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  file/randhead/per-block-test"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+
+	log "--- Multi-chunk decompression ---"
+	# More than one rzip chunk: the next chunk's blocks are started before
+	# the current one is finished, and the output must not notice.
+	local chunked="$WORKDIR_RT/chunked.txt"
+	seq 1 20000000 | head -c $((110 * 1024 * 1024)) > "$chunked"
+	if "$LRZIP" "${BASE_FLAGS[@]}" -w 1 --lz4 -o "$chunked.lrz" "$chunked" >/dev/null 2>&1 &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -p 1 -vvv -d -o "$chunked.out" "$chunked.lrz" >"$chunked.log" 2>&1 &&
+	   grep -q "already opened by look-ahead" "$chunked.log" &&
+	   cmp -s "$chunked" "$chunked.out"; then
+		log "PASS  file/chunked/look-ahead"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  file/chunked/look-ahead"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	# With more than one thread the chunks are rebuilt side by side, each
+	# into its own part of the output, and the MD5 still has to match.
+	rm -f "$chunked.out"
+	if "$LRZIP" "${BASE_FLAGS[@]}" -p 4 -vv -d -o "$chunked.out" "$chunked.lrz" >"$chunked.log" 2>&1 &&
+	   grep -q "chunks in parallel" "$chunked.log" &&
+	   cmp -s "$chunked" "$chunked.out" &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -p 4 -t "$chunked.lrz" >/dev/null 2>&1; then
+		log "PASS  file/chunked/parallel"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  file/chunked/parallel"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	# Three chunks compressed with several threads: only the last may be
+	# flagged eof. Older writers could flag a middle chunk too, which the
+	# size in the header must override when rebuilding in parallel.
+	local three="$WORKDIR_RT/three.bin"
+	{ head -c 1000000 /dev/urandom; head -c 230000000 /dev/zero; head -c 1000000 /dev/urandom; } > "$three"
+	if "$LRZIP" "${BASE_FLAGS[@]}" -w 1 -p 4 --lz4 -o "$three.lrz" "$three" >/dev/null 2>&1 &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -p 1 -vvv -t "$three.lrz" >"$three.log" 2>&1 &&
+	   [[ $(grep '^EOF:' "$three.log" | tr -d '\n') == "EOF: 0EOF: 0EOF: 1" ]] &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -p 4 -d -o "$three.out" "$three.lrz" >/dev/null 2>&1 &&
+	   cmp -s "$three" "$three.out" &&
+	   printf '\001' | dd of="$three.lrz" bs=1 conv=notrunc 2>/dev/null \
+		seek="$(grep 'Reading eof flag at' "$three.log" | sed -n '2s/.* at //p')" &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -p 4 -d -o "$three.out" "$three.lrz" >/dev/null 2>&1 &&
+	   cmp -s "$three" "$three.out" &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -p 4 -t "$three.lrz" >/dev/null 2>&1; then
+		log "PASS  file/chunked/middle-eof"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  file/chunked/middle-eof"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	# --range must also read past a middle chunk flagged eof
+	rm -f "$three.out"
+	if "$LRZIP" "${BASE_FLAGS[@]}" -d --range=231500000-231500999 -o "$three.out" "$three.lrz" >/dev/null 2>&1 &&
+	   tail -c +231500001 "$three" | head -c 1000 | cmp -s - "$three.out"; then
+		log "PASS  file/chunked/middle-eof-range"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  file/chunked/middle-eof-range"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	# Parallel rebuilds stay within maxram (a third of -m): with room
+	# for two of the 100MB chunks the third waits for one to finish,
+	# and with room for less than two the chunks are rebuilt in turn.
+	rm -f "$three.out"
+	if "$LRZIP" "${BASE_FLAGS[@]}" -m 6 -p 4 -vvv -d -o "$three.out" "$three.lrz" >"$three.log" 2>&1 &&
+	   grep -q "Waiting for ram to rebuild chunk" "$three.log" &&
+	   cmp -s "$three" "$three.out" &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -m 5 -p 4 -vvv -d -o "$three.out" "$three.lrz" >"$three.log" 2>&1 &&
+	   grep -q "too large to rebuild in parallel" "$three.log" &&
+	   cmp -s "$three" "$three.out"; then
+		log "PASS  file/chunked/parallel-maxram"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  file/chunked/parallel-maxram"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	# File output is allocated in full and mapped as history up front;
+	# what is left must be exactly the original, and stdout, which
+	# cannot be mapped, must agree with it.
+	rm -f "$chunked.out"
+	if "$LRZIP" "${BASE_FLAGS[@]}" -vvv -d -o "$chunked.out" "$chunked.lrz" >"$chunked.log" 2>&1 &&
+	   grep -q "of output as history" "$chunked.log" &&
+	   cmp -s "$chunked" "$chunked.out" &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -d -o - "$chunked.lrz" 2>/dev/null | cmp -s "$chunked" -; then
+		log "PASS  file/chunked/mapped-history"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  file/chunked/mapped-history"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	# --range extracts bytes out of the middle: across the boundary of the
+	# first two chunks, and from the second alone, skipping the first
+	# without decompressing it. The archive must survive.
+	rm -f "$chunked.out"
+	if "$LRZIP" "${BASE_FLAGS[@]}" -d --range=104857000-104858999 -o "$chunked.out" "$chunked.lrz" >/dev/null 2>&1 &&
+	   tail -c +104857001 "$chunked" | head -c 2000 | cmp -s - "$chunked.out" &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -vvv -d --range=110000000- -o - "$chunked.lrz" 2>"$chunked.log" |
+	   cmp -s - <(tail -c +110000001 "$chunked") &&
+	   grep -q "Skipping chunk" "$chunked.log" && [[ -f "$chunked.lrz" ]]; then
+		log "PASS  file/chunked/range"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  file/chunked/range"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	# Too little ram to map the whole chunk: the search slides a window
+	# over it and the MD5 is fed from copies rather than the mapping.
+	rm -f "$chunked.out"
+	if "$LRZIP" "${BASE_FLAGS[@]}" -U -m 1 --lz4 -vvv -o "$chunked.sl.lrz" "$chunked" >"$chunked.log" 2>&1 &&
+	   grep -q "sliding mmap mode" "$chunked.log" &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -t "$chunked.sl.lrz" >/dev/null 2>&1 &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -d -o "$chunked.out" "$chunked.sl.lrz" >/dev/null 2>&1 &&
+	   cmp -s "$chunked" "$chunked.out"; then
+		log "PASS  file/chunked/sliding"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  file/chunked/sliding"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	rm -f "$chunked.sl.lrz"
+	# A tree hash checks every chunk on the thread that rebuilt it; the
+	# root must still match what -c computes from the written file.
+	rm -f "$chunked.out"
+	if "$LRZIP" "${BASE_FLAGS[@]}" -w 1 --lz4 --tree-hash -o "$chunked.th.lrz" "$chunked" >/dev/null 2>&1 &&
+	   "$LRZIP" -i "$chunked.th.lrz" 2>&1 | grep -q "MD5 tree root" &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -p 4 -vvv -c -d -o "$chunked.out" "$chunked.th.lrz" >"$chunked.log" 2>&1 &&
+	   grep -q "chunks in parallel" "$chunked.log" &&
+	   [[ $(grep -c "Chunk MD5 of" "$chunked.log") -ge 2 ]] &&
+	   cmp -s "$chunked" "$chunked.out" &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -p 1 -t "$chunked.th.lrz" >/dev/null 2>&1 &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -d -o - "$chunked.th.lrz" 2>/dev/null | cmp -s "$chunked" -; then
+		log "PASS  file/chunked/tree-hash"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  file/chunked/tree-hash"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	# A stored byte changed in the middle of the data only shows up in
+	# the digest of the chunk it belongs to.
+	head -c 3000000 "$chunked" > "$chunked.3m"
+	if "$LRZIP" "${BASE_FLAGS[@]}" -n --tree-hash -o "$chunked.th.lrz" "$chunked.3m" >/dev/null 2>&1 &&
+	   printf 'Z' | dd of="$chunked.th.lrz" bs=1 seek=1500000 conv=notrunc 2>/dev/null &&
+	   ! "$LRZIP" "${BASE_FLAGS[@]}" -t "$chunked.th.lrz" >"$chunked.log" 2>&1 &&
+	   grep -q "Chunk MD5 check failed" "$chunked.log"; then
+		log "PASS  file/chunked/tree-hash-corrupt"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  file/chunked/tree-hash-corrupt"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	# With --block-crc the same damage is caught by the block's own
+	# thread, which names the block.
+	if "$LRZIP" "${BASE_FLAGS[@]}" -n --block-crc -o "$chunked.bc.lrz" "$chunked.3m" >/dev/null 2>&1 &&
+	   "$LRZIP" -i -vv "$chunked.bc.lrz" 2>&1 | grep -q "none+crc" &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -t "$chunked.bc.lrz" >/dev/null 2>&1 &&
+	   printf 'Z' | dd of="$chunked.bc.lrz" bs=1 seek=1500000 conv=notrunc 2>/dev/null &&
+	   ! "$LRZIP" "${BASE_FLAGS[@]}" -t "$chunked.bc.lrz" >"$chunked.log" 2>&1 &&
+	   grep -q "Block 1 of stream 1 at offset .* failed its CRC32 check" "$chunked.log"; then
+		log "PASS  file/chunked/block-crc"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  file/chunked/block-crc"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	# -c on compression decodes each block again and replays the rzip
+	# matches before the chunk is unmapped, leaving the archive unchanged.
+	if "$LRZIP" "${BASE_FLAGS[@]}" -o "$chunked.th.lrz" "$chunked.3m" >/dev/null 2>&1 &&
+	   "$LRZIP" -f -L 1 -c -vvv -o "$chunked.bc.lrz" "$chunked.3m" >"$chunked.log" 2>&1 &&
+	   grep -q "Verified .* byte block" "$chunked.log" &&
+	   grep -q "Replayed rzip tokens of 3000000 byte chunk" "$chunked.log" &&
+	   cmp -s "$chunked.th.lrz" "$chunked.bc.lrz"; then
+		log "PASS  file/chunked/compress-verify"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  file/chunked/compress-verify"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	rm -f "$chunked.th.lrz" "$chunked.bc.lrz" "$chunked.3m"
+	# -t rebuilds each chunk in memory and writes nothing; a damaged copy
+	# must still be caught, threaded or not.
+	cp "$chunked.lrz" "$chunked.bad.lrz"
+	printf 'UUUU' | dd of="$chunked.bad.lrz" bs=1 seek=5000000 conv=notrunc 2>/dev/null
+	if "$LRZIP" "${BASE_FLAGS[@]}" -p 1 -vvv -t "$chunked.lrz" >"$chunked.log" 2>&1 &&
+	   [[ $(grep -c "in memory" "$chunked.log") -eq 2 ]] &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -p 4 -vvv -t "$chunked.lrz" >"$chunked.log" 2>&1 &&
+	   [[ $(grep -c "in memory" "$chunked.log") -eq 2 ]] &&
+	   ! "$LRZIP" "${BASE_FLAGS[@]}" -p 1 -t "$chunked.bad.lrz" >/dev/null 2>&1 &&
+	   ! "$LRZIP" "${BASE_FLAGS[@]}" -p 4 -t "$chunked.bad.lrz" >/dev/null 2>&1; then
+		log "PASS  file/chunked/test-in-memory"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  file/chunked/test-in-memory"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	rm -f "$chunked" "$chunked.lrz" "$chunked.bad.lrz" "$chunked.out" "$chunked.log"
+
 	local total=$((PASS_OK + PASS_FAIL + PASS_SKIP))
 	log "roundtrip: $PASS_OK passed, $PASS_FAIL failed, $PASS_SKIP skipped (total $total)"
 	[[ "$PASS_FAIL" -eq 0 ]]
@@ -434,7 +712,7 @@ run_roundtrip_tests() {
 # allowance and compression must still round-trip rather than fail.
 # ----------------------------------------------------------------------------
 run_ultra_tests() {
-	local dictline dictsize plain ultra
+	local dictline dictsize plain ultra primed rc
 	WORKDIR_U="$(mktemp -d "${TMPDIR:-/tmp}/lrzip-ultra.XXXXXX")"
 	log "=== Part 3: ultra suite (WORKDIR=$WORKDIR_U) ==="
 
@@ -487,6 +765,72 @@ run_ultra_tests() {
 		PASS_FAIL=$((PASS_FAIL + 1))
 	fi
 
+	# Many threads in little ram: the thread count is kept and memory
+	# admission holds jobs back instead, so the archive must round-trip
+	# with every block written in order.
+	seq 1 4000000 > "$WORKDIR_U/admit.txt"
+	"$LRZIP" -f -vv -m 3 -p 8 -L9 -o "$WORKDIR_U/admit.lrz" "$WORKDIR_U/admit.txt" >"$WORKDIR_U/admit.log" 2>&1
+	if grep -q "compression threads to run at once" "$WORKDIR_U/admit.log" &&
+	   ! grep -q "Minimising number of threads" "$WORKDIR_U/admit.log"; then
+		log "PASS  lowram/admission"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  lowram/admission"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	"$LRZIP" "${BASE_FLAGS[@]}" -m 3 -d -o "$WORKDIR_U/admit.out" "$WORKDIR_U/admit.lrz" >/dev/null 2>&1
+	if cmp -s "$WORKDIR_U/admit.txt" "$WORKDIR_U/admit.out"; then
+		log "PASS  lowram/admission-roundtrip"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  lowram/admission-roundtrip"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	# LZMA blocks are read while they still decode: damage in the middle
+	# of one must fail the run, not hang it or pass it.
+	cp "$WORKDIR_U/admit.lrz" "$WORKDIR_U/bad.lrz"
+	printf 'UUUUUUUU' | dd of="$WORKDIR_U/bad.lrz" bs=1 conv=notrunc \
+		seek=$(( $(stat -c%s "$WORKDIR_U/admit.lrz") / 2 )) 2>/dev/null
+	timeout 120 "$LRZIP" "${BASE_FLAGS[@]}" -d -o "$WORKDIR_U/bad.out" "$WORKDIR_U/bad.lrz" >/dev/null 2>&1
+	rc=$?
+	if [[ "$rc" -ne 0 && "$rc" -ne 124 ]]; then
+		log "PASS  lzma/streamed-corrupt"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  lzma/streamed-corrupt (rc $rc)"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	# --prime continues each block from the tail of the block before it
+	# in its stream: later blocks must be recorded as primed, come out
+	# smaller than the same blocks compressed alone, and round-trip, also
+	# when encrypted.
+	"$LRZIP" "${BASE_FLAGS[@]}" -L7 -p 4 -o "$WORKDIR_U/alone.lrz" "$WORKDIR_U/admit.txt" >/dev/null 2>&1
+	"$LRZIP" "${BASE_FLAGS[@]}" -L7 -p 4 --prime -o "$WORKDIR_U/primed.lrz" "$WORKDIR_U/admit.txt" >/dev/null 2>&1
+	"$LRZIP" -i -vv "$WORKDIR_U/primed.lrz" >"$WORKDIR_U/primed.info" 2>&1
+	plain=$(stat -c%s "$WORKDIR_U/alone.lrz" 2>/dev/null || echo 0)
+	primed=$(stat -c%s "$WORKDIR_U/primed.lrz" 2>/dev/null || echo 0)
+	if grep -q "lzma+primed" "$WORKDIR_U/primed.info" &&
+	   [[ "$primed" -gt 0 && "$primed" -lt "$plain" ]]; then
+		log "PASS  prime/ratio ($primed < $plain)"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  prime/ratio ($primed >= $plain or no primed blocks)"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	"$LRZIP" "${BASE_FLAGS[@]}" -d -o "$WORKDIR_U/primed.out" "$WORKDIR_U/primed.lrz" >/dev/null 2>&1
+	"$LRZIP" "${BASE_FLAGS[@]}" -L7 -p 4 --prime --encrypt=testpass \
+		-o "$WORKDIR_U/primed-enc.lrz" "$WORKDIR_U/admit.txt" >/dev/null 2>&1
+	"$LRZIP" "${BASE_FLAGS[@]}" -d --encrypt=testpass -o "$WORKDIR_U/primed-enc.out" \
+		"$WORKDIR_U/primed-enc.lrz" >/dev/null 2>&1
+	if cmp -s "$WORKDIR_U/admit.txt" "$WORKDIR_U/primed.out" &&
+	   cmp -s "$WORKDIR_U/admit.txt" "$WORKDIR_U/primed-enc.out"; then
+		log "PASS  prime/roundtrip"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  prime/roundtrip"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+
 	rm -rf "$WORKDIR_U"
 	log "ultra: done"
 	[[ "$PASS_FAIL" -eq 0 ]]
@@ -644,6 +988,29 @@ run_chunk_filter_tests() {
 		log "FAIL  chunk/format-0.7"
 		PASS_FAIL=$((PASS_FAIL + 1))
 	fi
+	# The chunk is converted in one slice per thread, and the seams
+	# between x86 slices must come out as one conversion would.
+	if "$LRZIP" -f -L 1 -p 4 -vvv --filter=x86 -o "$lrz" "$in" >"$WORKDIR_C/big.log" 2>&1 &&
+	   grep -q 'Filter converted 4 slices in parallel' "$WORKDIR_C/big.log" &&
+	   "$LRZIP" "${BASE_FLAGS[@]}" -d -o "$WORKDIR_C/big.out" "$lrz" >/dev/null 2>&1 &&
+	   cmp -s "$in" "$WORKDIR_C/big.out"; then
+		log "PASS  chunk/x86-slices"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  chunk/x86-slices"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	# A prefiltered chunk is rebuilt in memory and unfiltered to the
+	# output as it goes rather than in a second pass over the file.
+	if "$LRZIP" "${BASE_FLAGS[@]}" -d -vvv -o "$WORKDIR_C/big.stream" "$lrz" >"$WORKDIR_C/unf.log" 2>&1 &&
+	   grep -q 'Rebuilding prefiltered chunk of .* bytes in memory' "$WORKDIR_C/unf.log" &&
+	   cmp -s "$in" "$WORKDIR_C/big.stream"; then
+		log "PASS  chunk/stream-unfilter"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  chunk/stream-unfilter"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
 
 	# Auto selection must decline the chunk filter on text (no code); the
 	# chunk header still carries LRZ_FILTER_NONE in its prefilter byte.
@@ -709,6 +1076,65 @@ run_chunk_filter_tests() {
 	[[ "$PASS_FAIL" -eq 0 ]]
 }
 
+# ----------------------------------------------------------------------------
+# Part 6: --auto per-block backend selection
+#
+# Every policy must round-trip on compressible, incompressible and zero data,
+# including encryption and stdio. A file mixing text with random data must
+# be stored in its random blocks and compressed in the rest, and --auto must
+# be refused together with a forced backend.
+# ----------------------------------------------------------------------------
+run_auto_tests() {
+	local policy in lrz
+	WORKDIR_A="$(mktemp -d "${TMPDIR:-/tmp}/lrzip-auto.XXXXXX")"
+	log "=== Part 6: auto backend suite (WORKDIR=$WORKDIR_A) ==="
+
+	for policy in speed balanced ratio; do
+		run_one "auto/$policy/small" small "--auto=$policy" file 0
+		run_one "auto/$policy/incom_large" incom_large "--auto=$policy" file 0
+		run_one "auto/$policy/zeros_large" zeros_large "--auto=$policy" file 0
+	done
+	run_one "auto/enc/small" small "--auto" file 1
+	run_one "auto/stdio/small" small "--auto" stdio 0
+
+	# Text either side of a random run spanning a whole backend block:
+	# the random block must be stored and the text blocks compressed.
+	in="$WORKDIR_A/mixed.bin"
+	lrz="$WORKDIR_A/mixed.lrz"
+	seq 1 1000000 > "$in"
+	dd if=/dev/urandom bs=1M count=16 status=none >> "$in"
+	seq 1 1000000 | rev >> "$in"
+	"$LRZIP" "${BASE_FLAGS[@]}" -p 4 --auto=speed -o "$lrz" "$in" >/dev/null 2>&1
+	if "$LRZIP" -i -vv "$lrz" 2>/dev/null | grep -qE $'^[0-9]+\tnone\t100' &&
+	   "$LRZIP" -i -vv "$lrz" 2>/dev/null | grep -qE $'^[0-9]+\t(lzo|gzip)\t'; then
+		log "PASS  auto/mixed-blocktypes"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  auto/mixed-blocktypes"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+	"$LRZIP" "${BASE_FLAGS[@]}" -d -o "$in.out" "$lrz" >/dev/null 2>&1
+	if cmp -s "$in" "$in.out"; then
+		log "PASS  auto/mixed-roundtrip"
+		PASS_OK=$((PASS_OK + 1))
+	else
+		log "FAIL  auto/mixed-roundtrip"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	fi
+
+	if "$LRZIP" "${BASE_FLAGS[@]}" -g --auto -o "$WORKDIR_A/no.lrz" "$in" >/dev/null 2>&1; then
+		log "FAIL  auto/forced-backend-refused"
+		PASS_FAIL=$((PASS_FAIL + 1))
+	else
+		log "PASS  auto/forced-backend-refused"
+		PASS_OK=$((PASS_OK + 1))
+	fi
+
+	rm -rf "$WORKDIR_A"
+	log "auto: done"
+	[[ "$PASS_FAIL" -eq 0 ]]
+}
+
 # ============================================================================
 # Main
 # ============================================================================
@@ -734,6 +1160,9 @@ if [[ "${SKIP_ROUNDTRIP:-0}" != 1 ]]; then
 	if ! run_chunk_filter_tests; then
 		STATUS=1
 	fi
+	if ! run_auto_tests; then
+		STATUS=1
+	fi
 else
 	log "SKIP  round-trip suite (SKIP_ROUNDTRIP=1)"
 fi
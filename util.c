@@ -53,6 +53,8 @@
 #include <fcntl.h>
 #include "lrzip_private.h"
 #include "util.h"
+#include "stream.h"
+#include "md5.h"
 #include "sha4.h"
 #include "aes.h"
 #ifdef HAVE_CTYPE_H
@@ -127,8 +129,8 @@ void setup_overhead(rzip_control *control)
 		/* Dictionary sizes per direct level, larger than the SDK
 		 * defaults: single block ultra hands the encoder whole
 		 * streams that are typically hundreds of MB, so a larger
-		 * window pays off in ratio. open_stream_out reduces threads
-		 * if the overhead does not fit in usable ram. */
+		 * window pays off in ratio. Memory admission in stream.c
+		 * holds back jobs whose overhead does not fit in usable ram. */
 		i64 dictsize = (level <= 4 ? (1 << (level * 2 + 16)) :
 				(level <= 6 ? (1 << (level + 20)) :
 				(level == 7 ? (1 << 26) :
@@ -189,23 +191,224 @@ size_t round_up_page(rzip_control *control, size_t len)
 	return len;
 }
 
-bool get_rand(rzip_control *control, uchar *buf, int len)
+/* MD5 worker for compression and decompression. The producer queues ranges
+ * in a ring of CKSUM_RING slots and only waits when all of them are still
+ * being hashed. A slot either points at the caller's bytes, which must stay
+ * put until md5_ring_drain(), or at its own copy of them. */
+static void *md5_ring_worker(void *data)
+{
+	rzip_control *control = (rzip_control *)data;
+	struct checksum *ck = &control->checksum;
+
+	while (42) {
+		struct cksum_slot *s;
+
+		cksem_wait(control, &control->cksum_worksem);
+		if (ck->shutdown)
+			break;
+		s = &ck->ring[ck->tail];
+		md5_process_bytes(s->data, (size_t)s->len, &control->ctx);
+		ck->tail = (ck->tail + 1) % CKSUM_RING;
+		cksem_post(control, &control->cksumsem);
+	}
+	return NULL;
+}
+
+void md5_ring_start(rzip_control *control)
+{
+	struct checksum *ck = &control->checksum;
+	int i;
+
+	memset(ck, 0, sizeof(*ck));
+	ck->capacity = CKSUM_CHUNK;
+	round_to_page(&ck->capacity);
+
+	cksem_init(control, &control->cksumsem);
+	for (i = 0; i < CKSUM_RING; i++)
+		cksem_post(control, &control->cksumsem);
+	cksem_init(control, &control->cksum_worksem);
+
+	if (unlikely(!create_pthread(control, &control->md5_thread, NULL, md5_ring_worker, control)))
+		failure("Failed to start MD5 worker thread\n");
+}
+
+/* Hand the slot being filled to the worker */
+static void md5_ring_submit(rzip_control *control)
+{
+	struct checksum *ck = &control->checksum;
+
+	if (!ck->filling)
+		return;
+	ck->filling = 0;
+	if (!ck->ring[ck->head].len) {
+		cksem_post(control, &control->cksumsem);
+		return;
+	}
+	ck->head = (ck->head + 1) % CKSUM_RING;
+	cksem_post(control, &control->cksum_worksem);
+}
+
+/* The slot being filled, claiming a free one if need be */
+static struct cksum_slot *md5_ring_slot(rzip_control *control)
+{
+	struct checksum *ck = &control->checksum;
+	struct cksum_slot *s = &ck->ring[ck->head];
+
+	if (!ck->filling) {
+		cksem_wait(control, &control->cksumsem);
+		s->data = NULL;
+		s->len = 0;
+		ck->filling = 1;
+	}
+	return s;
+}
+
+/* Queue len bytes at buf to be hashed where they are. Ranges that follow on
+ * from the last one are merged into the same slot. */
+void md5_ring_add(rzip_control *control, const uchar *buf, i64 len)
+{
+	struct checksum *ck = &control->checksum;
+	struct cksum_slot *s = &ck->ring[ck->head];
+
+	if (len <= 0)
+		return;
+	if (ck->filling && s->len && (s->data == s->buf || s->data + s->len != buf))
+		md5_ring_submit(control);
+	s = md5_ring_slot(control);
+	if (!s->len)
+		s->data = buf;
+	s->len += len;
+	if (s->len >= ck->capacity)
+		md5_ring_submit(control);
+}
+
+/* Room in a slot's own buffer for bytes that will not stay put, to be
+ * followed by md5_ring_commit() of what was stored there */
+uchar *md5_ring_space(rzip_control *control, i64 *space)
+{
+	struct checksum *ck = &control->checksum;
+	struct cksum_slot *s = &ck->ring[ck->head];
+
+	if (ck->filling && s->len && s->data != s->buf)
+		md5_ring_submit(control);
+	s = md5_ring_slot(control);
+	if (!s->buf) {
+		s->buf = malloc((size_t)ck->capacity);
+		if (unlikely(!s->buf))
+			failure("Failed to allocate MD5 batch buffer\n");
+	}
+	s->data = s->buf;
+	*space = ck->capacity - s->len;
+	return s->buf + s->len;
+}
+
+void md5_ring_commit(rzip_control *control, i64 len)
+{
+	struct checksum *ck = &control->checksum;
+
+	ck->ring[ck->head].len += len;
+	if (ck->ring[ck->head].len >= ck->capacity)
+		md5_ring_submit(control);
+}
+
+void md5_ring_copy(rzip_control *control, const uchar *buf, i64 len)
+{
+	while (len > 0) {
+		i64 space, n;
+		uchar *p = md5_ring_space(control, &space);
+
+		n = MIN(len, space);
+		memcpy(p, buf, (size_t)n);
+		md5_ring_commit(control, n);
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Wait until everything queued has been hashed */
+void md5_ring_drain(rzip_control *control)
+{
+	int i;
+
+	md5_ring_submit(control);
+	for (i = 0; i < CKSUM_RING; i++)
+		cksem_wait(control, &control->cksumsem);
+	for (i = 0; i < CKSUM_RING; i++)
+		cksem_post(control, &control->cksumsem);
+}
+
+void md5_ring_stop(rzip_control *control)
+{
+	struct checksum *ck = &control->checksum;
+	int i;
+
+	md5_ring_drain(control);
+	ck->shutdown = 1;
+	cksem_post(control, &control->cksum_worksem);
+	if (unlikely(!join_pthread(control, control->md5_thread, NULL)))
+		failure("Failed to join MD5 worker thread\n");
+	for (i = 0; i < CKSUM_RING; i++)
+		dealloc(ck->ring[i].buf);
+	ck->capacity = 0;
+}
+
+/* Salts, nonce prefixes and padding are served from a pool of /dev/urandom
+ * output refilled a page at a time, instead of opening the device for
+ * every block. Bytes are wiped from the pool as they are handed out. */
+#define RAND_POOL_LEN 4096
+
+static uchar rand_pool[RAND_POOL_LEN];
+static int rand_left;
+static pthread_mutex_t rand_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool fill_rand_pool(rzip_control *control)
 {
-	int fd;
+	ssize_t ret;
+	int fd, got;
 
 	/* Fail closed: weak PRNG fallback is unsafe for salts/IVs. */
 	fd = open("/dev/urandom", O_RDONLY);
 	if (unlikely(fd == -1))
 		fatal_return(("Failed to open /dev/urandom in get_rand\n"), false);
-	if (unlikely(read(fd, buf, len) != len)) {
-		close(fd);
-		fatal_return(("Failed to read fd in get_rand\n"), false);
+	for (got = 0; got < RAND_POOL_LEN; got += ret) {
+		ret = read(fd, rand_pool + got, RAND_POOL_LEN - got);
+		if (unlikely(ret <= 0)) {
+			close(fd);
+			fatal_return(("Failed to read fd in get_rand\n"), false);
+		}
 	}
 	if (unlikely(close(fd)))
 		fatal_return(("Failed to close fd in get_rand\n"), false);
+	rand_left = RAND_POOL_LEN;
 	return true;
 }
 
+bool get_rand(rzip_control *control, uchar *buf, int len)
+{
+	bool ret = true;
+
+	if (unlikely(!lock_mutex(control, &rand_lock)))
+		return false;
+	while (len > 0) {
+		uchar *src;
+		int n;
+
+		if (!rand_left && unlikely(!fill_rand_pool(control))) {
+			ret = false;
+			break;
+		}
+		n = MIN(len, rand_left);
+		src = rand_pool + RAND_POOL_LEN - rand_left;
+		memcpy(buf, src, n);
+		memset(src, 0, n);
+		rand_left -= n;
+		buf += n;
+		len -= n;
+	}
+	unlock_mutex(control, &rand_lock);
+	return ret;
+}
+
 bool read_config(rzip_control *control)
 {
 	/* check for lrzip.conf in ., $HOME/.lrzip and /etc/lrzip */
@@ -265,7 +468,7 @@ bool read_config(rzip_control *control)
 			if ( control->compression_level < 1 || control->compression_level > 9 )
 				failure_return(("CONF.FILE error. Compression Level must between 1 and 9"), false);
 		} else if (isparameter(parameter, "compressionmethod")) {
-			/* valid are rzip, gzip, bzip2, lzo, lzma (default), and zpaq */
+			/* valid are rzip, gzip, bzip2, lzo, lz4, lzma (default), and zpaq */
 			if (control->flags & FLAG_NOT_LZMA)
 				failure_return(("CONF.FILE error. Can only specify one compression method"), false);
 			if (isparameter(parametervalue, "bzip2"))
@@ -274,6 +477,8 @@ bool read_config(rzip_control *control)
 				control->flags |= FLAG_ZLIB_COMPRESS;
 			else if (isparameter(parametervalue, "lzo"))
 				control->flags |= FLAG_LZO_COMPRESS;
+			else if (isparameter(parametervalue, "lz4"))
+				control->flags |= FLAG_LZ4_COMPRESS;
 			else if (isparameter(parametervalue, "rzip"))
 				control->flags |= FLAG_NO_COMPRESS;
 			else if (isparameter(parametervalue, "zpaq"))
@@ -605,6 +810,66 @@ static bool hkdf_expand_sha512(const uchar *prk, size_t prk_len,
 	return true;
 }
 
+/* With --session-key the PBKDF2 master key is derived once per process and
+ * cached here, in locked memory that is wiped at exit. The session is tied
+ * to its passphrase, salt and iteration count: archives written in it take
+ * its salt, and archives read with the same three reuse it. */
+static struct aead_session {
+	uchar pass_id[HASH_LEN];	/* SHA-512 of the passphrase */
+	uchar salt[LRZ_AEAD_SALT_LEN];
+	unsigned int iters;
+	uchar master[HASH_LEN];
+} *session;
+
+static void wipe_session(void)
+{
+	if (!session)
+		return;
+	lrz_secure_wipe(session, sizeof(*session));
+	munlock(session, sizeof(*session));
+	dealloc(session);
+}
+
+static bool session_master(rzip_control *control, const uchar *pass, size_t pass_len,
+			   uchar master[HASH_LEN])
+{
+	bool writing = !(DECOMPRESS || TEST_ONLY || INFO);
+	uchar pass_id[HASH_LEN];
+
+	sha4(pass, (int)pass_len, pass_id, 0);
+	if (session && session->iters == control->aead_iters &&
+	    !memcmp(session->pass_id, pass_id, HASH_LEN) &&
+	    (writing || !memcmp(session->salt, control->aead_salt, LRZ_AEAD_SALT_LEN))) {
+		print_maxverbose("Reusing session master key\n");
+		memcpy(control->aead_salt, session->salt, LRZ_AEAD_SALT_LEN);
+		memcpy(control->salt, control->aead_salt, SALT_LEN);
+		memcpy(master, session->master, HASH_LEN);
+		lrz_secure_wipe(pass_id, sizeof(pass_id));
+		return true;
+	}
+	if (!pbkdf2_sha512(pass, pass_len, control->aead_salt, LRZ_AEAD_SALT_LEN,
+			   control->aead_iters, master, HASH_LEN)) {
+		lrz_secure_wipe(pass_id, sizeof(pass_id));
+		return false;
+	}
+	if (!session) {
+		/* Caching is only an optimisation, carry on without it */
+		session = malloc(sizeof(*session));
+		if (unlikely(!session)) {
+			lrz_secure_wipe(pass_id, sizeof(pass_id));
+			return true;
+		}
+		mlock(session, sizeof(*session));
+		atexit(wipe_session);
+	}
+	memcpy(session->pass_id, pass_id, HASH_LEN);
+	memcpy(session->salt, control->aead_salt, LRZ_AEAD_SALT_LEN);
+	session->iters = control->aead_iters;
+	memcpy(session->master, master, HASH_LEN);
+	lrz_secure_wipe(pass_id, sizeof(pass_id));
+	return true;
+}
+
 bool lrz_aead_kdf_setup(rzip_control *control)
 {
 	uchar master[HASH_LEN];
@@ -627,8 +892,21 @@ bool lrz_aead_kdf_setup(rzip_control *control)
 		return false;
 
 	print_maxverbose("PBKDF2-HMAC-SHA512 iterations %u\n", control->aead_iters);
-	if (!pbkdf2_sha512(pass, pass_len, control->aead_salt, LRZ_AEAD_SALT_LEN,
-			   control->aead_iters, master, HASH_LEN))
+	print_maxverbose("AES-256-GCM on %s\n", gcm_aes_hw() ?
+			 "AES-NI and PCLMULQDQ" : "portable tables");
+	if (control->aead_suite == LRZ_SUITE_AES256_GCM_PBKDF2_HKDF) {
+		uchar prk[HASH_LEN];
+
+		if (!session_master(control, pass, pass_len, master))
+			return false;
+		/* HKDF-Extract with the archive salt, so no two archives of
+		 * a session share keys or nonce space. */
+		hmac_sha512(control->aead_archive_salt, LRZ_AEAD_ARCHIVE_SALT_LEN,
+			    master, HASH_LEN, prk);
+		memcpy(master, prk, HASH_LEN);
+		lrz_secure_wipe(prk, sizeof(prk));
+	} else if (!pbkdf2_sha512(pass, pass_len, control->aead_salt, LRZ_AEAD_SALT_LEN,
+				  control->aead_iters, master, HASH_LEN))
 		return false;
 	if (!hkdf_expand_sha512(master, HASH_LEN, "lrzip-v3-hdr", 12,
 				control->aead_key_hdr, LRZ_AEAD_KEY_LEN))
@@ -646,20 +924,28 @@ bool lrz_aead_kdf_setup(rzip_control *control)
 	return true;
 }
 
-static void aead_next_nonce(rzip_control *control, int key_id,
+/* Compression workers seal their blocks concurrently, so the sequence
+ * counters are only ever advanced under nonce_lock. */
+static pthread_mutex_t nonce_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool aead_next_nonce(rzip_control *control, int key_id,
 			    uchar nonce[LRZ_AEAD_NONCE_LEN])
 {
 	uint64_t seq;
 	int i;
 
 	memcpy(nonce, control->aead_nonce_prefix, 4);
+	if (unlikely(!lock_mutex(control, &nonce_lock)))
+		return false;
 	if (key_id == LRZ_AEAD_KEY_HDR)
 		seq = ++control->aead_hdr_seq;
 	else
 		seq = ++control->aead_data_seq;
+	unlock_mutex(control, &nonce_lock);
 	/* seq as little-endian in nonce[4..11] */
 	for (i = 0; i < 8; i++)
 		nonce[4 + i] = (uchar)(seq >> (8 * i));
+	return true;
 }
 
 static const uchar *aead_key(const rzip_control *control, int key_id)
@@ -681,7 +967,8 @@ bool lrz_aead_seal(rzip_control *control, int key_id,
 	if (key_id != LRZ_AEAD_KEY_HDR && key_id != LRZ_AEAD_KEY_DATA)
 		return false;
 
-	aead_next_nonce(control, key_id, nonce);
+	if (unlikely(!aead_next_nonce(control, key_id, nonce)))
+		return false;
 	if (gcm_aes_encrypt(aead_key(control, key_id), 256, nonce,
 			    aad, aad_len, pt, pt_len,
 			    out + LRZ_AEAD_NONCE_LEN, tag) != 0)
@@ -694,6 +981,23 @@ bool lrz_aead_seal(rzip_control *control, int key_id,
 	return true;
 }
 
+bool lrz_aead_seal_inplace(rzip_control *control, int key_id,
+			   const uchar *aad, size_t aad_len,
+			   uchar *buf, size_t len,
+			   uchar nonce[LRZ_AEAD_NONCE_LEN],
+			   uchar tag[LRZ_AEAD_TAG_LEN])
+{
+	if (!control || !nonce || !tag || (len && !buf))
+		return false;
+	if (key_id != LRZ_AEAD_KEY_HDR && key_id != LRZ_AEAD_KEY_DATA)
+		return false;
+
+	if (unlikely(!aead_next_nonce(control, key_id, nonce)))
+		return false;
+	return gcm_aes_encrypt(aead_key(control, key_id), 256, nonce,
+			       aad, aad_len, buf, len, buf, tag) == 0;
+}
+
 bool lrz_aead_open(rzip_control *control, int key_id,
 		   const uchar *aad, size_t aad_len,
 		   const uchar *in, size_t in_len,
@@ -719,3 +1023,17 @@ bool lrz_aead_open(rzip_control *control, int key_id,
 	*pt_len = clen;
 	return true;
 }
+
+bool lrz_aead_open_inplace(rzip_control *control, int key_id,
+			   const uchar *aad, size_t aad_len,
+			   uchar *buf, size_t len,
+			   const uchar nonce[LRZ_AEAD_NONCE_LEN],
+			   const uchar tag[LRZ_AEAD_TAG_LEN])
+{
+	if (!control || !nonce || !tag || (len && !buf))
+		return false;
+	if (key_id != LRZ_AEAD_KEY_HDR && key_id != LRZ_AEAD_KEY_DATA)
+		return false;
+	return gcm_aes_decrypt(aead_key(control, key_id), 256, nonce,
+			       aad, aad_len, buf, len, tag, buf) == 0;
+}
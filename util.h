@@ -93,6 +93,13 @@ void setup_overhead(rzip_control *control);
 void setup_ram(rzip_control *control);
 void round_to_page(i64 *size);
 size_t round_up_page(rzip_control *control, size_t len);
+void md5_ring_start(rzip_control *control);
+void md5_ring_add(rzip_control *control, const uchar *buf, i64 len);
+uchar *md5_ring_space(rzip_control *control, i64 *space);
+void md5_ring_commit(rzip_control *control, i64 len);
+void md5_ring_copy(rzip_control *control, const uchar *buf, i64 len);
+void md5_ring_drain(rzip_control *control);
+void md5_ring_stop(rzip_control *control);
 bool get_rand(rzip_control *control, uchar *buf, int len);
 
 /* Safe allocation/copy length for untrusted sizes (malicious archives).
@@ -130,10 +137,24 @@ bool lrz_aead_seal(rzip_control *control, int key_id,
 		   const uchar *aad, size_t aad_len,
 		   const uchar *pt, size_t pt_len,
 		   uchar *out, size_t *out_len);
+/* Seal buf in place, returning the nonce and tag to be stored around it
+ * as nonce||ct||tag, so large payloads need no second buffer. */
+bool lrz_aead_seal_inplace(rzip_control *control, int key_id,
+			   const uchar *aad, size_t aad_len,
+			   uchar *buf, size_t len,
+			   uchar nonce[LRZ_AEAD_NONCE_LEN],
+			   uchar tag[LRZ_AEAD_TAG_LEN]);
 bool lrz_aead_open(rzip_control *control, int key_id,
 		   const uchar *aad, size_t aad_len,
 		   const uchar *in, size_t in_len,
 		   uchar *pt_out, size_t *pt_len);
+/* Verify and decrypt buf in place given its detached nonce and tag; buf is
+ * wiped if the tag does not match. */
+bool lrz_aead_open_inplace(rzip_control *control, int key_id,
+			   const uchar *aad, size_t aad_len,
+			   uchar *buf, size_t len,
+			   const uchar nonce[LRZ_AEAD_NONCE_LEN],
+			   const uchar tag[LRZ_AEAD_TAG_LEN]);
 
 /* On-disk overhead helpers for encrypt modes */
 static inline i64 lrz_enc_prefix_len(const rzip_control *control)